@@ -0,0 +1,301 @@
+#!/usr/bin/env python3
+"""End-to-end benchmark for vicpkg against a synthetic repository.
+
+Generates a vicpkg repository with --packages entries, of which the first
+--install get real archives (sizes cycle through --sizes), serves it over
+file:// or a local HTTP server, and times update, search, show, install,
+upgrade and purge. Results are written as JSON, each run with the
+per-phase wall times vicpkg reports through --trace-file.
+
+The binary must be built with VICPKG_DIR=<root>/data/vicpkg, which is what
+`make bench` does; installed files land under <root>/files.
+"""
+
+import argparse
+import gzip
+import hashlib
+import http.server
+import io
+import json
+import os
+import platform
+import random
+import shutil
+import statistics
+import subprocess
+import sys
+import tarfile
+import tempfile
+import threading
+import time
+
+WORDS = ("audio video network tool library daemon sensor camera voice robot "
+         "animation firmware driver utility python shell editor compression "
+         "crypto http json server client logger monitor cloud face").split()
+
+
+def parse_size(text):
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    text = text.strip().upper()
+    if text and text[-1] in units:
+        return int(float(text[:-1]) * units[text[-1]])
+    return int(text)
+
+
+def package_name(i):
+    return "bench-%05d" % i
+
+
+def build_archive(path, name, version, files_dir, size, rng):
+    """Writes a .vpkg holding one file of `size` random bytes."""
+    target = "%s/%s/data" % (files_dir, name)
+    buf = io.BytesIO()
+    with tarfile.open(fileobj=buf, mode="w:gz", compresslevel=1) as tar:
+        def add(member, data):
+            info = tarfile.TarInfo(member)
+            info.size = len(data)
+            info.mode = 0o644
+            tar.addfile(info, io.BytesIO(data))
+
+        add("package.info", ("Package: %s\nVersion: %s\n" %
+                             (name, version)).encode())
+        add("package.list", (target + "\n").encode())
+        add("pkg" + target, rng.randbytes(size))
+    data = buf.getvalue()
+    with open(path, "wb") as f:
+        f.write(data)
+    return len(data), hashlib.sha256(data).hexdigest()
+
+
+def write_repo(repo, args, files_dir, version, rng, when=None):
+    """Publishes `version` of every package, dated and stamped `when`."""
+    when = time.time() if when is None else when
+    os.makedirs(os.path.join(repo, "p"), exist_ok=True)
+    sizes = [parse_size(s) for s in args.sizes.split(",")]
+    stanzas = []
+
+    for i in range(args.packages):
+        name = package_name(i)
+        fields = [("Package", name), ("Version", version),
+                  ("Architecture", "vicpkg")]
+        if i < args.install:
+            size = sizes[i % len(sizes)]
+            archive = "p/%s_%s.vpkg" % (name, version)
+            length, sha = build_archive(os.path.join(repo, archive), name,
+                                        version, files_dir, size, rng)
+            fields += [("Filename", "./" + archive), ("Size", length),
+                       ("SHA256", sha), ("Installed-Size", size // 1024 + 1)]
+            if i > 0:
+                fields.append(("Depends", package_name((i - 1) // 2)))
+        else:
+            fields += [("Filename", "./p/%s.vpkg" % name), ("Size", 0)]
+        fields += [("Section", rng.choice(WORDS)),
+                   ("Name", name.replace("-", " ").title()),
+                   ("Description", " ".join(rng.sample(WORDS, 4)))]
+        stanzas.append("".join("%s: %s\n" % f for f in fields))
+
+    packages = "\n".join(stanzas).encode()
+    lists = {"Packages": packages, "Packages.gz": gzip.compress(packages, 6)}
+    release = ["Architectures: vicpkg",
+               "Date: %s" % time.strftime("%a, %d %b %Y %H:%M:%S +0000",
+                                          time.gmtime(when)),
+               "SHA256:"]
+    for fname, data in lists.items():
+        with open(os.path.join(repo, fname), "wb") as f:
+            f.write(data)
+        release.append(" %s %d %s" % (hashlib.sha256(data).hexdigest(),
+                                      len(data), fname))
+    with open(os.path.join(repo, "Release"), "w") as f:
+        f.write("\n".join(release) + "\n")
+    # Conditional requests compare whole seconds of Date and mtime.
+    for fname in list(lists) + ["Release"]:
+        os.utime(os.path.join(repo, fname), (when, when))
+
+
+class QuietHandler(http.server.SimpleHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+
+
+def serve(repo):
+    handler = lambda *a, **kw: QuietHandler(*a, directory=repo, **kw)
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server, "http://127.0.0.1:%d" % server.server_address[1]
+
+
+def read_phases(path):
+    """Sums the wall time of each span name in a vicpkg trace file."""
+    phases = {}
+    try:
+        with open(path) as f:
+            events = json.load(f)["traceEvents"]
+        os.unlink(path)
+    except (OSError, ValueError, KeyError):
+        return phases
+    for e in events:
+        phases[e["name"]] = phases.get(e["name"], 0) + e["dur"] / 1000
+    return {k: round(v, 3) for k, v in phases.items()}
+
+
+def run_once(argv, env, trace):
+    argv = argv[:1] + ["--trace-file", trace] + argv[1:]
+    # A file rather than a pipe, which a chatty run could fill while waited on.
+    with tempfile.TemporaryFile() as stderr:
+        start = time.perf_counter()
+        proc = subprocess.Popen(argv, env=env, stdout=subprocess.DEVNULL,
+                                stderr=stderr)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        stderr.seek(0)
+        err = stderr.read().decode(errors="replace")
+    return {
+        "wall_ms": round(wall * 1000, 3),
+        "user_ms": round(usage.ru_utime * 1000, 3),
+        "sys_ms": round(usage.ru_stime * 1000, 3),
+        "max_rss_kb": usage.ru_maxrss,
+        "exit": proc.returncode,
+        "stderr": err[-2000:] if proc.returncode else "",
+        "phases": read_phases(trace),
+    }
+
+
+def measure(results, step, argv, env, runs=1, setup=None, check=None):
+    """Times `argv`; `check`, when given, must confirm it did its work."""
+    samples = []
+    trace = os.path.join(tempfile.gettempdir(),
+                         "vicpkg-bench-trace.%d.json" % os.getpid())
+    for _ in range(runs):
+        if setup:
+            setup()
+        samples.append(run_once(argv, env, trace))
+    walls = [s["wall_ms"] for s in samples]
+    results.append({
+        "step": step,
+        "argv": argv[1:],
+        "runs": samples,
+        "median_ms": statistics.median(walls),
+        "min_ms": min(walls),
+        "ok": all(s["exit"] == 0 for s in samples) and (not check or check()),
+    })
+    print("  %-16s %10.1f ms%s" % (step, statistics.median(walls),
+                                    "" if results[-1]["ok"] else "  FAILED"),
+          file=sys.stderr)
+
+
+def installed_versions(binary, env):
+    out = subprocess.run([binary, "list"], env=env, capture_output=True,
+                         text=True).stdout
+    versions = {}
+    for line in out.splitlines():
+        name, _, version = line.strip().partition(" (")
+        if version.endswith(")"):
+            versions[name] = version[:-1]
+    return versions
+
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "rev-parse", "HEAD"], check=True,
+                              capture_output=True, text=True,
+                              cwd=os.path.dirname(__file__)).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--root", required=True,
+                        help="sandbox the binary was built for")
+    parser.add_argument("--binary", help="default: <root>/vicpkg")
+    parser.add_argument("--packages", type=int, default=1000)
+    parser.add_argument("--install", type=int, default=10,
+                        help="packages with real archives to install")
+    parser.add_argument("--sizes", default="4K,64K,1M",
+                        help="archive payload sizes, cycled")
+    parser.add_argument("--transport", choices=("file", "http"),
+                        default="file")
+    parser.add_argument("--runs", type=int, default=5,
+                        help="repetitions of read-only commands")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--out", help="JSON output file (default stdout)")
+    args = parser.parse_args()
+
+    root = os.path.abspath(args.root)
+    binary = args.binary or os.path.join(root, "vicpkg")
+    state = os.path.join(root, "data", "vicpkg")
+    files_dir = os.path.join(root, "files")
+    repo = os.path.join(root, "repo")
+    rng = random.Random(args.seed)
+    args.install = min(args.install, args.packages)
+
+    for d in (os.path.join(root, "data"), files_dir, repo):
+        shutil.rmtree(d, ignore_errors=True)
+    os.makedirs(state)
+
+    print("Generating %d packages (%d installable)..." %
+          (args.packages, args.install), file=sys.stderr)
+    gen_start = time.perf_counter()
+    write_repo(repo, args, files_dir, "1.0.0", rng)
+    gen_ms = (time.perf_counter() - gen_start) * 1000
+
+    server = None
+    if args.transport == "http":
+        server, url = serve(repo)
+    else:
+        url = "file://" + repo
+    with open(os.path.join(state, "repos.list"), "w") as f:
+        f.write(url + "\n")
+
+    env = dict(os.environ)
+    env["PATH"] = os.path.join(state, "bin") + ":" + env.get("PATH", "")
+    vp = [binary, "-y", "-q"]
+    installs = [package_name(i) for i in range(args.install)]
+    cache = os.path.join(state, "cache")
+    results = []
+
+    measure(results, "update-cold", vp + ["update"], env,
+            setup=lambda: shutil.rmtree(cache, ignore_errors=True))
+    measure(results, "update-warm", vp + ["update"], env, args.runs)
+    measure(results, "search", vp + ["search", WORDS[3]], env, args.runs)
+    measure(results, "show", vp + ["show", package_name(args.packages - 1)],
+            env, args.runs)
+    measure(results, "repo-list", vp + ["repo-list"], env, args.runs)
+    if installs:
+        measure(results, "install", vp + ["install"] + installs, env)
+        measure(results, "list", vp + ["list"], env, args.runs)
+        # Stamped past the first version so no conditional GET answers 304.
+        write_repo(repo, args, files_dir, "1.0.1", rng, time.time() + 2)
+        measure(results, "update-changed", vp + ["update"], env)
+        upgraded = lambda: all(installed_versions(binary, env).get(p) ==
+                               "1.0.1" for p in installs)
+        measure(results, "upgrade", vp + ["upgrade"], env, check=upgraded)
+        measure(results, "purge", vp + ["purge"] + installs[::-1], env)
+
+    if server:
+        server.shutdown()
+
+    report = {
+        "schema": 2,
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "revision": git_revision(),
+        "host": {"machine": platform.machine(), "system": platform.system(),
+                 "release": platform.release(), "cpus": os.cpu_count()},
+        "config": {"packages": args.packages, "install": args.install,
+                   "sizes": args.sizes, "transport": args.transport,
+                   "runs": args.runs, "seed": args.seed},
+        "generate_ms": round(gen_ms, 3),
+        "results": results,
+    }
+    text = json.dumps(report, indent=2) + "\n"
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+    return 0 if all(r["ok"] for r in results) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,516 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef VICPKG_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef VICPKG_HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef VICPKG_HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef VICPKG_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decomp.h"
+#include "trace.h"
+#include "vicpkg.h"
+
+#define DECODE_BUF_SIZE 65536
+
+enum { CODEC_NONE, CODEC_GZIP, CODEC_BZIP2, CODEC_XZ, CODEC_ZSTD, CODEC_AUTO };
+
+struct Decoder {
+  int codec;
+  /* Also set by the external decompressor's reader thread. */
+  _Atomic int failed;
+  int done;
+  FetchSink sink;
+  void *user;
+  char *out;
+  long long sink_us;
+
+  unsigned char sniff[6];
+  size_t sniff_len;
+
+  /* External decompressor fallback. */
+  int external;
+  pid_t pid;
+  int to_child;
+  int from_child;
+  pthread_t reader;
+  int reader_started;
+
+#ifdef VICPKG_HAVE_ZLIB
+  z_stream zs;
+#endif
+#ifdef VICPKG_HAVE_BZIP2
+  bz_stream bz;
+#endif
+#ifdef VICPKG_HAVE_LZMA
+  lzma_stream xz;
+#endif
+#ifdef VICPKG_HAVE_ZSTD
+  ZSTD_DStream *zstd;
+  size_t zstd_last;
+#endif
+};
+
+static int codec_from_name(const char *name) {
+  if (!name || strcmp(name, "none") == 0)
+    return CODEC_NONE;
+  if (strcmp(name, "gzip") == 0)
+    return CODEC_GZIP;
+  if (strcmp(name, "bzip2") == 0)
+    return CODEC_BZIP2;
+  if (strcmp(name, "xz") == 0)
+    return CODEC_XZ;
+  if (strcmp(name, "zstd") == 0)
+    return CODEC_ZSTD;
+  if (strcmp(name, "auto") == 0)
+    return CODEC_AUTO;
+  return -1;
+}
+
+const char *compression_from_magic(const unsigned char *magic, size_t len) {
+  if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    return "gzip";
+  if (len >= 2 && magic[0] == 0x42 && magic[1] == 0x5a)
+    return "bzip2";
+  if (len >= 2 && magic[0] == 0xfd && magic[1] == 0x37)
+    return "xz";
+  if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+      magic[3] == 0xfd)
+    return "zstd";
+  return "none";
+}
+
+int decoder_in_process(const char *compression) {
+  switch (codec_from_name(compression)) {
+  case CODEC_NONE:
+    return 1;
+#ifdef VICPKG_HAVE_ZLIB
+  case CODEC_GZIP:
+    return 1;
+#endif
+#ifdef VICPKG_HAVE_BZIP2
+  case CODEC_BZIP2:
+    return 1;
+#endif
+#ifdef VICPKG_HAVE_LZMA
+  case CODEC_XZ:
+    return 1;
+#endif
+#ifdef VICPKG_HAVE_ZSTD
+  case CODEC_ZSTD:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+static void *external_reader(void *arg) {
+  Decoder *d = arg;
+  char *buf = malloc(DECODE_BUF_SIZE);
+  ssize_t r;
+
+  while (buf && (r = read(d->from_child, buf, DECODE_BUF_SIZE)) != 0) {
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      d->failed = 1;
+      break;
+    }
+    if (!d->failed && !d->sink(d->user, buf, (size_t)r)) {
+      d->failed = 1;
+    }
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static int external_start(Decoder *d) {
+  static const char *commands[] = {NULL, "gzip", "bzip2", "xz", "zstd"};
+  int in[2], out[2];
+
+  if (pipe(in) != 0)
+    return 0;
+  if (pipe(out) != 0) {
+    close(in[0]);
+    close(in[1]);
+    return 0;
+  }
+
+  d->pid = fork();
+  if (d->pid > 0)
+    trace_add(TRACE_FORKS, 1);
+  if (d->pid < 0) {
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    return 0;
+  }
+
+  if (d->pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    execlp(commands[d->codec], commands[d->codec], "-dc", (char *)NULL);
+    _exit(127);
+  }
+
+  close(in[0]);
+  close(out[1]);
+  fcntl(in[1], F_SETFD, FD_CLOEXEC);
+  fcntl(out[0], F_SETFD, FD_CLOEXEC);
+  d->to_child = in[1];
+  d->from_child = out[0];
+  d->external = 1;
+
+  if (pthread_create(&d->reader, NULL, external_reader, d) != 0) {
+    close(d->to_child);
+    close(d->from_child);
+    kill(d->pid, SIGTERM);
+    waitpid(d->pid, NULL, 0);
+    d->external = 0;
+    return 0;
+  }
+  d->reader_started = 1;
+
+  if (verbose_mode) {
+    printf("[VERBOSE] Decompressing through external %s\n",
+           commands[d->codec]);
+  }
+  return 1;
+}
+
+static int codec_start(Decoder *d) {
+  switch (d->codec) {
+  case CODEC_NONE:
+    return 1;
+#ifdef VICPKG_HAVE_ZLIB
+  case CODEC_GZIP:
+    memset(&d->zs, 0, sizeof(d->zs));
+    return inflateInit2(&d->zs, 15 + 32) == Z_OK;
+#endif
+#ifdef VICPKG_HAVE_BZIP2
+  case CODEC_BZIP2:
+    memset(&d->bz, 0, sizeof(d->bz));
+    return BZ2_bzDecompressInit(&d->bz, 0, 0) == BZ_OK;
+#endif
+#ifdef VICPKG_HAVE_LZMA
+  case CODEC_XZ: {
+    lzma_stream init = LZMA_STREAM_INIT;
+    d->xz = init;
+    return lzma_stream_decoder(&d->xz, UINT64_MAX, LZMA_CONCATENATED) ==
+           LZMA_OK;
+  }
+#endif
+#ifdef VICPKG_HAVE_ZSTD
+  case CODEC_ZSTD:
+    d->zstd = ZSTD_createDStream();
+    d->zstd_last = 0;
+    return d->zstd && !ZSTD_isError(ZSTD_initDStream(d->zstd));
+#endif
+  default:
+    return external_start(d);
+  }
+}
+
+Decoder *decoder_new(const char *compression, FetchSink sink, void *user) {
+  int codec = codec_from_name(compression);
+  if (codec < 0)
+    return NULL;
+
+  Decoder *d = calloc(1, sizeof(Decoder));
+  if (!d)
+    return NULL;
+
+  d->codec = codec;
+  d->sink = sink;
+  d->user = user;
+  d->to_child = -1;
+  d->from_child = -1;
+  d->out = malloc(DECODE_BUF_SIZE);
+
+  if (!d->out || (codec != CODEC_AUTO && !codec_start(d))) {
+    free(d->out);
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+static int external_write(Decoder *d, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(d->to_child, data, len);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return 0;
+    data += w;
+    len -= w;
+  }
+  return !d->failed;
+}
+
+/* Passes output on, keeping the sink's time out of the decode time. */
+static int emit(Decoder *d, const char *data, size_t len) {
+  if (!trace_enabled)
+    return d->sink(d->user, data, len);
+
+  long long start = trace_now_us();
+  int ok = d->sink(d->user, data, len);
+  d->sink_us += trace_now_us() - start;
+  return ok;
+}
+
+static int codec_run(Decoder *d, const char *data, size_t len, int finish) {
+  if (d->external)
+    return len == 0 || external_write(d, data, len);
+
+  switch (d->codec) {
+  case CODEC_NONE:
+    return len == 0 || emit(d, data, len);
+#ifdef VICPKG_HAVE_ZLIB
+  case CODEC_GZIP:
+    d->zs.next_in = (unsigned char *)data;
+    d->zs.avail_in = (uInt)len;
+    do {
+      if (d->done) {
+        if (d->zs.avail_in == 0)
+          break;
+        /* Concatenated gzip members decode as one stream. */
+        if (inflateReset(&d->zs) != Z_OK)
+          return 0;
+        d->done = 0;
+      }
+      d->zs.next_out = (unsigned char *)d->out;
+      d->zs.avail_out = DECODE_BUF_SIZE;
+      int r = inflate(&d->zs, Z_NO_FLUSH);
+      if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+        return 0;
+      size_t produced = DECODE_BUF_SIZE - d->zs.avail_out;
+      if (produced > 0 && !emit(d, d->out, produced))
+        return 0;
+      if (r == Z_STREAM_END)
+        d->done = 1;
+      else if (r == Z_BUF_ERROR && produced == 0)
+        break;
+    } while (d->zs.avail_in > 0 || d->zs.avail_out == 0);
+    return !finish || d->done;
+#endif
+#ifdef VICPKG_HAVE_BZIP2
+  case CODEC_BZIP2:
+    d->bz.next_in = (char *)data;
+    d->bz.avail_in = (unsigned int)len;
+    do {
+      if (d->done) {
+        char *next = d->bz.next_in;
+        unsigned int avail = d->bz.avail_in;
+        if (avail == 0)
+          break;
+        BZ2_bzDecompressEnd(&d->bz);
+        memset(&d->bz, 0, sizeof(d->bz));
+        if (BZ2_bzDecompressInit(&d->bz, 0, 0) != BZ_OK)
+          return 0;
+        d->bz.next_in = next;
+        d->bz.avail_in = avail;
+        d->done = 0;
+      }
+      d->bz.next_out = d->out;
+      d->bz.avail_out = DECODE_BUF_SIZE;
+      int r = BZ2_bzDecompress(&d->bz);
+      if (r != BZ_OK && r != BZ_STREAM_END)
+        return 0;
+      size_t produced = DECODE_BUF_SIZE - d->bz.avail_out;
+      if (produced > 0 && !emit(d, d->out, produced))
+        return 0;
+      if (r == BZ_STREAM_END)
+        d->done = 1;
+      else if (produced == 0 && d->bz.avail_in == 0)
+        break;
+    } while (d->bz.avail_in > 0 || d->bz.avail_out == 0);
+    return !finish || d->done;
+#endif
+#ifdef VICPKG_HAVE_LZMA
+  case CODEC_XZ: {
+    lzma_action action = finish ? LZMA_FINISH : LZMA_RUN;
+    d->xz.next_in = (const uint8_t *)data;
+    d->xz.avail_in = len;
+    for (;;) {
+      d->xz.next_out = (uint8_t *)d->out;
+      d->xz.avail_out = DECODE_BUF_SIZE;
+      lzma_ret r = lzma_code(&d->xz, action);
+      size_t produced = DECODE_BUF_SIZE - d->xz.avail_out;
+      if (produced > 0 && !emit(d, d->out, produced))
+        return 0;
+      if (r == LZMA_STREAM_END)
+        return 1;
+      if (r != LZMA_OK)
+        return 0;
+      if (d->xz.avail_in == 0 && (!finish || produced == 0) &&
+          d->xz.avail_out != 0)
+        return !finish;
+    }
+  }
+#endif
+#ifdef VICPKG_HAVE_ZSTD
+  case CODEC_ZSTD: {
+    ZSTD_inBuffer in = {data, len, 0};
+    size_t produced = 0;
+    /* Calling without input would start a new frame, so finishing only
+     * checks that the last one was complete. */
+    while (in.pos < in.size || produced == DECODE_BUF_SIZE) {
+      ZSTD_outBuffer out = {d->out, DECODE_BUF_SIZE, 0};
+      size_t r = ZSTD_decompressStream(d->zstd, &out, &in);
+      if (ZSTD_isError(r))
+        return 0;
+      d->zstd_last = r;
+      produced = out.pos;
+      if (produced > 0 && !emit(d, d->out, produced))
+        return 0;
+    }
+    return !finish || d->zstd_last == 0;
+  }
+#endif
+  default:
+    return 0;
+  }
+}
+
+static int codec_feed(Decoder *d, const char *data, size_t len, int finish) {
+  if (!trace_enabled)
+    return codec_run(d, data, len, finish);
+
+  long long start = trace_now_us();
+  d->sink_us = 0;
+  int ok = codec_run(d, data, len, finish);
+  trace_add(TRACE_DECODE_US, trace_now_us() - start - d->sink_us);
+  return ok;
+}
+
+static int sniff_and_start(Decoder *d, int finish) {
+  const char *name = compression_from_magic(d->sniff, d->sniff_len);
+  d->codec = codec_from_name(name);
+  if (verbose_mode) {
+    printf("[VERBOSE] Detected %s stream\n", name);
+  }
+  if (!codec_start(d))
+    return 0;
+  return codec_feed(d, (const char *)d->sniff, d->sniff_len, finish);
+}
+
+int decoder_feed(Decoder *d, const char *data, size_t len) {
+  if (d->failed)
+    return 0;
+
+  if (d->codec == CODEC_AUTO) {
+    while (len > 0 && d->sniff_len < sizeof(d->sniff)) {
+      d->sniff[d->sniff_len++] = *data++;
+      len--;
+    }
+    if (d->sniff_len < sizeof(d->sniff))
+      return 1;
+    if (!sniff_and_start(d, 0)) {
+      d->failed = 1;
+      return 0;
+    }
+  }
+
+  if (len > 0 && !codec_feed(d, data, len, 0)) {
+    d->failed = 1;
+    return 0;
+  }
+  return 1;
+}
+
+int decoder_finish(Decoder *d) {
+  if (d->codec == CODEC_AUTO && !d->failed && !sniff_and_start(d, 1)) {
+    d->failed = 1;
+  } else if (!d->failed && !codec_feed(d, NULL, 0, 1)) {
+    d->failed = 1;
+  }
+
+  if (d->external) {
+    close(d->to_child);
+    d->to_child = -1;
+    if (d->reader_started) {
+      pthread_join(d->reader, NULL);
+      d->reader_started = 0;
+    }
+    close(d->from_child);
+    d->from_child = -1;
+
+    int status = 0;
+    waitpid(d->pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      d->failed = 1;
+    d->external = 0;
+  }
+
+  return !d->failed;
+}
+
+void decoder_free(Decoder *d) {
+  if (!d)
+    return;
+
+  if (d->external) {
+    close(d->to_child);
+    kill(d->pid, SIGTERM);
+    if (d->reader_started)
+      pthread_join(d->reader, NULL);
+    close(d->from_child);
+    waitpid(d->pid, NULL, 0);
+  }
+
+  switch (d->codec) {
+#ifdef VICPKG_HAVE_ZLIB
+  case CODEC_GZIP:
+    inflateEnd(&d->zs);
+    break;
+#endif
+#ifdef VICPKG_HAVE_BZIP2
+  case CODEC_BZIP2:
+    BZ2_bzDecompressEnd(&d->bz);
+    break;
+#endif
+#ifdef VICPKG_HAVE_LZMA
+  case CODEC_XZ:
+    lzma_end(&d->xz);
+    break;
+#endif
+#ifdef VICPKG_HAVE_ZSTD
+  case CODEC_ZSTD:
+    ZSTD_freeDStream(d->zstd);
+    break;
+#endif
+  default:
+    break;
+  }
+
+  free(d->out);
+  free(d);
+}
+
+int decoder_sink(void *user, const char *data, size_t len) {
+  return decoder_feed((Decoder *)user, data, len);
+}
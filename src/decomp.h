@@ -0,0 +1,26 @@
+#ifndef VICPKG_DECOMP_H
+#define VICPKG_DECOMP_H
+
+#include <stddef.h>
+
+#include "fetch.h"
+
+typedef struct Decoder Decoder;
+
+/*
+ * Push-style stream decoder. `compression` is one of "none", "gzip",
+ * "bzip2", "xz", "zstd" or "auto" (sniffed from the first bytes). Decoded
+ * output goes to `sink`. Codecs not linked in run through an external
+ * decompressor process, in which case the sink is called from a helper
+ * thread.
+ */
+Decoder *decoder_new(const char *compression, FetchSink sink, void *user);
+int decoder_feed(Decoder *d, const char *data, size_t len);
+int decoder_finish(Decoder *d);
+void decoder_free(Decoder *d);
+int decoder_sink(void *user, const char *data, size_t len);
+
+const char *compression_from_magic(const unsigned char *magic, size_t len);
+int decoder_in_process(const char *compression);
+
+#endif
@@ -0,0 +1,128 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "depends.h"
+#include "vicpkg.h"
+
+static const char *skip_space(const char *p) {
+  while (isspace((unsigned char)*p))
+    p++;
+  return p;
+}
+
+/* Bare ">" and "<" are dpkg's deprecated spellings of ">=" and "<=". */
+static int parse_op(const char **cursor) {
+  static const struct {
+    const char *text;
+    int op;
+  } ops[] = {{">=", REL_GE}, {"<=", REL_LE}, {">>", REL_GT}, {"<<", REL_LT},
+             {"==", REL_EQ}, {">", REL_GE},  {"<", REL_LE},  {"=", REL_EQ}};
+
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    size_t len = strlen(ops[i].text);
+    if (strncmp(*cursor, ops[i].text, len) == 0) {
+      *cursor += len;
+      return ops[i].op;
+    }
+  }
+  return -1;
+}
+
+static int parse_one(const char **cursor, Relation *r) {
+  const char *p = skip_space(*cursor);
+  size_t len = 0;
+
+  memset(r, 0, sizeof(*r));
+  while (p[len] && !isspace((unsigned char)p[len]) && !strchr("(,|", p[len]))
+    len++;
+  if (len == 0 || len >= sizeof(r->name))
+    return 0;
+  memcpy(r->name, p, len);
+  p = skip_space(p + len);
+
+  if (*p == '(') {
+    p = skip_space(p + 1);
+    r->op = parse_op(&p);
+    p = skip_space(p);
+    len = 0;
+    while (p[len] && p[len] != ')' && !isspace((unsigned char)p[len]))
+      len++;
+    if (r->op < 0 || len == 0 || len >= sizeof(r->version))
+      return 0;
+    memcpy(r->version, p, len);
+    p = skip_space(p + len);
+    if (*p != ')')
+      return 0;
+    p = skip_space(p + 1);
+  }
+
+  *cursor = p;
+  return 1;
+}
+
+/*
+ * Parses the next group of alternatives at *cursor into `alternatives`.
+ * Returns how many were read, 0 at the end of the field and -1 on a
+ * malformed group, which is skipped.
+ */
+int relation_parse(const char **cursor, Relation *alternatives, int max) {
+  const char *p = skip_space(*cursor);
+  int count = 0;
+
+  while (*p == ',')
+    p = skip_space(p + 1);
+  if (*p == '\0') {
+    *cursor = p;
+    return 0;
+  }
+
+  for (;;) {
+    Relation r;
+    if (!parse_one(&p, &r) || (*p && *p != ',' && *p != '|')) {
+      const char *end = strchr(p, ',');
+      *cursor = end ? end + 1 : p + strlen(p);
+      return -1;
+    }
+    if (count < max)
+      alternatives[count++] = r;
+    if (*p != '|')
+      break;
+    p++;
+  }
+
+  if (*p == ',')
+    p++;
+  *cursor = p;
+  return count;
+}
+
+int relation_satisfied(const Relation *r, const char *version) {
+  if (r->op == REL_ANY)
+    return 1;
+  if (!version || !*version)
+    return 0;
+
+  int cmp = compare_versions(version, r->version);
+  switch (r->op) {
+  case REL_LT:
+    return cmp < 0;
+  case REL_LE:
+    return cmp <= 0;
+  case REL_EQ:
+    return cmp == 0;
+  case REL_GE:
+    return cmp >= 0;
+  case REL_GT:
+    return cmp > 0;
+  }
+  return 0;
+}
+
+void relation_format(const Relation *r, char *out, size_t size) {
+  static const char *ops[] = {"", "<<", "<=", "=", ">=", ">>"};
+  if (r->op == REL_ANY)
+    snprintf(out, size, "%s", r->name);
+  else
+    snprintf(out, size, "%s (%s %s)", r->name, ops[r->op], r->version);
+}
@@ -0,0 +1,26 @@
+#ifndef VICPKG_DEPENDS_H
+#define VICPKG_DEPENDS_H
+
+#include <stddef.h>
+
+/*
+ * Package relationships as written in Depends and Conflicts fields: a comma
+ * separated list of groups, each a `|` separated list of alternatives such
+ * as "ffmpeg (>= 8.0), libfoo | libbar".
+ */
+
+#define RELATION_MAX_ALTERNATIVES 8
+
+enum { REL_ANY, REL_LT, REL_LE, REL_EQ, REL_GE, REL_GT };
+
+typedef struct {
+  char name[256];
+  int op;
+  char version[64];
+} Relation;
+
+int relation_parse(const char **cursor, Relation *alternatives, int max);
+int relation_satisfied(const Relation *r, const char *version);
+void relation_format(const Relation *r, char *out, size_t size);
+
+#endif
@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "decomp.h"
+#include "extract.h"
+#include "fetch.h"
+#include "fsutil.h"
+#include "journal.h"
+#include "tar.h"
+#include "trace.h"
+#include "vicpkg.h"
+
+#define EXTRACT_META_MAX (1024 * 1024)
+#define CLAIM_BUCKETS 1024
+
+struct Extractor {
+  char root[MAX_PATH];
+  Decoder *decoder;
+  TarReader *tar;
+  int failed;
+  ExtractCheck check;
+  void *check_user;
+  ExtractDone done;
+  void *done_user;
+  int flat;
+
+  int fd;
+  char target[MAX_PATH];
+  char type;
+  FetchBuffer *capture;
+  char last_parent[MAX_PATH];
+  int files;
+
+  /* Final paths whose contents sit at path + STAGED_SUFFIX until commit. */
+  char **staged;
+  int staged_count;
+  int staged_cap;
+  Journal *journal;
+
+  FetchBuffer package_list;
+  FetchBuffer package_info;
+};
+
+/*
+ * Targets being staged by live extractors in this process, so that two
+ * packages unpacking the same path at once cannot trample each other.
+ */
+typedef struct Claim {
+  struct Claim *next;
+  const Extractor *owner;
+  char path[];
+} Claim;
+
+static Claim *claims[CLAIM_BUCKETS];
+static pthread_mutex_t claims_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned claim_bucket(const char *path) {
+  unsigned h = 2166136261u;
+  while (*path) {
+    h ^= (unsigned char)*path++;
+    h *= 16777619u;
+  }
+  return h & (CLAIM_BUCKETS - 1);
+}
+
+static int claim_target(const Extractor *x, const char *path) {
+  unsigned b = claim_bucket(path);
+  int ok = 1;
+
+  pthread_mutex_lock(&claims_lock);
+  Claim *c = claims[b];
+  while (c && strcmp(c->path, path) != 0)
+    c = c->next;
+  if (c) {
+    ok = c->owner == x;
+  } else {
+    c = malloc(sizeof(Claim) + strlen(path) + 1);
+    if (c) {
+      strcpy(c->path, path);
+      c->owner = x;
+      c->next = claims[b];
+      claims[b] = c;
+    }
+  }
+  pthread_mutex_unlock(&claims_lock);
+  return ok;
+}
+
+static void release_claims(const Extractor *x) {
+  pthread_mutex_lock(&claims_lock);
+  for (int b = 0; b < CLAIM_BUCKETS; b++) {
+    Claim **link = &claims[b];
+    while (*link) {
+      Claim *c = *link;
+      if (c->owner == x) {
+        *link = c->next;
+        free(c);
+      } else {
+        link = &c->next;
+      }
+    }
+  }
+  pthread_mutex_unlock(&claims_lock);
+}
+
+/* Strips "./" and leading slashes; rejects paths that climb out with "..". */
+static const char *clean_member_path(const char *path) {
+  for (;;) {
+    if (path[0] == '.' && path[1] == '/')
+      path += 2;
+    else if (path[0] == '/')
+      path++;
+    else
+      break;
+  }
+
+  const char *p = path;
+  while (*p) {
+    if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+      return NULL;
+    const char *slash = strchr(p, '/');
+    if (!slash)
+      break;
+    p = slash + 1;
+  }
+  return path;
+}
+
+static int target_path(const Extractor *x, const char *member, char *out,
+                       size_t size) {
+  const char *path = clean_member_path(member);
+  if (!path || (!x->flat && strncmp(path, "pkg/", 4) != 0))
+    return 0;
+
+  if (!x->flat)
+    path += 4;
+  else if (!path[0])
+    return 0;
+  size_t root_len = strlen(x->root);
+  const char *sep = root_len > 0 && x->root[root_len - 1] == '/' ? "" : "/";
+  int n = snprintf(out, size, "%s%s%s", x->root, sep, path);
+  if (n < 0 || (size_t)n >= size)
+    return 0;
+
+  size_t len = strlen(out);
+  while (len > 1 && out[len - 1] == '/')
+    out[--len] = '\0';
+  return path[0] != '\0';
+}
+
+static int make_parent(Extractor *x, const char *path) {
+  char parent[MAX_PATH];
+  snprintf(parent, sizeof(parent), "%s", path);
+
+  char *slash = strrchr(parent, '/');
+  if (!slash || slash == parent)
+    return 1;
+  *slash = '\0';
+
+  if (strcmp(parent, x->last_parent) == 0)
+    return 1;
+  if (!fs_make_dirs(parent, 0755))
+    return 0;
+  snprintf(x->last_parent, sizeof(x->last_parent), "%s", parent);
+  return 1;
+}
+
+static int find_staged(const Extractor *x, const char *path) {
+  for (int i = x->staged_count - 1; i >= 0; i--) {
+    if (strcmp(x->staged[i], path) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static int add_staged(Extractor *x, const char *path) {
+  if (x->staged_count == x->staged_cap) {
+    int cap = x->staged_cap ? x->staged_cap * 2 : 64;
+    char **staged = realloc(x->staged, cap * sizeof(char *));
+    if (!staged)
+      return 0;
+    x->staged = staged;
+    x->staged_cap = cap;
+  }
+  char *copy = strdup(path);
+  if (!copy)
+    return 0;
+  x->staged[x->staged_count++] = copy;
+  return 1;
+}
+
+static int staged_path(const char *path, char *out, size_t size) {
+  return snprintf(out, size, "%s" STAGED_SUFFIX, path) < (int)size;
+}
+
+/*
+ * Makes room for the staged copy of `path`. A leftover from an interrupted
+ * run, or an earlier member of this archive with the same name, is replaced.
+ */
+static int prepare_staged(Extractor *x, const char *path, char *staged,
+                          size_t size) {
+  if (x->flat) {
+    snprintf(staged, size, "%s", path);
+    return unlink(staged) == 0 || errno == ENOENT;
+  }
+
+  if (!staged_path(path, staged, size)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  if (unlink(staged) == 0) {
+    if (find_staged(x, path) >= 0)
+      return 1;
+  } else if (errno != ENOENT) {
+    return 0;
+  }
+
+  /* Journaled before it exists, so a crash cannot leave it behind. */
+  if (x->journal && !journal_add(x->journal, path))
+    return 0;
+  return add_staged(x, path);
+}
+
+static int open_staged(Extractor *x, const char *path, mode_t mode) {
+  char staged[MAX_PATH];
+  if (!prepare_staged(x, path, staged, sizeof(staged)))
+    return -1;
+
+  int fd = open(staged, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    fchmod(fd, mode & 07777);
+  return fd;
+}
+
+static int entry_begin(void *user, const TarEntry *entry) {
+  Extractor *x = user;
+  const char *member = clean_member_path(entry->path);
+
+  x->capture = NULL;
+  x->fd = -1;
+  x->type = 0;
+
+  if (x->flat) {
+    /* No metadata members and nothing to stage into a fresh directory. */
+  } else if (member && strcmp(member, "package.list") == 0) {
+    x->capture = &x->package_list;
+    x->package_list.len = 0;
+    if (x->package_list.data)
+      x->package_list.data[0] = '\0';
+    return 1;
+  } else if (member && strcmp(member, "package.info") == 0) {
+    x->capture = &x->package_info;
+    x->package_info.len = 0;
+    if (x->package_info.data)
+      x->package_info.data[0] = '\0';
+    return 1;
+  }
+
+  if (!target_path(x, entry->path, x->target, sizeof(x->target)))
+    return 1;
+
+  if (verbose_mode) {
+    printf("[VERBOSE] Extracting %s\n", x->target);
+  }
+
+  if (entry->type != TAR_DIRECTORY && x->check &&
+      !x->check(x->check_user, x->target))
+    return 0;
+
+  if (!x->flat &&
+      (entry->type == TAR_FILE || entry->type == TAR_SYMLINK ||
+       entry->type == TAR_HARDLINK) &&
+      !claim_target(x, x->target)) {
+    fprintf(stderr, "Failed to extract %s: another package is installing it\n",
+            x->target);
+    return 0;
+  }
+
+  switch (entry->type) {
+  case TAR_DIRECTORY:
+    if (fs_make_dirs(x->target, entry->mode & 07777)) {
+      x->type = entry->type;
+      return 1;
+    }
+    break;
+
+  case TAR_FILE:
+    if (!make_parent(x, x->target))
+      break;
+    x->fd = open_staged(x, x->target, entry->mode);
+    if (x->fd >= 0) {
+      x->files++;
+      x->type = entry->type;
+      return 1;
+    }
+    break;
+
+  case TAR_SYMLINK: {
+    char staged[MAX_PATH];
+    if (!make_parent(x, x->target) ||
+        !prepare_staged(x, x->target, staged, sizeof(staged)))
+      break;
+    if (symlink(entry->linkname, staged) == 0) {
+      x->type = entry->type;
+      return 1;
+    }
+    break;
+  }
+
+  case TAR_HARDLINK: {
+    char source[MAX_PATH], staged[MAX_PATH];
+    if (!target_path(x, entry->linkname, source, sizeof(source))) {
+      errno = EINVAL;
+      break;
+    }
+    char staged_source[MAX_PATH];
+    if (staged_path(source, staged_source, sizeof(staged_source)) &&
+        access(staged_source, F_OK) == 0)
+      snprintf(source, sizeof(source), "%s", staged_source);
+    if (!make_parent(x, x->target) ||
+        !prepare_staged(x, x->target, staged, sizeof(staged)))
+      break;
+    if (link(source, staged) == 0) {
+      x->type = entry->type;
+      return 1;
+    }
+    break;
+  }
+
+  default:
+    /* Device nodes and FIFOs have no place in a package. */
+    return 1;
+  }
+
+  fprintf(stderr, "Failed to extract %s: %s\n", x->target, strerror(errno));
+  return 0;
+}
+
+static int entry_data(void *user, const char *data, size_t len) {
+  Extractor *x = user;
+
+  if (x->capture) {
+    if (x->capture->len + len > EXTRACT_META_MAX)
+      return 0;
+    return fetch_buffer_sink(x->capture, data, len);
+  }
+
+  while (x->fd >= 0 && len > 0) {
+    ssize_t w = write(x->fd, data, len);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      fprintf(stderr, "Failed to write %s: %s\n", x->target, strerror(errno));
+      return 0;
+    }
+    trace_add(TRACE_BYTES_OUT, w);
+    data += w;
+    len -= w;
+  }
+  return 1;
+}
+
+static int entry_end(void *user) {
+  Extractor *x = user;
+  int ok = 1;
+
+  if (x->fd >= 0) {
+    if (close(x->fd) != 0) {
+      fprintf(stderr, "Failed to write %s: %s\n", x->target, strerror(errno));
+      ok = 0;
+    }
+    x->fd = -1;
+  }
+  x->capture = NULL;
+
+  if (ok && x->type && x->done)
+    x->done(x->done_user, x->target, x->type);
+  x->type = 0;
+  return ok;
+}
+
+static const TarCallbacks extract_callbacks = {entry_begin, entry_data,
+                                               entry_end};
+
+Extractor *extractor_new(const char *root, const char *compression) {
+  Extractor *x = calloc(1, sizeof(Extractor));
+  if (!x)
+    return NULL;
+
+  snprintf(x->root, sizeof(x->root), "%s", root);
+  x->fd = -1;
+  x->tar = tar_reader_new(&extract_callbacks, x);
+  x->decoder = x->tar ? decoder_new(compression, tar_reader_sink, x->tar) : NULL;
+
+  if (!x->decoder) {
+    tar_reader_free(x->tar);
+    free(x);
+    return NULL;
+  }
+  return x;
+}
+
+void extractor_set_check(Extractor *x, ExtractCheck check, void *user) {
+  x->check = check;
+  x->check_user = user;
+}
+
+void extractor_set_done(Extractor *x, ExtractDone done, void *user) {
+  x->done = done;
+  x->done_user = user;
+}
+
+void extractor_set_flat(Extractor *x) { x->flat = 1; }
+
+void extractor_set_journal(Extractor *x, Journal *journal) {
+  x->journal = journal;
+}
+
+int extractor_feed(Extractor *x, const char *data, size_t len) {
+  if (x->failed || !decoder_feed(x->decoder, data, len)) {
+    x->failed = 1;
+    return 0;
+  }
+  return 1;
+}
+
+int extractor_sink(void *user, const char *data, size_t len) {
+  return extractor_feed((Extractor *)user, data, len);
+}
+
+int extractor_finish(Extractor *x) {
+  int ok = decoder_finish(x->decoder) && !x->failed &&
+           tar_reader_finish(x->tar);
+
+  if (x->fd >= 0) {
+    close(x->fd);
+    x->fd = -1;
+  }
+
+  if (verbose_mode) {
+    printf("[VERBOSE] Extracted %d files\n", x->files);
+  }
+  return ok;
+}
+
+/* Stages `path` with the given contents, to be committed with the package. */
+int extractor_stage_file(Extractor *x, const char *path, const char *data,
+                         size_t len) {
+  int fd = open_staged(x, path, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+
+  snprintf(x->target, sizeof(x->target), "%s", path);
+  x->capture = NULL;
+  x->fd = fd;
+  return entry_data(x, data, len) && entry_end(x);
+}
+
+/*
+ * Renames every staged file into place. With a journal the caller has
+ * written its commit record first, so a commit that fails part-way is left
+ * for journal_recover() to complete.
+ */
+int extractor_commit(Extractor *x) {
+  int ok = 1;
+  for (int i = 0; i < x->staged_count; i++) {
+    char staged[MAX_PATH];
+    if (!staged_path(x->staged[i], staged, sizeof(staged)) ||
+        rename(staged, x->staged[i]) != 0) {
+      fprintf(stderr, "Failed to install %s: %s\n", x->staged[i],
+              strerror(errno));
+      if (!x->journal)
+        unlink(staged);
+      ok = 0;
+    }
+    free(x->staged[i]);
+  }
+  x->staged_count = 0;
+  release_claims(x);
+  return ok;
+}
+
+void extractor_abort(Extractor *x) {
+  for (int i = 0; i < x->staged_count; i++) {
+    char staged[MAX_PATH];
+    if (staged_path(x->staged[i], staged, sizeof(staged)))
+      unlink(staged);
+    free(x->staged[i]);
+  }
+  x->staged_count = 0;
+  release_claims(x);
+}
+
+const char *extractor_package_list(const Extractor *x) {
+  return x->package_list.data ? x->package_list.data : "";
+}
+
+const char *extractor_package_info(const Extractor *x) {
+  return x->package_info.data ? x->package_info.data : "";
+}
+
+void extractor_free(Extractor *x) {
+  if (!x)
+    return;
+  if (x->fd >= 0)
+    close(x->fd);
+  extractor_abort(x);
+  free(x->staged);
+  decoder_free(x->decoder);
+  tar_reader_free(x->tar);
+  fetch_buffer_free(&x->package_list);
+  fetch_buffer_free(&x->package_info);
+  free(x);
+}
@@ -0,0 +1,53 @@
+#ifndef VICPKG_EXTRACT_H
+#define VICPKG_EXTRACT_H
+
+#include <stddef.h>
+
+#include "journal.h"
+
+typedef struct Extractor Extractor;
+
+/*
+ * Unpacks a .vpkg stream in one pass. Members under pkg/ are written next to
+ * their final paths below `root` and only renamed into place by
+ * extractor_commit(), so a stream that fails to finish or verify leaves the
+ * installed files untouched. package.list and package.info are kept in
+ * memory. `compression` is passed to the stream decoder.
+ */
+Extractor *extractor_new(const char *root, const char *compression);
+
+/* Called with each non-directory target before it is staged; 0 aborts. */
+typedef int (*ExtractCheck)(void *user, const char *path);
+void extractor_set_check(Extractor *x, ExtractCheck check, void *user);
+
+/* Called with each member's path and tar type once it has been written. */
+typedef void (*ExtractDone)(void *user, const char *path, char type);
+void extractor_set_done(Extractor *x, ExtractDone done, void *user);
+
+/*
+ * Flat layout for legacy archives, which are unpacked into a directory of
+ * their own: every member maps straight below `root`, none is metadata,
+ * and files are written in place rather than staged for commit.
+ */
+void extractor_set_flat(Extractor *x);
+
+/*
+ * Records each target in `journal` as it is staged, so that staged files
+ * left by a crash are rolled back at the next start. The journal may be
+ * shared by the packages of one transaction; its owner commits it before
+ * calling extractor_commit(). Call before feeding any data.
+ */
+void extractor_set_journal(Extractor *x, Journal *journal);
+
+int extractor_feed(Extractor *x, const char *data, size_t len);
+int extractor_sink(void *user, const char *data, size_t len);
+int extractor_finish(Extractor *x);
+int extractor_stage_file(Extractor *x, const char *path, const char *data,
+                         size_t len);
+int extractor_commit(Extractor *x);
+void extractor_abort(Extractor *x);
+const char *extractor_package_list(const Extractor *x);
+const char *extractor_package_info(const Extractor *x);
+void extractor_free(Extractor *x);
+
+#endif
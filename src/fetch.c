@@ -0,0 +1,1270 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef VICPKG_HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "fetch.h"
+#include "trace.h"
+#include "vicpkg.h"
+
+#define FETCH_MAX_BACKENDS 8
+#define FETCH_POOL_SIZE 8
+#define FETCH_MAX_REDIRECTS 5
+#define FETCH_BUF_SIZE 16384
+#define FETCH_MAX_URL 2048
+#define FETCH_CONNECT_TIMEOUT_MS 15000
+#define FETCH_IO_TIMEOUT_MS 30000
+#define FETCH_DRAIN_LIMIT 65536
+
+typedef struct {
+  char scheme[16];
+  char host[256];
+  int port;
+  char path[FETCH_MAX_URL];
+} FetchURL;
+
+typedef struct {
+  int fd;
+  int tls;
+  char host[256];
+  int port;
+  int timeout_ms;
+  long long deadline;
+#ifdef VICPKG_HAVE_OPENSSL
+  SSL *ssl;
+#endif
+  char buf[FETCH_BUF_SIZE];
+  size_t pos;
+  size_t len;
+} FetchConn;
+
+static const FetchBackend *backends[FETCH_MAX_BACKENDS];
+static int backend_count = 0;
+static pthread_once_t fetch_once = PTHREAD_ONCE_INIT;
+
+static FetchConn *pool[FETCH_POOL_SIZE];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef VICPKG_HAVE_OPENSSL
+static SSL_CTX *ssl_ctx = NULL;
+/* Loading the CA bundle is slow; only https transfers pay for it. */
+static pthread_once_t ssl_once = PTHREAD_ONCE_INIT;
+#endif
+
+static int parse_url(const char *url, FetchURL *u) {
+  memset(u, 0, sizeof(*u));
+
+  const char *sep = strstr(url, "://");
+  if (!sep || (size_t)(sep - url) >= sizeof(u->scheme))
+    return 0;
+
+  for (size_t i = 0; url + i < sep; i++) {
+    u->scheme[i] = tolower((unsigned char)url[i]);
+  }
+
+  const char *host = sep + 3;
+  const char *path = host + strcspn(host, "/?");
+  const char *host_end = path;
+  const char *port = NULL;
+
+  if (*host == '[') {
+    const char *close = memchr(host, ']', path - host);
+    if (!close)
+      return 0;
+    host++;
+    host_end = close;
+    if (close + 1 < path && close[1] == ':')
+      port = close + 2;
+  } else {
+    const char *colon = memchr(host, ':', path - host);
+    if (colon) {
+      host_end = colon;
+      port = colon + 1;
+    }
+  }
+
+  if (host_end == host || (size_t)(host_end - host) >= sizeof(u->host))
+    return 0;
+  memcpy(u->host, host, host_end - host);
+
+  if (port) {
+    u->port = atoi(port);
+  } else if (strcmp(u->scheme, "https") == 0) {
+    u->port = 443;
+  } else {
+    u->port = 80;
+  }
+
+  if (*path == '\0') {
+    strcpy(u->path, "/");
+  } else if (*path == '?') {
+    snprintf(u->path, sizeof(u->path), "/%s", path);
+  } else {
+    snprintf(u->path, sizeof(u->path), "%s", path);
+  }
+
+  return u->port > 0;
+}
+
+/* Returns 0 when the resolved URL does not fit in `size`. */
+static int resolve_location(const FetchURL *base, const char *location,
+                            char *out, size_t size) {
+  int n;
+  if (strstr(location, "://")) {
+    n = snprintf(out, size, "%s", location);
+    return n >= 0 && n < (int)size;
+  }
+
+  const char *host_fmt = strchr(base->host, ':') ? "[%s]" : "%s";
+  char host[300];
+  snprintf(host, sizeof(host), host_fmt, base->host);
+
+  if (location[0] == '/' && location[1] == '/') {
+    n = snprintf(out, size, "%s:%s", base->scheme, location);
+  } else if (location[0] == '/') {
+    n = snprintf(out, size, "%s://%s:%d%s", base->scheme, host, base->port,
+                 location);
+  } else {
+    char dir[FETCH_MAX_URL];
+    snprintf(dir, sizeof(dir), "%s", base->path);
+    char *q = strchr(dir, '?');
+    if (q)
+      *q = '\0';
+    char *slash = strrchr(dir, '/');
+    if (slash)
+      slash[1] = '\0';
+    n = snprintf(out, size, "%s://%s:%d%s%s", base->scheme, host, base->port,
+                 dir, location);
+  }
+  return n >= 0 && n < (int)size;
+}
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Shortens `timeout_ms` to what is left until `deadline` (0 for none). */
+static int remaining_ms(int timeout_ms, long long deadline) {
+  if (!deadline)
+    return timeout_ms;
+  long long left = deadline - now_ms();
+  if (left <= 0)
+    return 0;
+  return left < timeout_ms ? (int)left : timeout_ms;
+}
+
+/*
+ * getaddrinfo() takes no timeout, so a name is looked up on a thread of its
+ * own that is abandoned when it takes too long. The Lookup is shared with
+ * that thread, which only ever touches this, and freed by whichever of the
+ * two lets go of it last.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int refs;
+  int finished;
+  int rc;
+  char host[256];
+  char port[16];
+  struct addrinfo *res;
+} Lookup;
+
+static void lookup_release(Lookup *l) {
+  pthread_mutex_lock(&l->lock);
+  int last = --l->refs == 0;
+  pthread_mutex_unlock(&l->lock);
+  if (!last)
+    return;
+
+  if (l->res)
+    freeaddrinfo(l->res);
+  pthread_cond_destroy(&l->done);
+  pthread_mutex_destroy(&l->lock);
+  free(l);
+}
+
+static void *lookup_thread(void *arg) {
+  Lookup *l = arg;
+  struct addrinfo hints, *res = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo(l->host, l->port, &hints, &res);
+
+  pthread_mutex_lock(&l->lock);
+  l->rc = rc;
+  l->res = res;
+  l->finished = 1;
+  pthread_cond_signal(&l->done);
+  pthread_mutex_unlock(&l->lock);
+  lookup_release(l);
+  return NULL;
+}
+
+static int resolve_host(const char *host, const char *port, int timeout_ms,
+                        struct addrinfo **res) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST;
+  if (getaddrinfo(host, port, &hints, res) == 0)
+    return 1;
+  hints.ai_flags = 0;
+
+  Lookup *l = calloc(1, sizeof(Lookup));
+  if (!l)
+    return getaddrinfo(host, port, &hints, res) == 0;
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->done, NULL);
+  l->refs = 2;
+  snprintf(l->host, sizeof(l->host), "%s", host);
+  snprintf(l->port, sizeof(l->port), "%s", port);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, lookup_thread, l) != 0) {
+    l->refs = 1;
+    lookup_release(l);
+    return getaddrinfo(host, port, &hints, res) == 0;
+  }
+  pthread_detach(thread);
+
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += timeout_ms / 1000;
+  until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (until.tv_nsec >= 1000000000L) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&l->lock);
+  while (!l->finished &&
+         pthread_cond_timedwait(&l->done, &l->lock, &until) != ETIMEDOUT)
+    ;
+  int ok = l->finished && l->rc == 0;
+  if (ok) {
+    *res = l->res;
+    l->res = NULL;
+  }
+  pthread_mutex_unlock(&l->lock);
+  lookup_release(l);
+  return ok;
+}
+
+static int tcp_connect(const char *host, int port, int timeout_ms) {
+  struct addrinfo *res, *ai;
+  char port_str[16];
+
+  snprintf(port_str, sizeof(port_str), "%d", port);
+
+  if (!resolve_host(host, port_str, timeout_ms, &res)) {
+    if (verbose_mode) {
+      printf("[VERBOSE] Could not resolve %s\n", host);
+    }
+    return -1;
+  }
+
+  int fd = -1;
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    int ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+    if (!ok && errno == EINPROGRESS) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (poll(&pfd, 1, timeout_ms) == 1 &&
+          getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+        ok = 1;
+      }
+    }
+
+    if (ok) {
+      fcntl(fd, F_SETFL, flags);
+      break;
+    }
+
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd < 0)
+    return -1;
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+static void conn_set_timeout(FetchConn *c, int timeout_ms) {
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void conn_close(FetchConn *c) {
+  if (!c)
+    return;
+#ifdef VICPKG_HAVE_OPENSSL
+  if (c->ssl) {
+    SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+  }
+#endif
+  if (c->fd >= 0)
+    close(c->fd);
+  free(c);
+}
+
+#ifdef VICPKG_HAVE_OPENSSL
+static void ssl_init(void) {
+  SSL_library_init();
+  SSL_load_error_strings();
+
+  ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  if (!ssl_ctx)
+    return;
+
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+  SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+  SSL_CTX_set_default_verify_paths(ssl_ctx);
+  if (access("/etc/ssl/certs/ca-certificates.crt", R_OK) == 0) {
+    SSL_CTX_load_verify_locations(ssl_ctx, "/etc/ssl/certs/ca-certificates.crt",
+                                  NULL);
+  }
+}
+
+static int conn_start_tls(FetchConn *c) {
+  pthread_once(&ssl_once, ssl_init);
+  if (!ssl_ctx)
+    return 0;
+
+  c->ssl = SSL_new(ssl_ctx);
+  if (!c->ssl)
+    return 0;
+
+  SSL_set_fd(c->ssl, c->fd);
+  SSL_set_tlsext_host_name(c->ssl, c->host);
+  /* Without this any certificate the CAs trust would do, for any host. */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  if (SSL_set1_host(c->ssl, c->host) != 1)
+    return 0;
+#elif OPENSSL_VERSION_NUMBER >= 0x10002000L
+  if (X509_VERIFY_PARAM_set1_host(SSL_get0_param(c->ssl), c->host, 0) != 1)
+    return 0;
+#else
+#error "OpenSSL 1.0.2 or newer is needed to check server host names"
+#endif
+
+  if (SSL_connect(c->ssl) != 1) {
+    if (verbose_mode) {
+      printf("[VERBOSE] TLS handshake with %s failed: %s\n", c->host,
+             ERR_error_string(ERR_get_error(), NULL));
+    }
+    return 0;
+  }
+  return 1;
+}
+#endif
+
+static FetchConn *conn_open(const FetchURL *u, int timeout_ms,
+                            long long deadline) {
+  int tls = strcmp(u->scheme, "https") == 0;
+#ifndef VICPKG_HAVE_OPENSSL
+  if (tls)
+    return NULL;
+#endif
+
+  int connect_timeout = remaining_ms(timeout_ms < FETCH_CONNECT_TIMEOUT_MS
+                                         ? timeout_ms
+                                         : FETCH_CONNECT_TIMEOUT_MS,
+                                     deadline);
+  if (connect_timeout <= 0)
+    return NULL;
+  int fd = tcp_connect(u->host, u->port, connect_timeout);
+  if (fd < 0)
+    return NULL;
+
+  FetchConn *c = calloc(1, sizeof(FetchConn));
+  if (!c) {
+    close(fd);
+    return NULL;
+  }
+  c->fd = fd;
+  c->tls = tls;
+  c->port = u->port;
+  c->timeout_ms = timeout_ms;
+  c->deadline = deadline;
+  snprintf(c->host, sizeof(c->host), "%s", u->host);
+  conn_set_timeout(c, remaining_ms(timeout_ms, deadline));
+
+#ifdef VICPKG_HAVE_OPENSSL
+  if (tls && !conn_start_tls(c)) {
+    conn_close(c);
+    return NULL;
+  }
+#endif
+
+  if (verbose_mode) {
+    printf("[VERBOSE] Connected to %s:%d%s\n", u->host, u->port,
+           tls ? " (TLS)" : "");
+  }
+  return c;
+}
+
+static FetchConn *conn_acquire(const FetchURL *u, int timeout_ms,
+                               long long deadline, int *reused) {
+  int tls = strcmp(u->scheme, "https") == 0;
+  FetchConn *c = NULL;
+
+  pthread_mutex_lock(&pool_lock);
+  for (int i = 0; i < FETCH_POOL_SIZE; i++) {
+    if (pool[i] && pool[i]->tls == tls && pool[i]->port == u->port &&
+        strcasecmp(pool[i]->host, u->host) == 0) {
+      c = pool[i];
+      pool[i] = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (c) {
+    *reused = 1;
+    c->timeout_ms = timeout_ms;
+    c->deadline = deadline;
+    conn_set_timeout(c, remaining_ms(timeout_ms, deadline));
+    return c;
+  }
+
+  *reused = 0;
+  return conn_open(u, timeout_ms, deadline);
+}
+
+static void conn_release(FetchConn *c, int keep_alive) {
+  if (!keep_alive || c->pos != c->len) {
+    conn_close(c);
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  for (int i = 0; i < FETCH_POOL_SIZE; i++) {
+    if (!pool[i]) {
+      pool[i] = c;
+      c = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  conn_close(c);
+}
+
+static ssize_t conn_recv(FetchConn *c, char *out, size_t n) {
+#ifdef VICPKG_HAVE_OPENSSL
+  if (c->tls) {
+    int r = SSL_read(c->ssl, out, (int)n);
+    if (r > 0)
+      return r;
+    return SSL_get_error(c->ssl, r) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+  }
+#endif
+  ssize_t r;
+  do {
+    r = recv(c->fd, out, n, 0);
+  } while (r < 0 && errno == EINTR);
+  return r;
+}
+
+static int conn_write_all(FetchConn *c, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t w;
+#ifdef VICPKG_HAVE_OPENSSL
+    if (c->tls) {
+      w = SSL_write(c->ssl, data, (int)len);
+      if (w <= 0)
+        return 0;
+    } else
+#endif
+    {
+      w = send(c->fd, data, len, MSG_NOSIGNAL);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        return 0;
+    }
+    data += w;
+    len -= w;
+  }
+  return 1;
+}
+
+/* Returns 1 with data buffered, 0 at a clean EOF and -1 on an error. */
+static int conn_fill(FetchConn *c) {
+  if (c->pos < c->len)
+    return 1;
+  if (c->deadline) {
+    int left = remaining_ms(c->timeout_ms, c->deadline);
+    if (left <= 0)
+      return -1;
+    conn_set_timeout(c, left);
+  }
+  ssize_t r = conn_recv(c, c->buf, sizeof(c->buf));
+  if (r <= 0)
+    return r == 0 ? 0 : -1;
+  c->pos = 0;
+  c->len = r;
+  return 1;
+}
+
+static int conn_read_line(FetchConn *c, char *line, size_t size) {
+  size_t n = 0;
+  for (;;) {
+    if (conn_fill(c) <= 0)
+      return 0;
+    char ch = c->buf[c->pos++];
+    if (ch == '\n')
+      break;
+    if (n + 1 < size)
+      line[n++] = ch;
+  }
+  if (n > 0 && line[n - 1] == '\r')
+    n--;
+  line[n] = '\0';
+  return 1;
+}
+
+/*
+ * Streams `len` body bytes (or until EOF when len < 0). A NULL sink drains.
+ * Only a clean EOF ends a body of unknown length; a timeout or reset means
+ * it was cut short.
+ */
+static int conn_read_body(FetchConn *c, long long len, FetchSink sink,
+                          void *user, long long *bytes) {
+  while (len != 0) {
+    int filled = conn_fill(c);
+    if (filled <= 0)
+      return len < 0 && filled == 0;
+
+    size_t avail = c->len - c->pos;
+    if (len > 0 && (long long)avail > len)
+      avail = (size_t)len;
+
+    if (sink && !sink(user, c->buf + c->pos, avail))
+      return 0;
+
+    c->pos += avail;
+    *bytes += avail;
+    if (len > 0)
+      len -= avail;
+  }
+  return 1;
+}
+
+static int conn_read_chunked(FetchConn *c, FetchSink sink, void *user,
+                             long long *bytes) {
+  char line[256];
+  for (;;) {
+    if (!conn_read_line(c, line, sizeof(line)))
+      return 0;
+
+    long long chunk = strtoll(line, NULL, 16);
+    if (chunk < 0)
+      return 0;
+
+    if (chunk == 0) {
+      do {
+        if (!conn_read_line(c, line, sizeof(line)))
+          return 0;
+      } while (line[0] != '\0');
+      return 1;
+    }
+
+    if (!conn_read_body(c, chunk, sink, user, bytes))
+      return 0;
+    if (!conn_read_line(c, line, sizeof(line)))
+      return 0;
+  }
+}
+
+static void copy_header_value(char *dst, size_t size, const char *value) {
+  while (isspace((unsigned char)*value))
+    value++;
+  snprintf(dst, size, "%s", value);
+  trim_string(dst);
+}
+
+/* Formats the byte range of `opts` as "start-last" or "start-". */
+static void format_range(const FetchOptions *opts, char *out, size_t size) {
+  if (opts->range_end > 0)
+    snprintf(out, size, "%lld-%lld", opts->range_start, opts->range_end - 1);
+  else
+    snprintf(out, size, "%lld-", opts->range_start);
+}
+
+enum { HTTP_FAILED = 0, HTTP_DONE = 1, HTTP_REDIRECT = 2 };
+
+static int http_request_once(const FetchURL *u, const FetchOptions *opts,
+                             long long deadline, FetchSink sink, void *user,
+                             FetchResponse *resp, char *location,
+                             size_t location_size) {
+  int timeout_ms = (opts && opts->timeout_ms > 0) ? opts->timeout_ms
+                                                  : FETCH_IO_TIMEOUT_MS;
+  int head_only = opts && opts->head_only;
+
+  char host_header[300];
+  int default_port = (strcmp(u->scheme, "https") == 0) ? 443 : 80;
+  const char *host_fmt = strchr(u->host, ':') ? "[%s]" : "%s";
+  snprintf(host_header, sizeof(host_header), host_fmt, u->host);
+  if (u->port != default_port) {
+    size_t hl = strlen(host_header);
+    snprintf(host_header + hl, sizeof(host_header) - hl, ":%d", u->port);
+  }
+
+  char request[FETCH_MAX_URL + 1024];
+  int n = snprintf(request, sizeof(request),
+                   "%s %s HTTP/1.1\r\n"
+                   "Host: %s\r\n"
+                   "User-Agent: vicpkg/%s\r\n"
+                   "Accept-Encoding: identity\r\n"
+                   "Connection: keep-alive\r\n",
+                   head_only ? "HEAD" : "GET", u->path, host_header,
+                   VICPKG_VERSION);
+  if (opts && opts->if_none_match && opts->if_none_match[0]) {
+    n += snprintf(request + n, sizeof(request) - n, "If-None-Match: %s\r\n",
+                  opts->if_none_match);
+  }
+  if (opts && opts->if_modified_since && opts->if_modified_since[0]) {
+    n += snprintf(request + n, sizeof(request) - n,
+                  "If-Modified-Since: %s\r\n", opts->if_modified_since);
+  }
+  if (opts && opts->ranged) {
+    char range[64];
+    format_range(opts, range, sizeof(range));
+    n += snprintf(request + n, sizeof(request) - n, "Range: bytes=%s\r\n",
+                  range);
+    if (opts->if_range && opts->if_range[0]) {
+      n += snprintf(request + n, sizeof(request) - n, "If-Range: %s\r\n",
+                    opts->if_range);
+    }
+  }
+  snprintf(request + n, sizeof(request) - n, "\r\n");
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int reused = 0;
+    FetchConn *c = conn_acquire(u, timeout_ms, deadline, &reused);
+    if (!c)
+      return HTTP_FAILED;
+
+    char line[MAX_LINE];
+    if (!conn_write_all(c, request, strlen(request)) ||
+        !conn_read_line(c, line, sizeof(line))) {
+      conn_close(c);
+      if (reused)
+        continue;
+      return HTTP_FAILED;
+    }
+
+    int minor = 1, status = 0;
+    while (sscanf(line, "HTTP/1.%d %d", &minor, &status) == 2 &&
+           status >= 100 && status < 200) {
+      do {
+        if (!conn_read_line(c, line, sizeof(line))) {
+          conn_close(c);
+          return HTTP_FAILED;
+        }
+      } while (line[0] != '\0');
+      if (!conn_read_line(c, line, sizeof(line))) {
+        conn_close(c);
+        return HTTP_FAILED;
+      }
+    }
+
+    if (sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) {
+      conn_close(c);
+      return HTTP_FAILED;
+    }
+
+    long long content_length = -1;
+    int chunked = 0;
+    int keep_alive = (minor >= 1);
+    location[0] = '\0';
+    resp->status = status;
+    resp->content_length = -1;
+    resp->etag[0] = '\0';
+    resp->last_modified[0] = '\0';
+
+    for (;;) {
+      if (!conn_read_line(c, line, sizeof(line))) {
+        conn_close(c);
+        return HTTP_FAILED;
+      }
+      if (line[0] == '\0')
+        break;
+
+      char *colon = strchr(line, ':');
+      if (!colon)
+        continue;
+      *colon = '\0';
+      const char *value = colon + 1;
+      while (isspace((unsigned char)*value))
+        value++;
+
+      if (strcasecmp(line, "Content-Length") == 0) {
+        content_length = atoll(value);
+      } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+        chunked = strcasestr(value, "chunked") != NULL;
+      } else if (strcasecmp(line, "Connection") == 0) {
+        if (strcasestr(value, "close"))
+          keep_alive = 0;
+        else if (strcasestr(value, "keep-alive"))
+          keep_alive = 1;
+      } else if (strcasecmp(line, "ETag") == 0) {
+        copy_header_value(resp->etag, sizeof(resp->etag), value);
+      } else if (strcasecmp(line, "Last-Modified") == 0) {
+        copy_header_value(resp->last_modified, sizeof(resp->last_modified),
+                          value);
+      } else if (strcasecmp(line, "Location") == 0) {
+        copy_header_value(location, location_size, value);
+      }
+    }
+
+    int redirect = location[0] != '\0' &&
+                   (status == 301 || status == 302 || status == 303 ||
+                    status == 307 || status == 308);
+    int has_body = !head_only && status != 204 && status != 304;
+    int deliver = !redirect && status >= 200 && status < 300;
+    long long bytes = 0;
+    int ok = 1;
+
+    if (!chunked)
+      resp->content_length = content_length;
+
+    if (has_body) {
+      if (!deliver && (chunked || content_length < 0 ||
+                       content_length > FETCH_DRAIN_LIMIT)) {
+        keep_alive = 0;
+      } else if (chunked) {
+        ok = conn_read_chunked(c, deliver ? sink : NULL, user, &bytes);
+      } else {
+        ok = conn_read_body(c, content_length, deliver ? sink : NULL, user,
+                            &bytes);
+        if (content_length < 0)
+          keep_alive = 0;
+      }
+    }
+
+    if (!ok) {
+      conn_close(c);
+      return HTTP_FAILED;
+    }
+
+    if (deliver)
+      resp->bytes = bytes;
+    conn_release(c, keep_alive);
+    return redirect ? HTTP_REDIRECT : HTTP_DONE;
+  }
+
+  return HTTP_FAILED;
+}
+
+static int http_handles(const char *scheme) {
+#ifdef VICPKG_HAVE_OPENSSL
+  if (strcmp(scheme, "https") == 0)
+    return 1;
+#endif
+  return strcmp(scheme, "http") == 0;
+}
+
+static int http_perform(const char *url, const FetchOptions *opts,
+                        FetchSink sink, void *user, FetchResponse *resp) {
+  char current[FETCH_MAX_URL];
+  char location[FETCH_MAX_URL];
+  snprintf(current, sizeof(current), "%s", url);
+  long long deadline =
+      opts && opts->deadline_ms > 0 ? now_ms() + opts->deadline_ms : 0;
+
+  for (int i = 0; i <= FETCH_MAX_REDIRECTS; i++) {
+    FetchURL u;
+    if (!parse_url(current, &u) || !http_handles(u.scheme))
+      return 0;
+
+    int r = http_request_once(&u, opts, deadline, sink, user, resp, location,
+                              sizeof(location));
+    if (r != HTTP_REDIRECT)
+      return r == HTTP_DONE;
+
+    if (!resolve_location(&u, location, current, sizeof(current))) {
+      if (verbose_mode) {
+        printf("[VERBOSE] Redirect from %s is too long\n", url);
+      }
+      return 0;
+    }
+    if (verbose_mode) {
+      printf("[VERBOSE] Redirected to %s\n", current);
+    }
+  }
+
+  return 1;
+}
+
+static void http_cleanup(void) {
+  pthread_mutex_lock(&pool_lock);
+  for (int i = 0; i < FETCH_POOL_SIZE; i++) {
+    conn_close(pool[i]);
+    pool[i] = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static int file_handles(const char *scheme) {
+  return strcmp(scheme, "file") == 0;
+}
+
+static int file_perform(const char *url, const FetchOptions *opts,
+                        FetchSink sink, void *user, FetchResponse *resp) {
+  const char *path = url + strlen("file://");
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    resp->status = (errno == ENOENT || errno == ENOTDIR) ? 404 : 403;
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    resp->status = 403;
+    return 1;
+  }
+
+  struct tm tm;
+  resp->status = 200;
+  resp->content_length = st.st_size;
+  strftime(resp->last_modified, sizeof(resp->last_modified),
+           "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&st.st_mtime, &tm));
+  /* Nanoseconds too, or rewrites within a second look unchanged. */
+  snprintf(resp->etag, sizeof(resp->etag), "\"%llx-%llx.%lx\"",
+           (unsigned long long)st.st_size, (unsigned long long)st.st_mtime,
+           (unsigned long)st.st_mtim.tv_nsec);
+
+  int not_modified = 0;
+  if (opts && opts->if_none_match && opts->if_none_match[0]) {
+    not_modified = strcmp(opts->if_none_match, resp->etag) == 0;
+  } else if (opts && opts->if_modified_since && opts->if_modified_since[0]) {
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(opts->if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+      not_modified = st.st_mtime <= timegm(&tm);
+    }
+  }
+  if (not_modified) {
+    close(fd);
+    resp->status = 304;
+    resp->content_length = -1;
+    return 1;
+  }
+
+  long long left = st.st_size;
+  if (opts && opts->ranged &&
+      !(opts->if_range && opts->if_range[0] &&
+        strcmp(opts->if_range, resp->etag) != 0 &&
+        strcmp(opts->if_range, resp->last_modified) != 0)) {
+    long long end = opts->range_end > 0 && opts->range_end < st.st_size
+                        ? opts->range_end
+                        : st.st_size;
+    if (opts->range_start >= end ||
+        lseek(fd, opts->range_start, SEEK_SET) < 0) {
+      close(fd);
+      resp->status = 416;
+      resp->content_length = -1;
+      return 1;
+    }
+    left = end - opts->range_start;
+    resp->status = 206;
+    resp->content_length = left;
+  }
+
+  int ok = 1;
+  if (!(opts && opts->head_only)) {
+    char buf[65536];
+    while (left > 0) {
+      size_t want = left < (long long)sizeof(buf) ? (size_t)left : sizeof(buf);
+      ssize_t r = read(fd, buf, want);
+      if (r == 0)
+        break;
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        ok = 0;
+        break;
+      }
+      if (!sink(user, buf, (size_t)r)) {
+        ok = 0;
+        break;
+      }
+      resp->bytes += r;
+      left -= r;
+    }
+  }
+
+  close(fd);
+  return ok;
+}
+
+/*
+ * Fallback for schemes with no native transport (https without OpenSSL).
+ * curl is exec'd directly with headers dumped ahead of the body on stdout.
+ */
+static int curl_handles(const char *scheme) {
+  (void)scheme;
+  return 1;
+}
+
+static int curl_perform(const char *url, const FetchOptions *opts,
+                        FetchSink sink, void *user, FetchResponse *resp) {
+  int timeout_ms = (opts && opts->timeout_ms > 0) ? opts->timeout_ms
+                                                  : FETCH_IO_TIMEOUT_MS;
+  char timeout_str[16];
+  char deadline_str[16];
+  snprintf(timeout_str, sizeof(timeout_str), "%d", (timeout_ms + 999) / 1000);
+
+  char if_none_match[160];
+  char if_modified_since[96];
+  char range[64];
+  char if_range[160];
+  const char *argv[32];
+  int argc = 0;
+  argv[argc++] = "curl";
+  argv[argc++] = "-s";
+  argv[argc++] = "-L";
+  argv[argc++] = "--max-redirs";
+  argv[argc++] = "5";
+  argv[argc++] = "--connect-timeout";
+  argv[argc++] = timeout_str;
+  argv[argc++] = "--speed-limit";
+  argv[argc++] = "1";
+  argv[argc++] = "--speed-time";
+  argv[argc++] = timeout_str;
+  if (opts && opts->deadline_ms > 0) {
+    snprintf(deadline_str, sizeof(deadline_str), "%d",
+             (opts->deadline_ms + 999) / 1000);
+    argv[argc++] = "--max-time";
+    argv[argc++] = deadline_str;
+  }
+  if (opts && opts->head_only) {
+    argv[argc++] = "-I";
+  } else {
+    argv[argc++] = "-D";
+    argv[argc++] = "-";
+  }
+  if (opts && opts->if_none_match && opts->if_none_match[0]) {
+    snprintf(if_none_match, sizeof(if_none_match), "If-None-Match: %s",
+             opts->if_none_match);
+    argv[argc++] = "-H";
+    argv[argc++] = if_none_match;
+  }
+  if (opts && opts->if_modified_since && opts->if_modified_since[0]) {
+    snprintf(if_modified_since, sizeof(if_modified_since),
+             "If-Modified-Since: %s", opts->if_modified_since);
+    argv[argc++] = "-H";
+    argv[argc++] = if_modified_since;
+  }
+  if (opts && opts->ranged) {
+    format_range(opts, range, sizeof(range));
+    argv[argc++] = "-r";
+    argv[argc++] = range;
+    if (opts->if_range && opts->if_range[0]) {
+      snprintf(if_range, sizeof(if_range), "If-Range: %s", opts->if_range);
+      argv[argc++] = "-H";
+      argv[argc++] = if_range;
+    }
+  }
+  argv[argc++] = url;
+  argv[argc] = NULL;
+
+  int fds[2];
+  if (pipe(fds) != 0)
+    return 0;
+
+  pid_t pid = fork();
+  if (pid > 0)
+    trace_add(TRACE_FORKS, 1);
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+  }
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0)
+      dup2(devnull, STDERR_FILENO);
+    execvp("curl", (char *const *)argv);
+    _exit(127);
+  }
+  close(fds[1]);
+
+  FILE *out = fdopen(fds[0], "r");
+  char line[MAX_LINE];
+  int ok = 0;
+  resp->content_length = -1;
+
+  while (out && fgets(line, sizeof(line), out)) {
+    int status = 0;
+    if (sscanf(line, "HTTP/%*s %d", &status) != 1)
+      break;
+
+    int location = 0;
+    resp->status = status;
+    resp->content_length = -1;
+    resp->etag[0] = '\0';
+    resp->last_modified[0] = '\0';
+
+    while (fgets(line, sizeof(line), out)) {
+      trim_string(line);
+      if (line[0] == '\0' || line[0] == '\r' || line[0] == '\n')
+        break;
+      char *colon = strchr(line, ':');
+      if (!colon)
+        continue;
+      *colon = '\0';
+      const char *value = colon + 1;
+      if (strcasecmp(line, "Content-Length") == 0) {
+        resp->content_length = atoll(value);
+      } else if (strcasecmp(line, "ETag") == 0) {
+        copy_header_value(resp->etag, sizeof(resp->etag), value);
+      } else if (strcasecmp(line, "Last-Modified") == 0) {
+        copy_header_value(resp->last_modified, sizeof(resp->last_modified),
+                          value);
+      } else if (strcasecmp(line, "Location") == 0) {
+        location = 1;
+      }
+    }
+
+    if ((status >= 100 && status < 200) ||
+        (location && status >= 300 && status < 400)) {
+      continue;
+    }
+
+    ok = 1;
+    if (status >= 200 && status < 300 && !(opts && opts->head_only)) {
+      char buf[65536];
+      size_t r;
+      while ((r = fread(buf, 1, sizeof(buf), out)) > 0) {
+        if (!sink(user, buf, r)) {
+          ok = 0;
+          break;
+        }
+        resp->bytes += r;
+      }
+    } else {
+      /* Read past an error page so curl exits 0 instead of on a broken pipe. */
+      char buf[4096];
+      while (fread(buf, 1, sizeof(buf), out) > 0)
+        ;
+    }
+    break;
+  }
+
+  if (out) {
+    fclose(out);
+  } else {
+    close(fds[0]);
+  }
+
+  int wstatus = 0;
+  if (!ok)
+    kill(pid, SIGTERM);
+  waitpid(pid, &wstatus, 0);
+  if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+    ok = 0;
+
+  return ok;
+}
+
+static const FetchBackend file_backend = {"file", file_handles, file_perform,
+                                          NULL};
+static const FetchBackend http_backend = {"http", http_handles, http_perform,
+                                          http_cleanup};
+static const FetchBackend curl_backend = {"curl", curl_handles, curl_perform,
+                                          NULL};
+
+static void fetch_init(void) {
+  signal(SIGPIPE, SIG_IGN);
+  backends[backend_count++] = &curl_backend;
+  backends[backend_count++] = &http_backend;
+  backends[backend_count++] = &file_backend;
+}
+
+void fetch_register_backend(const FetchBackend *backend) {
+  pthread_once(&fetch_once, fetch_init);
+  if (backend_count < FETCH_MAX_BACKENDS) {
+    backends[backend_count++] = backend;
+  }
+}
+
+static const FetchBackend *select_backend(const char *url) {
+  const char *forced = getenv("VICPKG_FETCH_BACKEND");
+  char scheme[16] = "";
+  const char *sep = strstr(url, "://");
+
+  if (sep && (size_t)(sep - url) < sizeof(scheme)) {
+    for (size_t i = 0; url + i < sep; i++) {
+      scheme[i] = tolower((unsigned char)url[i]);
+    }
+  }
+
+  for (int i = backend_count - 1; i >= 0; i--) {
+    if (forced && forced[0] != '\0') {
+      if (strcmp(backends[i]->name, forced) == 0)
+        return backends[i];
+    } else if (backends[i]->handles(scheme)) {
+      return backends[i];
+    }
+  }
+  return NULL;
+}
+
+int fetch_url(const char *url, const FetchOptions *opts, FetchSink sink,
+              void *user, FetchResponse *resp) {
+  pthread_once(&fetch_once, fetch_init);
+
+  FetchResponse local;
+  if (!resp)
+    resp = &local;
+  memset(resp, 0, sizeof(*resp));
+  resp->content_length = -1;
+
+  const FetchBackend *backend = select_backend(url);
+  if (!backend)
+    return 0;
+
+  int span = trace_begin("fetch", url);
+  int ok = backend->perform(url, opts, sink, user, resp);
+  trace_add(TRACE_BYTES_IN, resp->bytes);
+  trace_end(span);
+  if (verbose_mode) {
+    printf("[VERBOSE] %s %s -> %d (%lld bytes)\n", backend->name, url,
+           resp->status, resp->bytes);
+  }
+  return ok;
+}
+
+static int file_sink(void *user, const char *data, size_t len) {
+  trace_add(TRACE_BYTES_OUT, (long long)len);
+  return fwrite(data, 1, len, (FILE *)user) == len;
+}
+
+int fetch_to_file(const char *url, const char *path, const FetchOptions *opts,
+                  FetchResponse *resp) {
+  FetchResponse local;
+  if (!resp)
+    resp = &local;
+
+  char part[MAX_PATH + 32];
+  snprintf(part, sizeof(part), "%s.%d.part", path, (int)getpid());
+
+  FILE *f = fopen(part, "wb");
+  if (!f)
+    return 0;
+
+  int ok = fetch_url(url, opts, file_sink, f, resp);
+  if (fclose(f) != 0)
+    ok = 0;
+
+  if (ok && fetch_status_ok(resp) &&
+      (resp->content_length < 0 || resp->bytes == resp->content_length) &&
+      rename(part, path) == 0) {
+    return 1;
+  }
+
+  remove(part);
+  return 0;
+}
+
+int fetch_buffer_sink(void *user, const char *data, size_t len) {
+  FetchBuffer *buf = user;
+  if (buf->len + len + 1 > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + len + 1)
+      cap *= 2;
+    char *data_new = realloc(buf->data, cap);
+    if (!data_new)
+      return 0;
+    buf->data = data_new;
+    buf->cap = cap;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+  return 1;
+}
+
+int fetch_to_buffer(const char *url, const FetchOptions *opts, FetchBuffer *buf,
+                    FetchResponse *resp) {
+  FetchResponse local;
+  if (!resp)
+    resp = &local;
+
+  buf->len = 0;
+  if (buf->data)
+    buf->data[0] = '\0';
+
+  return fetch_url(url, opts, fetch_buffer_sink, buf, resp) &&
+         fetch_status_ok(resp);
+}
+
+void fetch_buffer_free(FetchBuffer *buf) {
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
+
+int fetch_status_ok(const FetchResponse *resp) {
+  return resp->status >= 200 && resp->status < 300;
+}
+
+void fetch_cleanup(void) {
+  for (int i = 0; i < backend_count; i++) {
+    if (backends[i]->cleanup)
+      backends[i]->cleanup();
+  }
+}
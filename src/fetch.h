@@ -0,0 +1,66 @@
+#ifndef VICPKG_FETCH_H
+#define VICPKG_FETCH_H
+
+#include <stddef.h>
+
+typedef struct {
+  int status;
+  long long content_length;
+  long long bytes;
+  char etag[128];
+  char last_modified[64];
+} FetchResponse;
+
+typedef struct {
+  int head_only;
+  /* `timeout_ms` bounds the connect and each read or write; `deadline_ms`,
+     when set, bounds the whole request, lookup and redirects included. */
+  int timeout_ms;
+  int deadline_ms;
+  const char *if_none_match;
+  const char *if_modified_since;
+  /* With `ranged`, asks for bytes [range_start, range_end), or to the end
+     when range_end is 0; a server that honours it answers 206. With
+     `if_range` (an ETag or Last-Modified date) the range is only sent if
+     the file still matches, otherwise the whole file comes back as 200. */
+  int ranged;
+  long long range_start;
+  long long range_end;
+  const char *if_range;
+} FetchOptions;
+
+/* Receives body bytes of a 2xx response. Return 0 to abort the transfer. */
+typedef int (*FetchSink)(void *user, const char *data, size_t len);
+
+/*
+ * A backend performs one request. It returns 1 when a response was received
+ * (whatever its status) and 0 on transport failure. Only 2xx bodies are
+ * passed to the sink.
+ */
+typedef struct {
+  const char *name;
+  int (*handles)(const char *scheme);
+  int (*perform)(const char *url, const FetchOptions *opts, FetchSink sink,
+                 void *user, FetchResponse *resp);
+  void (*cleanup)(void);
+} FetchBackend;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} FetchBuffer;
+
+void fetch_register_backend(const FetchBackend *backend);
+int fetch_url(const char *url, const FetchOptions *opts, FetchSink sink,
+              void *user, FetchResponse *resp);
+int fetch_to_file(const char *url, const char *path, const FetchOptions *opts,
+                  FetchResponse *resp);
+int fetch_to_buffer(const char *url, const FetchOptions *opts, FetchBuffer *buf,
+                    FetchResponse *resp);
+int fetch_buffer_sink(void *user, const char *data, size_t len);
+void fetch_buffer_free(FetchBuffer *buf);
+int fetch_status_ok(const FetchResponse *resp);
+void fetch_cleanup(void);
+
+#endif
@@ -0,0 +1,203 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fsutil.h"
+#include "trace.h"
+#include "vicpkg.h"
+
+#define COPY_CHUNK (64 * 1024)
+
+int fs_make_dirs(const char *path, mode_t mode) {
+  char buf[MAX_PATH];
+  if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+
+  for (char *p = buf + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    int ok = mkdir(buf, 0755) == 0 || errno == EEXIST;
+    *p = '/';
+    if (!ok)
+      return 0;
+  }
+  return mkdir(buf, mode) == 0 || errno == EEXIST;
+}
+
+/* Empties and removes directory `name` under `dirfd` in one post-order walk. */
+static int remove_dir_at(int dirfd, const char *name) {
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return errno == ENOENT;
+
+  DIR *dir = fdopendir(fd);
+  if (!dir) {
+    close(fd);
+    return 0;
+  }
+
+  int ok = 1;
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+      continue;
+    if (d->d_type == DT_DIR) {
+      ok &= remove_dir_at(fd, d->d_name);
+    } else if (unlinkat(fd, d->d_name, 0) != 0) {
+      if (errno == EISDIR || errno == EPERM)
+        ok &= remove_dir_at(fd, d->d_name);
+      else if (errno != ENOENT)
+        ok = 0;
+    }
+  }
+  closedir(dir);
+
+  if (unlinkat(dirfd, name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+    return 0;
+  return ok;
+}
+
+/* Removes a file, symlink or whole directory. A missing path is not an error. */
+int fs_remove(const char *path) {
+  if (unlink(path) == 0 || errno == ENOENT)
+    return 1;
+  if (errno != EISDIR && errno != EPERM)
+    return 0;
+  return remove_dir_at(AT_FDCWD, path);
+}
+
+int fs_remove_tree(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) != 0)
+    return errno == ENOENT;
+  if (!S_ISDIR(st.st_mode))
+    return unlink(path) == 0 || errno == ENOENT;
+  return remove_dir_at(AT_FDCWD, path);
+}
+
+static int copy_file_at(int sfd, const char *sname, int dfd, const char *dname,
+                        mode_t mode) {
+  int in = openat(sfd, sname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (in < 0)
+    return 0;
+  int out = openat(dfd, dname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   mode & 07777);
+  if (out < 0) {
+    close(in);
+    return 0;
+  }
+
+  char buf[COPY_CHUNK];
+  int ok = 1;
+  for (;;) {
+    ssize_t n = read(in, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    for (char *p = buf; n > 0;) {
+      ssize_t w = write(out, p, n);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0) {
+        ok = 0;
+        break;
+      }
+      trace_add(TRACE_BYTES_OUT, w);
+      p += w;
+      n -= w;
+    }
+    if (!ok)
+      break;
+  }
+
+  close(in);
+  if (close(out) != 0)
+    ok = 0;
+  return ok;
+}
+
+static int copy_at(int sfd, const char *sname, int dfd, const char *dname) {
+  struct stat st;
+  if (fstatat(sfd, sname, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    return 0;
+
+  if (S_ISREG(st.st_mode))
+    return copy_file_at(sfd, sname, dfd, dname, st.st_mode);
+
+  if (S_ISLNK(st.st_mode)) {
+    char target[MAX_PATH];
+    ssize_t n = readlinkat(sfd, sname, target, sizeof(target) - 1);
+    if (n < 0)
+      return 0;
+    target[n] = '\0';
+    return symlinkat(target, dfd, dname) == 0;
+  }
+
+  if (!S_ISDIR(st.st_mode))
+    return 1;
+
+  if (mkdirat(dfd, dname, st.st_mode & 07777) != 0 && errno != EEXIST)
+    return 0;
+  int from = openat(sfd, sname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int to = openat(dfd, dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *dir = from >= 0 && to >= 0 ? fdopendir(from) : NULL;
+  if (!dir) {
+    if (from >= 0)
+      close(from);
+    if (to >= 0)
+      close(to);
+    return 0;
+  }
+
+  int ok = 1;
+  struct dirent *d;
+  while (ok && (d = readdir(dir)) != NULL) {
+    if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+      ok = copy_at(from, d->d_name, to, d->d_name);
+  }
+  closedir(dir);
+  close(to);
+  return ok;
+}
+
+/* Copies a file, symlink or directory tree, keeping permission bits. */
+int fs_copy_tree(const char *from, const char *to) {
+  return copy_at(AT_FDCWD, from, AT_FDCWD, to);
+}
+
+/* Renames `from` over `to`, copying instead when they are on different mounts. */
+int fs_move(const char *from, const char *to) {
+  if (renameat(AT_FDCWD, from, AT_FDCWD, to) == 0)
+    return 1;
+  if (errno != EXDEV)
+    return 0;
+  return fs_copy_tree(from, to) && fs_remove_tree(from);
+}
+
+/*
+ * Removes `path` and then each parent directory in turn for as long as they
+ * are empty, stopping below `stop`, which must be an ancestor of `path`.
+ */
+void fs_prune_dirs(const char *path, const char *stop) {
+  size_t stop_len = strlen(stop);
+  char dir[MAX_PATH];
+  snprintf(dir, sizeof(dir), "%s", path);
+
+  while (strncmp(dir, stop, stop_len) == 0 && dir[stop_len] == '/' &&
+         rmdir(dir) == 0) {
+    char *slash = strrchr(dir, '/');
+    if (!slash)
+      break;
+    *slash = '\0';
+  }
+}
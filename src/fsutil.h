@@ -0,0 +1,21 @@
+#ifndef VICPKG_FSUTIL_H
+#define VICPKG_FSUTIL_H
+
+#include <sys/types.h>
+
+/*
+ * Filesystem helpers in place of `rm -rf`, `mv`, `cp -a` and `mkdir -p`
+ * shells. Trees are walked relative to open directory descriptors
+ * (openat/unlinkat/renameat), so each file costs a syscall or two, paths
+ * with spaces need no quoting and symlinks are never followed. All return
+ * 1 on success and 0 with errno set.
+ */
+
+int fs_make_dirs(const char *path, mode_t mode);
+int fs_remove(const char *path);
+int fs_remove_tree(const char *path);
+int fs_copy_tree(const char *from, const char *to);
+int fs_move(const char *from, const char *to);
+void fs_prune_dirs(const char *path, const char *stop);
+
+#endif
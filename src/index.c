@@ -0,0 +1,622 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index.h"
+
+#define STANZA_MAX_LINE MAX_LINE
+
+struct IndexBuilder {
+  PkgIndexEntry *entries;
+  uint32_t entry_count;
+  uint32_t entry_cap;
+
+  PkgIndexRepo repos[MAX_REPOS];
+  uint32_t repo_start[MAX_REPOS];
+  uint32_t repo_count;
+
+  char *strings;
+  uint32_t strings_size;
+  uint32_t strings_cap;
+
+  uint32_t *intern;
+  uint32_t intern_cap;
+  uint32_t intern_count;
+
+  char line[STANZA_MAX_LINE];
+  size_t line_len;
+  int line_overflow;
+  PkgIndexEntry current;
+  int has_current;
+};
+
+static uint32_t hash_string(const char *s) {
+  uint32_t h = 2166136261u;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int intern_grow(IndexBuilder *b) {
+  uint32_t cap = b->intern_cap ? b->intern_cap * 2 : 1024;
+  uint32_t *table = calloc(cap, sizeof(uint32_t));
+  if (!table)
+    return 0;
+
+  for (uint32_t i = 0; i < b->intern_cap; i++) {
+    uint32_t off = b->intern[i];
+    if (!off)
+      continue;
+    uint32_t slot = hash_string(b->strings + off) & (cap - 1);
+    while (table[slot])
+      slot = (slot + 1) & (cap - 1);
+    table[slot] = off;
+  }
+
+  free(b->intern);
+  b->intern = table;
+  b->intern_cap = cap;
+  return 1;
+}
+
+/* Returns the pool offset of `s`, adding it once. Offset 0 is "". */
+static uint32_t intern_string(IndexBuilder *b, const char *s) {
+  if (*s == '\0')
+    return 0;
+
+  if ((b->intern_count + 1) * 2 > b->intern_cap && !intern_grow(b))
+    return 0;
+
+  uint32_t slot = hash_string(s) & (b->intern_cap - 1);
+  while (b->intern[slot]) {
+    if (strcmp(b->strings + b->intern[slot], s) == 0)
+      return b->intern[slot];
+    slot = (slot + 1) & (b->intern_cap - 1);
+  }
+
+  size_t len = strlen(s) + 1;
+  if (b->strings_size + len > b->strings_cap) {
+    uint32_t cap = b->strings_cap * 2;
+    while (cap < b->strings_size + len)
+      cap *= 2;
+    char *strings = realloc(b->strings, cap);
+    if (!strings)
+      return 0;
+    b->strings = strings;
+    b->strings_cap = cap;
+  }
+
+  uint32_t off = b->strings_size;
+  memcpy(b->strings + off, s, len);
+  b->strings_size += len;
+  b->intern[slot] = off;
+  b->intern_count++;
+  return off;
+}
+
+IndexBuilder *index_builder_new(void) {
+  IndexBuilder *b = calloc(1, sizeof(IndexBuilder));
+  if (!b)
+    return NULL;
+
+  b->strings_cap = 65536;
+  b->strings = malloc(b->strings_cap);
+  if (!b->strings || !intern_grow(b)) {
+    index_builder_free(b);
+    return NULL;
+  }
+  b->strings[0] = '\0';
+  b->strings_size = 1;
+  return b;
+}
+
+void index_builder_free(IndexBuilder *b) {
+  if (!b)
+    return;
+  free(b->entries);
+  free(b->strings);
+  free(b->intern);
+  free(b);
+}
+
+int index_builder_add_repo(IndexBuilder *b, const char *url, int is_legacy) {
+  if (b->repo_count >= MAX_REPOS)
+    return -1;
+  b->repos[b->repo_count].url = intern_string(b, url);
+  b->repos[b->repo_count].flags = is_legacy ? PKGINDEX_FLAG_LEGACY : 0;
+  b->repo_start[b->repo_count] = b->entry_count;
+  b->line_len = 0;
+  b->line_overflow = 0;
+  b->has_current = 0;
+  return (int)b->repo_count++;
+}
+
+static int append_entry(IndexBuilder *b, const PkgIndexEntry *entry) {
+  if (b->entry_count == b->entry_cap) {
+    uint32_t cap = b->entry_cap ? b->entry_cap * 2 : 256;
+    PkgIndexEntry *entries = realloc(b->entries, cap * sizeof(PkgIndexEntry));
+    if (!entries)
+      return 0;
+    b->entries = entries;
+    b->entry_cap = cap;
+  }
+  b->entries[b->entry_count++] = *entry;
+  return 1;
+}
+
+static int flush_stanza(IndexBuilder *b) {
+  if (!b->has_current)
+    return 1;
+
+  b->has_current = 0;
+  PkgIndexEntry *e = &b->current;
+  if (e->fields[IDX_PACKAGE] == 0)
+    return 1;
+
+  e->hash = hash_string(b->strings + e->fields[IDX_PACKAGE]);
+  return append_entry(b, e);
+}
+
+static int field_for_key(const char *key) {
+  static const char *names[IDX_FIELD_COUNT] = {
+      "Package",     "Version", "Architecture",       "Filename",
+      "Description", "Name",    "Depends-OS",         "Depends-OS-Version",
+      "SHA256",      "Installed-Size",     "Depends",
+      "Conflicts",   "Section"};
+  for (int i = 0; i < IDX_FIELD_COUNT; i++) {
+    if (strcmp(key, names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static int handle_line(IndexBuilder *b, int repo, char *line) {
+  size_t len = strlen(line);
+  while (len > 0 && (line[len - 1] == '\r' || isspace((unsigned char)line[len - 1])))
+    line[--len] = '\0';
+
+  if (b->repos[repo].flags & PKGINDEX_FLAG_LEGACY) {
+    char *name = line;
+    while (isspace((unsigned char)*name))
+      name++;
+    if (*name == '\0' || *name == '#')
+      return 1;
+
+    PkgIndexEntry e;
+    memset(&e, 0, sizeof(e));
+    e.repo = repo;
+    e.flags = PKGINDEX_FLAG_LEGACY;
+    e.fields[IDX_PACKAGE] = intern_string(b, name);
+    e.hash = hash_string(name);
+    return append_entry(b, &e);
+  }
+
+  if (len == 0)
+    return flush_stanza(b);
+
+  if (line[0] == ' ' || line[0] == '\t')
+    return 1;
+
+  char *colon = strchr(line, ':');
+  if (!colon)
+    return 1;
+  *colon = '\0';
+
+  char *value = colon + 1;
+  while (isspace((unsigned char)*value))
+    value++;
+
+  if (strcmp(line, "Package") == 0) {
+    if (!flush_stanza(b))
+      return 0;
+    memset(&b->current, 0, sizeof(b->current));
+    b->current.repo = repo;
+    b->has_current = 1;
+  }
+
+  if (!b->has_current)
+    return 1;
+
+  if (strcmp(line, "Size") == 0) {
+    b->current.size = atoll(value);
+    return 1;
+  }
+
+  int field = field_for_key(line);
+  if (field >= 0) {
+    b->current.fields[field] = intern_string(b, value);
+  }
+  return 1;
+}
+
+int index_builder_feed(IndexBuilder *b, int repo, const char *data,
+                       size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    char ch = data[i];
+    if (ch == '\n') {
+      b->line[b->line_len] = '\0';
+      int ok = b->line_overflow || handle_line(b, repo, b->line);
+      b->line_len = 0;
+      b->line_overflow = 0;
+      if (!ok)
+        return 0;
+    } else if (b->line_len + 1 < sizeof(b->line)) {
+      b->line[b->line_len++] = ch;
+    } else {
+      b->line_overflow = 1;
+    }
+  }
+  return 1;
+}
+
+int index_builder_finish_repo(IndexBuilder *b, int repo) {
+  if (b->line_len > 0 && !b->line_overflow) {
+    b->line[b->line_len] = '\0';
+    if (!handle_line(b, repo, b->line))
+      return 0;
+  }
+  b->line_len = 0;
+  b->line_overflow = 0;
+  return flush_stanza(b);
+}
+
+/* Drops what was fed for the repo so far; it must be the last one added. */
+void index_builder_abort_repo(IndexBuilder *b, int repo) {
+  b->entry_count = b->repo_start[repo];
+  b->line_len = 0;
+  b->line_overflow = 0;
+  b->has_current = 0;
+}
+
+int index_builder_import_repo(IndexBuilder *b, int repo,
+                              const PackageIndex *old, int old_repo) {
+  for (uint32_t i = 0; i < old->hdr->entry_count; i++) {
+    const PkgIndexEntry *src = &old->entries[i];
+    if (src->repo != (uint32_t)old_repo)
+      continue;
+
+    PkgIndexEntry e = *src;
+    e.repo = repo;
+    for (int f = 0; f < IDX_FIELD_COUNT; f++) {
+      e.fields[f] = intern_string(b, old->strings + src->fields[f]);
+    }
+    if (!append_entry(b, &e))
+      return 0;
+  }
+  return 1;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t w = write(fd, p, len);
+    if (w <= 0)
+      return 0;
+    p += w;
+    len -= w;
+  }
+  return 1;
+}
+
+static const int search_fields[] = {IDX_PACKAGE, IDX_NAME, IDX_DESCRIPTION,
+                                    IDX_SECTION};
+
+static uint32_t gram_key(const char *s) {
+  return (uint32_t)tolower((unsigned char)s[0]) << 16 |
+         (uint32_t)tolower((unsigned char)s[1]) << 8 |
+         (uint32_t)tolower((unsigned char)s[2]);
+}
+
+static int by_gram(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Builds the trigram table. Each (gram, entry) pair is packed into one
+ * 64-bit key so a single sort groups the postings and orders them by entry.
+ */
+static int build_grams(IndexBuilder *b, PkgIndexGram **grams,
+                       uint32_t *gram_count, uint32_t **postings,
+                       uint32_t *posting_count) {
+  uint64_t *pairs = NULL;
+  size_t count = 0, cap = 0;
+
+  for (uint32_t i = 0; i < b->entry_count; i++) {
+    for (size_t f = 0; f < sizeof(search_fields) / sizeof(*search_fields);
+         f++) {
+      const char *s = b->strings + b->entries[i].fields[search_fields[f]];
+      for (; s[0] && s[1] && s[2]; s++) {
+        if (count == cap) {
+          cap = cap ? cap * 2 : 4096;
+          uint64_t *grown = realloc(pairs, cap * sizeof(uint64_t));
+          if (!grown) {
+            free(pairs);
+            return 0;
+          }
+          pairs = grown;
+        }
+        pairs[count++] = (uint64_t)gram_key(s) << 32 | i;
+      }
+    }
+  }
+  qsort(pairs, count, sizeof(uint64_t), by_gram);
+
+  *grams = malloc((count ? count : 1) * sizeof(PkgIndexGram));
+  *postings = malloc((count ? count : 1) * sizeof(uint32_t));
+  if (!*grams || !*postings) {
+    free(*grams);
+    free(*postings);
+    free(pairs);
+    return 0;
+  }
+
+  uint32_t ng = 0, np = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0 && pairs[i] == pairs[i - 1])
+      continue;
+    uint32_t gram = (uint32_t)(pairs[i] >> 32);
+    if (ng == 0 || (*grams)[ng - 1].gram != gram) {
+      (*grams)[ng].gram = gram;
+      (*grams)[ng].first = np;
+      (*grams)[ng].count = 0;
+      ng++;
+    }
+    (*postings)[np++] = (uint32_t)pairs[i];
+    (*grams)[ng - 1].count++;
+  }
+  free(pairs);
+
+  *gram_count = ng;
+  *posting_count = np;
+  return 1;
+}
+
+int index_builder_write(IndexBuilder *b, const char *path) {
+  uint32_t bucket_count = 16;
+  while (bucket_count < b->entry_count * 2)
+    bucket_count *= 2;
+
+  uint32_t *buckets = calloc(bucket_count, sizeof(uint32_t));
+  uint32_t *tails = calloc(bucket_count, sizeof(uint32_t));
+  if (!buckets || !tails) {
+    free(buckets);
+    free(tails);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < b->entry_count; i++) {
+    uint32_t slot = b->entries[i].hash & (bucket_count - 1);
+    b->entries[i].next = 0;
+    if (tails[slot]) {
+      b->entries[tails[slot] - 1].next = i + 1;
+    } else {
+      buckets[slot] = i + 1;
+    }
+    tails[slot] = i + 1;
+  }
+  free(tails);
+
+  PkgIndexGram *grams;
+  uint32_t *postings;
+  uint32_t gram_count, posting_count;
+  if (!build_grams(b, &grams, &gram_count, &postings, &posting_count)) {
+    free(buckets);
+    return 0;
+  }
+
+  PkgIndexHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = PKGINDEX_MAGIC;
+  hdr.version = PKGINDEX_VERSION;
+  hdr.bucket_count = bucket_count;
+  hdr.entry_count = b->entry_count;
+  hdr.repo_count = b->repo_count;
+  hdr.strings_size = b->strings_size;
+  hdr.buckets_offset = sizeof(hdr);
+  hdr.entries_offset = hdr.buckets_offset + bucket_count * sizeof(uint32_t);
+  hdr.entries_offset = (hdr.entries_offset + 7) & ~7u;
+  hdr.repos_offset =
+      hdr.entries_offset + b->entry_count * sizeof(PkgIndexEntry);
+  hdr.gram_count = gram_count;
+  hdr.grams_offset = hdr.repos_offset + b->repo_count * sizeof(PkgIndexRepo);
+  hdr.posting_count = posting_count;
+  hdr.postings_offset = hdr.grams_offset + gram_count * sizeof(PkgIndexGram);
+  hdr.strings_offset =
+      hdr.postings_offset + posting_count * sizeof(uint32_t);
+  hdr.total_size = hdr.strings_offset + b->strings_size;
+
+  char temp_path[MAX_PATH];
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    free(buckets);
+    free(grams);
+    free(postings);
+    return 0;
+  }
+
+  static const char pad[8] = {0};
+  size_t pad_len = hdr.entries_offset -
+                   (hdr.buckets_offset + bucket_count * sizeof(uint32_t));
+  int ok = write_all(fd, &hdr, sizeof(hdr)) &&
+           write_all(fd, buckets, bucket_count * sizeof(uint32_t)) &&
+           write_all(fd, pad, pad_len) &&
+           write_all(fd, b->entries, b->entry_count * sizeof(PkgIndexEntry)) &&
+           write_all(fd, b->repos, b->repo_count * sizeof(PkgIndexRepo)) &&
+           write_all(fd, grams, gram_count * sizeof(PkgIndexGram)) &&
+           write_all(fd, postings, posting_count * sizeof(uint32_t)) &&
+           write_all(fd, b->strings, b->strings_size);
+  free(buckets);
+  free(grams);
+  free(postings);
+
+  if (close(fd) != 0)
+    ok = 0;
+  if (ok && rename(temp_path, path) == 0)
+    return 1;
+
+  remove(temp_path);
+  return 0;
+}
+
+int pkgindex_open(PackageIndex *idx, const char *path) {
+  memset(idx, 0, sizeof(*idx));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PkgIndexHeader)) {
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  const PkgIndexHeader *hdr = map;
+  if (hdr->magic != PKGINDEX_MAGIC || hdr->version != PKGINDEX_VERSION ||
+      hdr->total_size != (uint32_t)st.st_size || hdr->bucket_count == 0 ||
+      hdr->postings_offset + hdr->posting_count * sizeof(uint32_t) !=
+          hdr->strings_offset ||
+      hdr->strings_offset + hdr->strings_size != hdr->total_size) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  idx->base = map;
+  idx->size = st.st_size;
+  idx->hdr = hdr;
+  idx->buckets = (const uint32_t *)(idx->base + hdr->buckets_offset);
+  idx->entries = (const PkgIndexEntry *)(idx->base + hdr->entries_offset);
+  idx->repos = (const PkgIndexRepo *)(idx->base + hdr->repos_offset);
+  idx->grams = (const PkgIndexGram *)(idx->base + hdr->grams_offset);
+  idx->postings = (const uint32_t *)(idx->base + hdr->postings_offset);
+  idx->strings = idx->base + hdr->strings_offset;
+  return 1;
+}
+
+void pkgindex_close(PackageIndex *idx) {
+  if (idx->base) {
+    munmap((void *)idx->base, idx->size);
+  }
+  memset(idx, 0, sizeof(*idx));
+}
+
+static const PkgIndexEntry *chain_find(const PackageIndex *idx, uint32_t next,
+                                       uint32_t hash, const char *name) {
+  while (next && next <= idx->hdr->entry_count) {
+    const PkgIndexEntry *e = &idx->entries[next - 1];
+    if (e->hash == hash &&
+        strcmp(idx->strings + e->fields[IDX_PACKAGE], name) == 0) {
+      return e;
+    }
+    next = e->next;
+  }
+  return NULL;
+}
+
+const PkgIndexEntry *pkgindex_lookup(const PackageIndex *idx,
+                                     const char *name) {
+  if (!idx->hdr)
+    return NULL;
+  uint32_t hash = hash_string(name);
+  uint32_t slot = hash & (idx->hdr->bucket_count - 1);
+  return chain_find(idx, idx->buckets[slot], hash, name);
+}
+
+const PkgIndexEntry *pkgindex_next(const PackageIndex *idx,
+                                   const PkgIndexEntry *entry) {
+  return chain_find(idx, entry->next, entry->hash,
+                    idx->strings + entry->fields[IDX_PACKAGE]);
+}
+
+const char *pkgindex_field(const PackageIndex *idx, const PkgIndexEntry *entry,
+                           int field) {
+  return idx->strings + entry->fields[field];
+}
+
+const char *pkgindex_repo(const PackageIndex *idx, const PkgIndexEntry *entry) {
+  return idx->strings + idx->repos[entry->repo].url;
+}
+
+/* Returns the entries whose searchable text contains the 3-byte `gram`. */
+const uint32_t *pkgindex_postings(const PackageIndex *idx, const char *gram,
+                                  uint32_t *count) {
+  uint32_t key = gram_key(gram);
+  uint32_t lo = 0, hi = idx->hdr ? idx->hdr->gram_count : 0;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (idx->grams[mid].gram < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (!idx->hdr || lo == idx->hdr->gram_count || idx->grams[lo].gram != key) {
+    *count = 0;
+    return NULL;
+  }
+  *count = idx->grams[lo].count;
+  return idx->postings + idx->grams[lo].first;
+}
+
+int pkgindex_find_repo(const PackageIndex *idx, const char *url, int is_legacy) {
+  if (!idx->hdr)
+    return -1;
+  uint32_t flags = is_legacy ? PKGINDEX_FLAG_LEGACY : 0;
+  for (uint32_t i = 0; i < idx->hdr->repo_count; i++) {
+    if (idx->repos[i].flags == flags &&
+        strcmp(idx->strings + idx->repos[i].url, url) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+void pkgindex_fill_info(const PackageIndex *idx, const PkgIndexEntry *entry,
+                        PackageInfo *info) {
+  memset(info, 0, sizeof(PackageInfo));
+
+  snprintf(info->package, sizeof(info->package), "%s",
+           pkgindex_field(idx, entry, IDX_PACKAGE));
+  snprintf(info->version, sizeof(info->version), "%s",
+           pkgindex_field(idx, entry, IDX_VERSION));
+  snprintf(info->architecture, sizeof(info->architecture), "%s",
+           pkgindex_field(idx, entry, IDX_ARCHITECTURE));
+  snprintf(info->filename, sizeof(info->filename), "%s",
+           pkgindex_field(idx, entry, IDX_FILENAME));
+  snprintf(info->description, sizeof(info->description), "%s",
+           pkgindex_field(idx, entry, IDX_DESCRIPTION));
+  snprintf(info->name, sizeof(info->name), "%s",
+           pkgindex_field(idx, entry, IDX_NAME));
+  snprintf(info->depends_os, sizeof(info->depends_os), "%s",
+           pkgindex_field(idx, entry, IDX_DEPENDS_OS));
+  snprintf(info->depends_os_version, sizeof(info->depends_os_version), "%s",
+           pkgindex_field(idx, entry, IDX_DEPENDS_OS_VERSION));
+  snprintf(info->sha256, sizeof(info->sha256), "%s",
+           pkgindex_field(idx, entry, IDX_SHA256));
+  snprintf(info->depends, sizeof(info->depends), "%s",
+           pkgindex_field(idx, entry, IDX_DEPENDS));
+  snprintf(info->conflicts, sizeof(info->conflicts), "%s",
+           pkgindex_field(idx, entry, IDX_CONFLICTS));
+  snprintf(info->repo, sizeof(info->repo), "%s", pkgindex_repo(idx, entry));
+  info->installed_size =
+      atol(pkgindex_field(idx, entry, IDX_INSTALLED_SIZE)) * 1024L;
+  info->size = (long)entry->size;
+  info->is_legacy = (entry->flags & PKGINDEX_FLAG_LEGACY) != 0;
+}
@@ -0,0 +1,111 @@
+#ifndef VICPKG_INDEX_H
+#define VICPKG_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vicpkg.h"
+
+#define PKGINDEX_MAGIC 0x58444950u
+#define PKGINDEX_VERSION 7
+
+#define PKGINDEX_FLAG_LEGACY 1u
+
+enum {
+  IDX_PACKAGE,
+  IDX_VERSION,
+  IDX_ARCHITECTURE,
+  IDX_FILENAME,
+  IDX_DESCRIPTION,
+  IDX_NAME,
+  IDX_DEPENDS_OS,
+  IDX_DEPENDS_OS_VERSION,
+  IDX_SHA256,
+  IDX_INSTALLED_SIZE,
+  IDX_DEPENDS,
+  IDX_CONFLICTS,
+  IDX_SECTION,
+  IDX_FIELD_COUNT
+};
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t bucket_count;
+  uint32_t entry_count;
+  uint32_t repo_count;
+  uint32_t strings_size;
+  uint32_t buckets_offset;
+  uint32_t entries_offset;
+  uint32_t repos_offset;
+  uint32_t strings_offset;
+  uint32_t total_size;
+  uint32_t gram_count;
+  uint32_t grams_offset;
+  uint32_t posting_count;
+  uint32_t postings_offset;
+} PkgIndexHeader;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t next;
+  uint32_t repo;
+  uint32_t flags;
+  int64_t size;
+  uint32_t fields[IDX_FIELD_COUNT];
+} PkgIndexEntry;
+
+typedef struct {
+  uint32_t url;
+  uint32_t flags;
+} PkgIndexRepo;
+
+/*
+ * Search index: every lowercased trigram of an entry's Package, Name,
+ * Description and Section maps to the sorted ids of the entries holding it.
+ */
+typedef struct {
+  uint32_t gram;
+  uint32_t first;
+  uint32_t count;
+} PkgIndexGram;
+
+typedef struct {
+  const char *base;
+  size_t size;
+  const PkgIndexHeader *hdr;
+  const uint32_t *buckets;
+  const PkgIndexEntry *entries;
+  const PkgIndexRepo *repos;
+  const PkgIndexGram *grams;
+  const uint32_t *postings;
+  const char *strings;
+} PackageIndex;
+
+typedef struct IndexBuilder IndexBuilder;
+
+IndexBuilder *index_builder_new(void);
+int index_builder_add_repo(IndexBuilder *b, const char *url, int is_legacy);
+int index_builder_feed(IndexBuilder *b, int repo, const char *data, size_t len);
+int index_builder_finish_repo(IndexBuilder *b, int repo);
+void index_builder_abort_repo(IndexBuilder *b, int repo);
+int index_builder_import_repo(IndexBuilder *b, int repo,
+                              const PackageIndex *old, int old_repo);
+int index_builder_write(IndexBuilder *b, const char *path);
+void index_builder_free(IndexBuilder *b);
+
+int pkgindex_open(PackageIndex *idx, const char *path);
+void pkgindex_close(PackageIndex *idx);
+const PkgIndexEntry *pkgindex_lookup(const PackageIndex *idx, const char *name);
+const PkgIndexEntry *pkgindex_next(const PackageIndex *idx,
+                                   const PkgIndexEntry *entry);
+const char *pkgindex_field(const PackageIndex *idx, const PkgIndexEntry *entry,
+                           int field);
+const char *pkgindex_repo(const PackageIndex *idx, const PkgIndexEntry *entry);
+const uint32_t *pkgindex_postings(const PackageIndex *idx, const char *gram,
+                                  uint32_t *count);
+int pkgindex_find_repo(const PackageIndex *idx, const char *url, int is_legacy);
+void pkgindex_fill_info(const PackageIndex *idx, const PkgIndexEntry *entry,
+                        PackageInfo *info);
+
+#endif
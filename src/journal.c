@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+/* Remembers the filesystem holding `path`'s directory for the commit sync. */
+static void note_device(Journal *j, const char *path) {
+  char dir[MAX_PATH];
+  snprintf(dir, sizeof(dir), "%s", path);
+
+  char *slash = strrchr(dir, '/');
+  if (slash && slash != dir)
+    *slash = '\0';
+  else if (slash)
+    dir[1] = '\0';
+
+  struct stat st;
+  if (stat(dir, &st) != 0)
+    return;
+
+  for (int i = 0; i < j->device_count; i++) {
+    if (j->devices[i] == st.st_dev)
+      return;
+  }
+  if (j->device_count == JOURNAL_MAX_DEVICES) {
+    j->sync_all = 1;
+    return;
+  }
+  j->devices[j->device_count] = st.st_dev;
+  snprintf(j->device_paths[j->device_count], MAX_PATH, "%s", dir);
+  j->device_count++;
+}
+
+int journal_begin(Journal *j, const char *name) {
+  memset(j, 0, sizeof(Journal));
+  mkdir(JOURNAL_DIR, 0755);
+  snprintf(j->path, sizeof(j->path), "%s/%s", JOURNAL_DIR, name);
+
+  j->file = fopen(j->path, "w");
+  if (!j->file) {
+    fprintf(stderr, "Failed to create journal %s: %s\n", j->path,
+            strerror(errno));
+    return 0;
+  }
+  pthread_mutex_init(&j->lock, NULL);
+  note_device(j, j->path);
+  return 1;
+}
+
+/* Names a package the commit installs, for the recovery message. */
+int journal_add_package(Journal *j, const char *package) {
+  pthread_mutex_lock(&j->lock);
+  int ok = fprintf(j->file, "package %s\n", package) > 0 &&
+           fflush(j->file) == 0;
+  pthread_mutex_unlock(&j->lock);
+  return ok;
+}
+
+/* Flushed at once, as the staged file is created right after. */
+int journal_add(Journal *j, const char *target) {
+  pthread_mutex_lock(&j->lock);
+  note_device(j, target);
+  int ok = fprintf(j->file, "stage %s\n", target) > 0 && fflush(j->file) == 0;
+  pthread_mutex_unlock(&j->lock);
+  return ok;
+}
+
+/*
+ * Makes the staged files and the journal durable with one sync per
+ * filesystem involved, then appends and syncs the commit record.
+ */
+int journal_commit(Journal *j) {
+  if (fflush(j->file) != 0)
+    return 0;
+
+  if (j->sync_all) {
+    sync();
+  } else {
+    for (int i = 0; i < j->device_count; i++) {
+      int fd = open(j->device_paths[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      if (syncfs(fd) != 0) {
+        close(fd);
+        return 0;
+      }
+      close(fd);
+    }
+  }
+
+  return fputs("commit\n", j->file) >= 0 && fflush(j->file) == 0 &&
+         fdatasync(fileno(j->file)) == 0;
+}
+
+/* Leaves the journal on disk for journal_recover() to finish. */
+void journal_close(Journal *j) {
+  if (j->file) {
+    fclose(j->file);
+    j->file = NULL;
+    pthread_mutex_destroy(&j->lock);
+  }
+}
+
+void journal_remove(Journal *j) {
+  journal_close(j);
+  unlink(j->path);
+}
+
+static int read_line(FILE *f, char *line, size_t size) {
+  if (!fgets(line, size, f))
+    return 0;
+  line[strcspn(line, "\n")] = '\0';
+  return 1;
+}
+
+static void recover_journal(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+
+  char line[MAX_PATH + 16];
+  int committed = 0;
+  int packages = 0;
+  while (read_line(f, line, sizeof(line)))
+    committed = strcmp(line, "commit") == 0;
+
+  rewind(f);
+  while (read_line(f, line, sizeof(line))) {
+    if (strncmp(line, "stage ", 6) != 0)
+      continue;
+
+    const char *target = line + 6;
+    char staged[MAX_PATH];
+    struct stat st;
+    if (snprintf(staged, sizeof(staged), "%s" STAGED_SUFFIX, target) >=
+            (int)sizeof(staged) ||
+        lstat(staged, &st) != 0)
+      continue;
+
+    if (committed ? rename(staged, target) != 0 : unlink(staged) != 0) {
+      fprintf(stderr, "Failed to recover %s: %s\n", target, strerror(errno));
+    } else if (verbose_mode) {
+      printf("[VERBOSE] %s %s\n", committed ? "Committed" : "Discarded",
+             target);
+    }
+  }
+
+  rewind(f);
+  while (read_line(f, line, sizeof(line))) {
+    if (strncmp(line, "package ", 8) != 0)
+      continue;
+    printf("%s interrupted install of %s.\n",
+           committed ? "Completed" : "Rolled back", line + 8);
+    packages++;
+  }
+  fclose(f);
+
+  unlink(path);
+  if (packages == 0)
+    printf("%s an interrupted install.\n",
+           committed ? "Completed" : "Rolled back");
+}
+
+/* Whether an interrupted run left any journal behind. */
+int journal_pending(void) {
+  DIR *dir = opendir(JOURNAL_DIR);
+  if (!dir)
+    return 0;
+
+  struct dirent *d;
+  int found = 0;
+  while (!found && (d = readdir(dir)) != NULL)
+    found = d->d_name[0] != '.';
+  closedir(dir);
+  return found;
+}
+
+int journal_recover(void) {
+  DIR *dir = opendir(JOURNAL_DIR);
+  if (!dir)
+    return 1;
+
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    if (d->d_name[0] == '.')
+      continue;
+
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", JOURNAL_DIR, d->d_name);
+    recover_journal(path);
+  }
+  closedir(dir);
+  return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef VICPKG_JOURNAL_H
+#define VICPKG_JOURNAL_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "vicpkg.h"
+
+#define JOURNAL_MAX_DEVICES 8
+
+/*
+ * Write-ahead journal for committing the staged files of a transaction. The
+ * journal is opened before anything is staged and lists every target as its
+ * new contents are created at target + STAGED_SUFFIX; once the staged data
+ * and the list are on disk a commit record is appended, and only then are
+ * the files renamed into place. journal_recover() finishes committed
+ * journals left by an interrupted run and rolls back the others. Packages
+ * may be staged into one journal from several threads.
+ */
+
+typedef struct {
+  char path[MAX_PATH];
+  FILE *file;
+  dev_t devices[JOURNAL_MAX_DEVICES];
+  char device_paths[JOURNAL_MAX_DEVICES][MAX_PATH];
+  int device_count;
+  int sync_all;
+  pthread_mutex_t lock;
+} Journal;
+
+int journal_begin(Journal *j, const char *name);
+int journal_add_package(Journal *j, const char *package);
+int journal_add(Journal *j, const char *target);
+int journal_commit(Journal *j);
+void journal_close(Journal *j);
+void journal_remove(Journal *j);
+int journal_pending(void);
+int journal_recover(void);
+
+#endif
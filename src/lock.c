@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lock.h"
+
+#define LOCK_STATE_BYTE 0
+#define LOCK_BOOST_BYTE 1
+
+static int lock_fd = -1;
+static int lock_writable;
+
+static int open_lock_file(void) {
+  if (lock_fd >= 0)
+    return 1;
+
+  lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  lock_writable = lock_fd >= 0;
+  if (lock_fd < 0)
+    lock_fd = open(LOCK_FILE, O_RDONLY | O_CLOEXEC);
+  return lock_fd >= 0;
+}
+
+static int set_lock(int byte, short type, int wait) {
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = byte;
+  fl.l_len = 1;
+
+  while (fcntl(lock_fd, wait ? F_SETLKW : F_SETLK, &fl) != 0) {
+    if (errno != EINTR)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Returns 0 only when the lock cannot be taken at all. Without a lock file
+ * (vicpkg has never set itself up) there is nothing to protect yet, and a
+ * read-only lock file can only be locked shared.
+ */
+int lock_state(int exclusive) {
+  if (!open_lock_file())
+    return !exclusive || errno == ENOENT;
+  if (exclusive && !lock_writable)
+    return 0;
+
+  short type = exclusive ? F_WRLCK : F_RDLCK;
+  if (set_lock(LOCK_STATE_BYTE, type, 0))
+    return 1;
+  if (errno != EAGAIN && errno != EACCES)
+    return 0;
+
+  if (!quiet_mode)
+    fprintf(stderr, "Waiting for another vicpkg process to finish...\n");
+  return set_lock(LOCK_STATE_BYTE, type, 1);
+}
+
+void unlock_state(void) {
+  if (lock_fd >= 0)
+    set_lock(LOCK_STATE_BYTE, F_UNLCK, 0);
+}
+
+void lock_boost(void) {
+  if (open_lock_file())
+    set_lock(LOCK_BOOST_BYTE, F_RDLCK, 1);
+}
+
+/*
+ * Drops this process' hold on the boost and returns 1 if no other process
+ * still has one. Releasing before probing means that of two processes
+ * finishing together at least one sees the other gone. The winner keeps
+ * the byte until it exits, so a new run cannot raise the clock just before
+ * it is lowered.
+ */
+int unlock_boost(void) {
+  if (lock_fd < 0 || !lock_writable)
+    return 1;
+
+  set_lock(LOCK_BOOST_BYTE, F_UNLCK, 0);
+  if (!set_lock(LOCK_BOOST_BYTE, F_WRLCK, 0))
+    return 0;
+  return 1;
+}
@@ -0,0 +1,24 @@
+#ifndef VICPKG_LOCK_H
+#define VICPKG_LOCK_H
+
+#include "vicpkg.h"
+
+/*
+ * Cross-process locks, held as fcntl record locks on bytes of LOCK_FILE so
+ * the kernel drops them when a process exits or crashes.
+ *
+ * The state byte serializes vicpkg runs: commands that only read take it
+ * shared and the ones that change packages, repositories or caches take it
+ * exclusive. A shared lock may be raised to exclusive and lowered again.
+ *
+ * Every process running with the CPU boosted holds the boost byte shared;
+ * the clock is only lowered by the one that finds nobody else holding it.
+ */
+
+int lock_state(int exclusive);
+void unlock_state(void);
+
+void lock_boost(void);
+int unlock_boost(void);
+
+#endif
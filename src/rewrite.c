@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rewrite.h"
+#include "trace.h"
+#include "vicpkg.h"
+
+#define TEXT_PROBE 512
+#define REWRITE_MAX_WORKERS 16
+
+/* Files queued for the workers; `next` is the first one not yet taken. */
+struct RewritePool {
+  const char *needle;
+  size_t needle_len;
+  const char *replacement;
+  size_t replacement_len;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  char **paths;
+  int count;
+  int cap;
+  int next;
+  int closed;
+  int rewritten;
+  int failed;
+
+  pthread_t threads[REWRITE_MAX_WORKERS];
+  int started;
+};
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, data, len);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return 0;
+    trace_add(TRACE_BYTES_OUT, w);
+    data += w;
+    len -= w;
+  }
+  return 1;
+}
+
+/*
+ * Builds the rewritten contents of `data` in one allocation, starting at
+ * `first`, the offset of the first match. Returns NULL when out of memory.
+ */
+static char *replace_all(const RewritePool *job, const char *data, size_t size,
+                         const char *first, size_t *out_len) {
+  size_t matches = 0;
+  for (const char *p = first; p;
+       p = memmem(p + job->needle_len, data + size - p - job->needle_len,
+                  job->needle, job->needle_len))
+    matches++;
+
+  *out_len = size + matches * job->replacement_len - matches * job->needle_len;
+  char *out = malloc(*out_len ? *out_len : 1);
+  if (!out)
+    return NULL;
+
+  char *w = out;
+  const char *r = data;
+  for (const char *p = first; p;
+       p = memmem(r, data + size - r, job->needle, job->needle_len)) {
+    memcpy(w, r, p - r);
+    w += p - r;
+    memcpy(w, job->replacement, job->replacement_len);
+    w += job->replacement_len;
+    r = p + job->needle_len;
+  }
+  memcpy(w, r, data + size - r);
+  return out;
+}
+
+/* Returns 1 if the file was rewritten, 0 if it had nothing to change, -1 on error. */
+static int rewrite_file(const RewritePool *job, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < job->needle_len) {
+    close(fd);
+    return 0;
+  }
+
+  size_t size = st.st_size;
+  const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+  madvise((void *)data, size, MADV_SEQUENTIAL);
+
+  const char *first = NULL;
+  if (!memchr(data, '\0', size < TEXT_PROBE ? size : TEXT_PROBE))
+    first = memmem(data, size, job->needle, job->needle_len);
+  if (!first) {
+    munmap((void *)data, size);
+    return 0;
+  }
+
+  size_t out_len;
+  char *out = replace_all(job, data, size, first, &out_len);
+  munmap((void *)data, size);
+  if (!out)
+    return -1;
+
+  char temp[MAX_PATH];
+  snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+  int tfd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 st.st_mode & 07777);
+  int ok = tfd >= 0 && write_all(tfd, out, out_len);
+  if (tfd >= 0 && close(tfd) != 0)
+    ok = 0;
+  free(out);
+
+  if (!ok || rename(temp, path) != 0) {
+    unlink(temp);
+    return -1;
+  }
+  if (verbose_mode) {
+    printf("[VERBOSE] Patched paths in: %s\n", path);
+  }
+  return 1;
+}
+
+static void *rewrite_worker(void *arg) {
+  RewritePool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->next == pool->count && !pool->closed)
+      pthread_cond_wait(&pool->changed, &pool->lock);
+    if (pool->next == pool->count)
+      break;
+    const char *path = pool->paths[pool->next++];
+    pthread_mutex_unlock(&pool->lock);
+
+    int r = rewrite_file(pool, path);
+    int err = errno;
+    if (r < 0)
+      fprintf(stderr, "Failed to patch %s: %s\n", path, strerror(err));
+
+    pthread_mutex_lock(&pool->lock);
+    if (r > 0)
+      pool->rewritten++;
+    else if (r < 0)
+      pool->failed++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+RewritePool *rewrite_pool_new(const char *needle, const char *replacement,
+                              int workers) {
+  RewritePool *pool = calloc(1, sizeof(RewritePool));
+  if (!pool)
+    return NULL;
+
+  pool->needle = needle;
+  pool->needle_len = strlen(needle);
+  pool->replacement = replacement;
+  pool->replacement_len = strlen(replacement);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->changed, NULL);
+
+  if (workers > REWRITE_MAX_WORKERS)
+    workers = REWRITE_MAX_WORKERS;
+  while (pool->started < workers &&
+         pthread_create(&pool->threads[pool->started], NULL, rewrite_worker,
+                        pool) == 0)
+    pool->started++;
+  return pool;
+}
+
+/* Queues a file; it is rewritten by a worker while the caller carries on. */
+int rewrite_pool_add(RewritePool *pool, const char *path) {
+  if (pool->needle_len == 0)
+    return 1;
+
+  char *copy = strdup(path);
+  if (!copy)
+    return 0;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count == pool->cap) {
+    int cap = pool->cap ? pool->cap * 2 : 64;
+    char **grown = realloc(pool->paths, cap * sizeof(char *));
+    if (!grown) {
+      pthread_mutex_unlock(&pool->lock);
+      free(copy);
+      return 0;
+    }
+    pool->paths = grown;
+    pool->cap = cap;
+  }
+  pool->paths[pool->count++] = copy;
+  pthread_cond_signal(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+  return 1;
+}
+
+/*
+ * Waits for the queued files and frees the pool. Returns the number of
+ * files rewritten, or -1 if any could not be.
+ */
+int rewrite_pool_finish(RewritePool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->closed = 1;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+
+  /* Without threads the queue is worked off here. */
+  if (pool->started == 0)
+    rewrite_worker(pool);
+  for (int i = 0; i < pool->started; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  int result = pool->failed ? -1 : pool->rewritten;
+  for (int i = 0; i < pool->count; i++)
+    free(pool->paths[i]);
+  free(pool->paths);
+  pthread_cond_destroy(&pool->changed);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+  return result;
+}
+
+/* Queues the regular files under `dir`, skipping symlinks and dotfiles. */
+static int queue_tree(RewritePool *pool, const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return errno == ENOENT;
+
+  int ok = 1;
+  struct dirent *entry;
+  while (ok && (entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    char path[MAX_PATH];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >=
+        (int)sizeof(path))
+      continue;
+
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat(path, &st) != 0)
+        continue;
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+    }
+
+    if (type == DT_DIR)
+      ok = queue_tree(pool, path);
+    else if (type == DT_REG)
+      ok = rewrite_pool_add(pool, path);
+  }
+  closedir(d);
+  return ok;
+}
+
+/*
+ * Replaces every occurrence of `needle` in the text files under `root`,
+ * spreading the files over up to `workers` threads. Returns the number of
+ * files rewritten, or -1 if any could not be.
+ */
+int rewrite_tree(const char *root, const char *needle,
+                 const char *replacement, int workers) {
+  RewritePool *pool = rewrite_pool_new(needle, replacement, workers);
+  if (!pool)
+    return -1;
+  int queued = queue_tree(pool, root);
+  int result = rewrite_pool_finish(pool);
+  return queued ? result : -1;
+}
@@ -0,0 +1,25 @@
+#ifndef VICPKG_REWRITE_H
+#define VICPKG_REWRITE_H
+
+/*
+ * In-place string replacement across a directory tree, used to point
+ * legacy packages' hard-coded /data/purplpkg paths at their install
+ * directory. Each file is mapped and searched without copying; only files
+ * that contain the needle are rewritten, each through one write into a
+ * temporary file that is renamed over the original. Files whose first
+ * 512 bytes hold a NUL are taken to be binaries and left alone, since
+ * changing their length would break them.
+ */
+
+int rewrite_tree(const char *root, const char *needle,
+                 const char *replacement, int workers);
+
+/* A pool of worker threads that rewrites files as they are queued. */
+typedef struct RewritePool RewritePool;
+
+RewritePool *rewrite_pool_new(const char *needle, const char *replacement,
+                              int workers);
+int rewrite_pool_add(RewritePool *pool, const char *path);
+int rewrite_pool_finish(RewritePool *pool);
+
+#endif
@@ -0,0 +1,187 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "search.h"
+
+#define TERM_MAX 64
+
+enum { MATCH_NONE, MATCH_INSIDE, MATCH_WORD, MATCH_PREFIX, MATCH_EXACT };
+
+/* Score of a term by the field and the kind of match it made there. */
+static const struct {
+  int field;
+  int score[MATCH_EXACT + 1];
+} weights[] = {
+    {IDX_PACKAGE, {0, 40, 50, 70, 100}},
+    {IDX_NAME, {0, 20, 25, 30, 35}},
+    {IDX_SECTION, {0, 8, 10, 12, 15}},
+    {IDX_DESCRIPTION, {0, 5, 8, 8, 8}},
+};
+
+typedef struct {
+  char text[TERM_MAX];
+  size_t len;
+} Term;
+
+static int split_terms(const char *query, Term *terms) {
+  int count = 0;
+
+  while (*query && count < SEARCH_MAX_TERMS) {
+    while (isspace((unsigned char)*query))
+      query++;
+    if (!*query)
+      break;
+
+    size_t len = 0;
+    for (; *query && !isspace((unsigned char)*query); query++) {
+      if (len + 1 < TERM_MAX)
+        terms[count].text[len++] = (char)tolower((unsigned char)*query);
+    }
+    terms[count].text[len] = '\0';
+    terms[count].len = len;
+    count++;
+  }
+  return count;
+}
+
+static int match_quality(const char *text, const Term *term) {
+  int best = MATCH_NONE;
+
+  for (const char *p = text; *p; p++) {
+    if (strncasecmp(p, term->text, term->len) != 0)
+      continue;
+    if (p == text)
+      return p[term->len] == '\0' ? MATCH_EXACT : MATCH_PREFIX;
+    if (!isalnum((unsigned char)p[-1]))
+      best = MATCH_WORD;
+    else if (best == MATCH_NONE)
+      best = MATCH_INSIDE;
+  }
+  return best;
+}
+
+static int term_score(const PackageIndex *idx, const PkgIndexEntry *e,
+                      const Term *term) {
+  int best = 0;
+  size_t fields = (e->flags & PKGINDEX_FLAG_LEGACY)
+                      ? 1
+                      : sizeof(weights) / sizeof(weights[0]);
+
+  for (size_t i = 0; i < fields; i++) {
+    int q = match_quality(pkgindex_field(idx, e, weights[i].field), term);
+    if (weights[i].score[q] > best)
+      best = weights[i].score[q];
+  }
+  return best;
+}
+
+/*
+ * Narrows the search to the shortest posting list among the terms'
+ * trigrams. Returns 0 when some trigram occurs nowhere, so nothing can
+ * match; *ids stays NULL when every term is too short to have one.
+ */
+static int pick_candidates(const PackageIndex *idx, const Term *terms,
+                           int count, const uint32_t **ids, uint32_t *n) {
+  *ids = NULL;
+  *n = 0;
+
+  for (int t = 0; t < count; t++) {
+    for (size_t i = 0; i + 3 <= terms[t].len; i++) {
+      uint32_t len;
+      const uint32_t *list = pkgindex_postings(idx, terms[t].text + i, &len);
+      if (!list)
+        return 0;
+      if (!*ids || len < *n) {
+        *ids = list;
+        *n = len;
+      }
+    }
+  }
+  return 1;
+}
+
+static const PackageIndex *sort_index;
+
+static int by_package(const void *a, const void *b) {
+  const SearchHit *x = a, *y = b;
+  int cmp = strcmp(pkgindex_field(sort_index, x->entry, IDX_PACKAGE),
+                   pkgindex_field(sort_index, y->entry, IDX_PACKAGE));
+  if (cmp != 0)
+    return cmp;
+  if (x->score != y->score)
+    return y->score - x->score;
+  /* Entries are stored in repository priority order. */
+  return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+static int by_rank(const void *a, const void *b) {
+  const SearchHit *x = a, *y = b;
+  if (x->score != y->score)
+    return y->score - x->score;
+  return strcmp(pkgindex_field(sort_index, x->entry, IDX_PACKAGE),
+                pkgindex_field(sort_index, y->entry, IDX_PACKAGE));
+}
+
+/* Returns the number of hits stored in *hits (to be freed), or -1. */
+int search_index(const PackageIndex *idx, const char *query,
+                 SearchFilter filter, void *user, SearchHit **hits) {
+  Term terms[SEARCH_MAX_TERMS];
+  int term_count = split_terms(query, terms);
+  const uint32_t *ids;
+  uint32_t n;
+
+  *hits = NULL;
+  if (!idx->hdr || term_count == 0 ||
+      !pick_candidates(idx, terms, term_count, &ids, &n))
+    return 0;
+  if (!ids)
+    n = idx->hdr->entry_count;
+
+  SearchHit *out = malloc((n ? n : 1) * sizeof(SearchHit));
+  if (!out)
+    return -1;
+
+  int count = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t id = ids ? ids[i] : i;
+    if (id >= idx->hdr->entry_count)
+      continue;
+
+    const PkgIndexEntry *e = &idx->entries[id];
+    if (filter && !filter(user, idx, e))
+      continue;
+
+    int score = 0;
+    for (int t = 0; t < term_count; t++) {
+      int s = term_score(idx, e, &terms[t]);
+      if (s == 0) {
+        score = 0;
+        break;
+      }
+      score += s;
+    }
+    if (score > 0) {
+      out[count].entry = e;
+      out[count].score = score;
+      count++;
+    }
+  }
+
+  /* Keep the best entry of each package, then rank across packages. */
+  sort_index = idx;
+  qsort(out, count, sizeof(SearchHit), by_package);
+  int unique = 0;
+  for (int i = 0; i < count; i++) {
+    if (unique > 0 &&
+        strcmp(pkgindex_field(idx, out[unique - 1].entry, IDX_PACKAGE),
+               pkgindex_field(idx, out[i].entry, IDX_PACKAGE)) == 0)
+      continue;
+    out[unique++] = out[i];
+  }
+  qsort(out, unique, sizeof(SearchHit), by_rank);
+
+  *hits = out;
+  return unique;
+}
@@ -0,0 +1,27 @@
+#ifndef VICPKG_SEARCH_H
+#define VICPKG_SEARCH_H
+
+#include "index.h"
+
+/*
+ * Package search over the index's trigram table. The query is split into
+ * whitespace separated terms, all of which must occur (case-insensitively)
+ * in an entry's Package, Name, Description or Section. Hits are ranked by
+ * where each term matched, and only the best entry per package is kept.
+ */
+
+#define SEARCH_MAX_TERMS 8
+
+typedef struct {
+  const PkgIndexEntry *entry;
+  int score;
+} SearchHit;
+
+/* Returns 0 to leave an entry out of the results. */
+typedef int (*SearchFilter)(void *user, const PackageIndex *idx,
+                            const PkgIndexEntry *entry);
+
+int search_index(const PackageIndex *idx, const char *query,
+                 SearchFilter filter, void *user, SearchHit **hits);
+
+#endif
@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "fetch.h"
+#include "segment.h"
+#include "sha256.h"
+#include "trace.h"
+#include "vicpkg.h"
+
+#define MIRROR_MAX_FAILURES 3
+#define SEGMENT_MIN_SPLIT (256 * 1024)
+#define HASH_CHUNK (256 * 1024)
+
+enum { SEG_FREE, SEG_ACTIVE, SEG_DONE };
+
+typedef struct {
+  const char *url;
+  long long bytes;
+  long long busy_us;
+  int failures;
+  int disabled;
+} Mirror;
+
+/* Bytes [start, end) of the file; everything before `pos` is written. */
+typedef struct {
+  long long start;
+  long long end;
+  long long pos;
+  int state;
+  int mirror;
+} Segment;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  Mirror *mirrors;
+  int mirror_count;
+  Segment *segs;
+  int seg_count;
+  int seg_cap;
+  int fd;
+  long long size;
+
+  /* Everything before `hashed` has gone through `sha`. */
+  Sha256 sha;
+  long long hashed;
+  int hashing;
+  int failed;
+} SegmentJob;
+
+typedef struct {
+  SegmentJob *job;
+  int seg;
+  FetchResponse resp;
+  long long bytes;
+  int refused;
+  int write_failed;
+} Transfer;
+
+typedef struct {
+  SegmentJob *job;
+  int mirror;
+} Worker;
+
+static int add_segment(SegmentJob *job, long long start, long long end) {
+  if (job->seg_count == job->seg_cap) {
+    int cap = job->seg_cap ? job->seg_cap * 2 : 64;
+    Segment *grown = realloc(job->segs, cap * sizeof(Segment));
+    if (!grown)
+      return -1;
+    job->segs = grown;
+    job->seg_cap = cap;
+  }
+
+  Segment *s = &job->segs[job->seg_count];
+  s->start = start;
+  s->end = end;
+  s->pos = start;
+  s->state = SEG_FREE;
+  s->mirror = -1;
+  return job->seg_count++;
+}
+
+/* Bytes per microsecond one connection to `m` has managed so far. */
+static double mirror_rate(const Mirror *m) {
+  return m->busy_us > 0 ? (double)m->bytes / m->busy_us : 0;
+}
+
+static int pick_mirror(const SegmentJob *job, int preferred) {
+  if (!job->mirrors[preferred].disabled)
+    return preferred;
+
+  int best = -1;
+  for (int i = 0; i < job->mirror_count; i++) {
+    if (!job->mirrors[i].disabled &&
+        (best < 0 || mirror_rate(&job->mirrors[i]) >
+                         mirror_rate(&job->mirrors[best])))
+      best = i;
+  }
+  return best;
+}
+
+/*
+ * Returns a free segment, or else splits off the back half of the active
+ * one expected to finish last, judged by its mirror's rate. -1 when
+ * neither is possible. Called with the lock held.
+ */
+static int take_segment(SegmentJob *job) {
+  for (int i = 0; i < job->seg_count; i++) {
+    if (job->segs[i].state == SEG_FREE)
+      return i;
+  }
+
+  int slowest = -1;
+  double slowest_eta = 0;
+  for (int i = 0; i < job->seg_count; i++) {
+    const Segment *s = &job->segs[i];
+    long long remaining = s->end - s->pos;
+    if (s->state != SEG_ACTIVE || remaining < 2 * SEGMENT_MIN_SPLIT)
+      continue;
+    double rate = mirror_rate(&job->mirrors[s->mirror]);
+    double eta = rate > 0 ? remaining / rate : 1e18 + remaining;
+    if (slowest < 0 || eta > slowest_eta) {
+      slowest = i;
+      slowest_eta = eta;
+    }
+  }
+  if (slowest < 0)
+    return -1;
+
+  Segment *s = &job->segs[slowest];
+  long long mid = s->pos + (s->end - s->pos) / 2;
+  int split = add_segment(job, mid, job->segs[slowest].end);
+  if (split >= 0)
+    job->segs[slowest].end = mid;
+  return split;
+}
+
+static int any_active(const SegmentJob *job) {
+  for (int i = 0; i < job->seg_count; i++) {
+    if (job->segs[i].state == SEG_ACTIVE)
+      return 1;
+  }
+  return 0;
+}
+
+static int hash_range(SegmentJob *job, long long from, long long to) {
+  char *buf = malloc(HASH_CHUNK);
+  if (!buf)
+    return 0;
+
+  while (from < to) {
+    size_t want = to - from < HASH_CHUNK ? (size_t)(to - from) : HASH_CHUNK;
+    ssize_t r = pread(job->fd, buf, want, from);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      free(buf);
+      return 0;
+    }
+    sha256_update(&job->sha, buf, r);
+    from += r;
+  }
+  free(buf);
+  return 1;
+}
+
+/*
+ * Hashes completed segments that continue the hashed prefix, so checking
+ * the whole file overlaps with the download. One thread hashes at a time;
+ * the lock is dropped while it reads. Called with the lock held.
+ */
+static void advance_hash(SegmentJob *job) {
+  if (job->hashing)
+    return;
+  job->hashing = 1;
+
+  while (!job->failed) {
+    int next = -1;
+    for (int i = 0; i < job->seg_count; i++) {
+      const Segment *s = &job->segs[i];
+      if (s->state == SEG_DONE && s->start <= job->hashed &&
+          job->hashed < s->end) {
+        next = i;
+        break;
+      }
+    }
+    if (next < 0)
+      break;
+
+    long long from = job->hashed, to = job->segs[next].end;
+    pthread_mutex_unlock(&job->lock);
+    int ok = hash_range(job, from, to);
+    pthread_mutex_lock(&job->lock);
+    if (!ok)
+      job->failed = 1;
+    else
+      job->hashed = to;
+  }
+  job->hashing = 0;
+}
+
+static int segment_sink(void *user, const char *data, size_t len) {
+  Transfer *t = user;
+  SegmentJob *job = t->job;
+
+  /* A 200 would be the whole file, not this range. */
+  if (t->resp.status != 206) {
+    t->refused = 1;
+    return 0;
+  }
+
+  pthread_mutex_lock(&job->lock);
+  long long pos = job->segs[t->seg].pos;
+  long long end = job->segs[t->seg].end;
+  pthread_mutex_unlock(&job->lock);
+
+  /* The tail may have been split off to another mirror meanwhile. */
+  size_t n = pos >= end ? 0 : end - pos < (long long)len ? (size_t)(end - pos)
+                                                          : len;
+  for (size_t done = 0; done < n;) {
+    ssize_t w = pwrite(job->fd, data + done, n - done, pos + done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      t->write_failed = 1;
+      return 0;
+    }
+    done += w;
+  }
+  trace_add(TRACE_BYTES_OUT, n);
+
+  pthread_mutex_lock(&job->lock);
+  job->segs[t->seg].pos = pos + n;
+  pthread_mutex_unlock(&job->lock);
+  t->bytes += n;
+  return n == len;
+}
+
+/* The end of the stretch at the start of the file that is fully written. */
+static long long written_prefix(const SegmentJob *job) {
+  long long prefix = 0;
+  for (int moved = 1; moved;) {
+    moved = 0;
+    for (int i = 0; i < job->seg_count; i++) {
+      const Segment *s = &job->segs[i];
+      long long end = s->state == SEG_DONE ? s->end : s->pos;
+      if (s->start <= prefix && prefix < end) {
+        prefix = end;
+        moved = 1;
+      }
+    }
+  }
+  return prefix;
+}
+
+static void *segment_worker(void *arg) {
+  Worker *w = arg;
+  SegmentJob *job = w->job;
+
+  pthread_mutex_lock(&job->lock);
+  while (!job->failed) {
+    int m = pick_mirror(job, w->mirror);
+    if (m < 0) {
+      job->failed = 1;
+      break;
+    }
+    w->mirror = m;
+
+    int s = take_segment(job);
+    if (s < 0) {
+      /* An active segment may yet fail and need someone to retry it. */
+      if (!any_active(job))
+        break;
+      pthread_cond_wait(&job->changed, &job->lock);
+      continue;
+    }
+
+    Segment *seg = &job->segs[s];
+    seg->state = SEG_ACTIVE;
+    seg->mirror = m;
+
+    FetchOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.ranged = 1;
+    opts.range_start = seg->pos;
+    opts.range_end = seg->end;
+
+    Transfer t;
+    memset(&t, 0, sizeof(t));
+    t.job = job;
+    t.seg = s;
+    const char *url = job->mirrors[m].url;
+    pthread_mutex_unlock(&job->lock);
+
+    long long started = trace_now_us();
+    fetch_url(url, &opts, segment_sink, &t, &t.resp);
+    long long elapsed = trace_now_us() - started;
+
+    pthread_mutex_lock(&job->lock);
+    Mirror *mirror = &job->mirrors[m];
+    mirror->bytes += t.bytes;
+    mirror->busy_us += elapsed;
+    seg = &job->segs[s];
+
+    if (seg->pos >= seg->end) {
+      seg->state = SEG_DONE;
+      advance_hash(job);
+    } else {
+      seg->state = SEG_FREE;
+      if (t.write_failed) {
+        job->failed = 1;
+      } else if (t.refused || ++mirror->failures >= MIRROR_MAX_FAILURES) {
+        if (verbose_mode && !mirror->disabled) {
+          printf("[VERBOSE] Dropping mirror %s (HTTP %d)\n", url,
+                 t.resp.status);
+        }
+        mirror->disabled = 1;
+      }
+    }
+    pthread_cond_broadcast(&job->changed);
+  }
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+/*
+ * Downloads `size` bytes into `fd` from the mirrors in `urls`, which must
+ * all serve the same file, and checks the result against `sha256`. The
+ * first `*done` bytes are taken to be in `fd` already. On return `*done` is
+ * how much of the start of the file is in place, so that a failed download
+ * can be resumed; it is 0 if the checksum did not match.
+ */
+int segment_fetch(const char *const *urls, int url_count, long long size,
+                  int fd, long long *done, const char *sha256) {
+  if (url_count <= 0 || size <= 0 || *done > size || ftruncate(fd, size) != 0)
+    return 0;
+
+  SegmentJob job;
+  memset(&job, 0, sizeof(job));
+  job.fd = fd;
+  job.size = size;
+  job.mirror_count = url_count;
+  job.mirrors = calloc(url_count, sizeof(Mirror));
+  if (!job.mirrors)
+    return 0;
+  for (int i = 0; i < url_count; i++)
+    job.mirrors[i].url = urls[i];
+  if (*done > 0 && add_segment(&job, 0, *done) == 0)
+    job.segs[0].state = SEG_DONE;
+  for (long long start = *done; start < size; start += SEGMENT_SIZE) {
+    long long end = start + SEGMENT_SIZE < size ? start + SEGMENT_SIZE : size;
+    if (add_segment(&job, start, end) < 0) {
+      free(job.segs);
+      free(job.mirrors);
+      return 0;
+    }
+  }
+  sha256_init(&job.sha);
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.changed, NULL);
+
+  /* Connections start spread evenly over the mirrors. */
+  Worker workers[SEGMENT_WORKERS];
+  pthread_t threads[SEGMENT_WORKERS];
+  int started = 0;
+  for (int i = 0; i < SEGMENT_WORKERS; i++) {
+    workers[i].job = &job;
+    workers[i].mirror = i % url_count;
+    if (pthread_create(&threads[started], NULL, segment_worker,
+                       &workers[i]) == 0)
+      started++;
+  }
+  if (started == 0)
+    segment_worker(&workers[0]);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  /* Only a resumed prefix may be left to hash. */
+  pthread_mutex_lock(&job.lock);
+  advance_hash(&job);
+  pthread_mutex_unlock(&job.lock);
+  *done = written_prefix(&job);
+
+  int ok = !job.failed && job.hashed == size;
+  if (ok && sha256 && sha256[0]) {
+    char hash[SHA256_HEX_SIZE];
+    sha256_final_hex(&job.sha, hash);
+    if (strcasecmp(hash, sha256) != 0) {
+      fprintf(stderr, "Checksum mismatch for segmented download of %s\n",
+              urls[0]);
+      *done = 0;
+      ok = 0;
+    }
+  }
+
+  if (verbose_mode) {
+    for (int i = 0; i < url_count; i++) {
+      const Mirror *m = &job.mirrors[i];
+      printf("[VERBOSE] %s: %lld bytes at %.1f KB/s per connection%s\n",
+             m->url, m->bytes, mirror_rate(m) * 1e6 / 1024,
+             m->disabled ? " (dropped)" : "");
+    }
+  }
+
+  pthread_cond_destroy(&job.changed);
+  pthread_mutex_destroy(&job.lock);
+  free(job.segs);
+  free(job.mirrors);
+  return ok;
+}
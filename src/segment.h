@@ -0,0 +1,18 @@
+#ifndef VICPKG_SEGMENT_H
+#define VICPKG_SEGMENT_H
+
+/*
+ * Segmented download of one file from several mirrors at once. The file is
+ * cut into SEGMENT_SIZE ranges that SEGMENT_WORKERS connections pull from
+ * a shared queue, so a slow mirror simply ends up serving fewer of them.
+ * A range that fails goes back on the queue from where it stopped. A
+ * mirror that fails repeatedly, or ignores Range, is dropped. Once the
+ * queue is empty, idle connections split the range that is furthest from
+ * finishing and take over its second half. The ranges are written into
+ * `fd` at their offsets and hashed in file order as they complete.
+ */
+
+int segment_fetch(const char *const *urls, int url_count, long long size,
+                  int fd, long long *done, const char *sha256);
+
+#endif
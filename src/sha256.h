@@ -0,0 +1,22 @@
+#ifndef VICPKG_SHA256_H
+#define VICPKG_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_HEX_SIZE 65
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char block[64];
+  size_t block_len;
+} Sha256;
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, unsigned char digest[32]);
+void sha256_final_hex(Sha256 *ctx, char hex[SHA256_HEX_SIZE]);
+void sha256_hex(const void *data, size_t len, char hex[SHA256_HEX_SIZE]);
+
+#endif
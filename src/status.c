@@ -0,0 +1,485 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fsutil.h"
+#include "status.h"
+
+/* Version 1 databases end their header before the path table fields. */
+#define STATUS_V1_HEADER offsetof(StatusHeader, path_count)
+
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_path(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Finds the next non-empty line of a manifest, trimmed, from *pos. */
+static int manifest_line(const char *text, size_t *pos, size_t *start,
+                         size_t *len) {
+  while (text[*pos]) {
+    size_t s = *pos;
+    size_t e = s + strcspn(text + s, "\n");
+    *pos = text[e] ? e + 1 : e;
+
+    while (s < e && isspace((unsigned char)text[s]))
+      s++;
+    while (e > s && isspace((unsigned char)text[e - 1]))
+      e--;
+    if (e > s) {
+      *start = s;
+      *len = e - s;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int status_open(StatusDB *db) {
+  memset(db, 0, sizeof(*db));
+
+  int fd = open(STATUS_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StatusHeader)) {
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  const StatusHeader *hdr = map;
+  size_t header_size =
+      hdr->version == 1 ? STATUS_V1_HEADER : sizeof(StatusHeader);
+  if (hdr->magic != STATUS_MAGIC ||
+      (hdr->version != STATUS_VERSION && hdr->version != 1) ||
+      (size_t)st.st_size < header_size || hdr->entries_offset < header_size ||
+      hdr->total_size != (uint32_t)st.st_size ||
+      hdr->strings_offset + hdr->strings_size != hdr->total_size ||
+      hdr->entries_offset + hdr->entry_count * sizeof(StatusEntry) >
+          hdr->strings_offset ||
+      hdr->strings_size == 0 ||
+      ((const char *)map)[hdr->total_size - 1] != '\0') {
+    fprintf(stderr, "Ignoring damaged package database %s\n", STATUS_FILE);
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  db->base = map;
+  db->size = st.st_size;
+  db->hdr = hdr;
+  db->entries = (const StatusEntry *)(db->base + hdr->entries_offset);
+  db->strings = db->base + hdr->strings_offset;
+
+  if (hdr->version >= 2 && hdr->path_bucket_count > 0 &&
+      hdr->paths_offset + hdr->path_count * sizeof(StatusPath) <=
+          hdr->path_buckets_offset &&
+      hdr->path_buckets_offset + hdr->path_bucket_count * sizeof(uint32_t) <=
+          hdr->strings_offset) {
+    db->paths = (const StatusPath *)(db->base + hdr->paths_offset);
+    db->path_buckets = (const uint32_t *)(db->base + hdr->path_buckets_offset);
+    db->path_bucket_count = hdr->path_bucket_count;
+  }
+  return 1;
+}
+
+void status_close(StatusDB *db) {
+  if (db->base)
+    munmap((void *)db->base, db->size);
+  memset(db, 0, sizeof(*db));
+}
+
+int status_count(const StatusDB *db) {
+  return db->hdr ? (int)db->hdr->entry_count : 0;
+}
+
+const char *status_string(const StatusDB *db, uint32_t offset) {
+  if (!db->hdr || offset >= db->hdr->strings_size)
+    return "";
+  return db->strings + offset;
+}
+
+const StatusEntry *status_lookup(const StatusDB *db, const char *name) {
+  int lo = 0, hi = status_count(db) - 1;
+
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(name, status_string(db, db->entries[mid].name));
+    if (cmp == 0)
+      return &db->entries[mid];
+    if (cmp < 0)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
+}
+
+/* Returns the package whose manifest lists `path`, or NULL. */
+const StatusEntry *status_owner(const StatusDB *db, const char *path) {
+  if (!db->paths)
+    return NULL;
+
+  size_t len = strlen(path);
+  uint32_t hash = hash_path(path, len);
+  uint32_t i = db->path_buckets[hash & (db->path_bucket_count - 1)];
+
+  while (i > 0 && i <= db->hdr->path_count) {
+    const StatusPath *p = &db->paths[i - 1];
+    if (p->hash == hash && p->len == len &&
+        p->path + len < db->hdr->strings_size &&
+        memcmp(db->strings + p->path, path, len) == 0 &&
+        p->entry < db->hdr->entry_count)
+      return &db->entries[p->entry];
+    i = p->next;
+  }
+  return NULL;
+}
+
+/* Copies the installed version of `name` into `version` ("" if none). */
+int status_installed_version(const StatusDB *db, const char *name,
+                             char *version, size_t size) {
+  const StatusEntry *e = status_lookup(db, name);
+  snprintf(version, size, "%s", e ? status_string(db, e->version) : "");
+  return e != NULL;
+}
+
+static StatusRecord *edit_add(StatusEdit *edit) {
+  if (edit->count == edit->cap) {
+    int cap = edit->cap ? edit->cap * 2 : 32;
+    StatusRecord *records = realloc(edit->records, cap * sizeof(StatusRecord));
+    if (!records)
+      return NULL;
+    edit->records = records;
+    edit->cap = cap;
+  }
+  StatusRecord *r = &edit->records[edit->count++];
+  memset(r, 0, sizeof(*r));
+  return r;
+}
+
+int status_edit_load(StatusEdit *edit, const StatusDB *db) {
+  memset(edit, 0, sizeof(*edit));
+
+  for (int i = 0; i < status_count(db); i++) {
+    const StatusEntry *e = &db->entries[i];
+    StatusRecord *r = edit_add(edit);
+    if (!r)
+      return 0;
+
+    snprintf(r->name, sizeof(r->name), "%s", status_string(db, e->name));
+    snprintf(r->version, sizeof(r->version), "%s",
+             status_string(db, e->version));
+    snprintf(r->repo, sizeof(r->repo), "%s", status_string(db, e->repo));
+    snprintf(r->sha256, sizeof(r->sha256), "%s", status_string(db, e->sha256));
+    r->flags = e->flags;
+    r->installed = e->installed;
+    r->files = strdup(status_string(db, e->files));
+    if (!r->files)
+      return 0;
+  }
+  return 1;
+}
+
+/* Returns the record for `name`, adding an empty one if there is none. */
+StatusRecord *status_edit_set(StatusEdit *edit, const char *name) {
+  for (int i = 0; i < edit->count; i++) {
+    if (strcmp(edit->records[i].name, name) == 0)
+      return &edit->records[i];
+  }
+
+  StatusRecord *r = edit_add(edit);
+  if (r)
+    snprintf(r->name, sizeof(r->name), "%s", name);
+  return r;
+}
+
+int status_edit_remove(StatusEdit *edit, const char *name) {
+  for (int i = 0; i < edit->count; i++) {
+    if (strcmp(edit->records[i].name, name) != 0)
+      continue;
+    free(edit->records[i].files);
+    edit->records[i] = edit->records[--edit->count];
+    return 1;
+  }
+  return 0;
+}
+
+void status_edit_free(StatusEdit *edit) {
+  for (int i = 0; i < edit->count; i++)
+    free(edit->records[i].files);
+  free(edit->records);
+  memset(edit, 0, sizeof(*edit));
+}
+
+static int by_name(const void *a, const void *b) {
+  return strcmp(((const StatusRecord *)a)->name,
+                ((const StatusRecord *)b)->name);
+}
+
+static uint32_t pool_add(char *pool, uint32_t *used, const char *s) {
+  if (!s || !*s)
+    return 0;
+  uint32_t off = *used;
+  size_t len = strlen(s) + 1;
+  memcpy(pool + off, s, len);
+  *used += len;
+  return off;
+}
+
+/* Serializes the edit into a malloc'd database image. */
+char *status_edit_image(StatusEdit *edit, size_t *len) {
+  qsort(edit->records, edit->count, sizeof(StatusRecord), by_name);
+
+  size_t strings_size = 1;
+  uint32_t path_count = 0;
+  for (int i = 0; i < edit->count; i++) {
+    const StatusRecord *r = &edit->records[i];
+    strings_size += strlen(r->name) + strlen(r->version) + strlen(r->repo) +
+                    strlen(r->sha256) + (r->files ? strlen(r->files) : 0) + 5;
+
+    size_t pos = 0, start, n;
+    while (r->files && manifest_line(r->files, &pos, &start, &n))
+      path_count++;
+  }
+
+  uint32_t bucket_count = 16;
+  while (bucket_count < path_count * 2)
+    bucket_count *= 2;
+
+  StatusHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = STATUS_MAGIC;
+  hdr.version = STATUS_VERSION;
+  hdr.entry_count = edit->count;
+  hdr.entries_offset = sizeof(hdr);
+  hdr.path_count = path_count;
+  hdr.path_bucket_count = bucket_count;
+  hdr.paths_offset = hdr.entries_offset + edit->count * sizeof(StatusEntry);
+  hdr.path_buckets_offset = hdr.paths_offset + path_count * sizeof(StatusPath);
+  hdr.strings_offset =
+      hdr.path_buckets_offset + bucket_count * sizeof(uint32_t);
+
+  char *image = calloc(1, hdr.strings_offset + strings_size);
+  if (!image)
+    return NULL;
+
+  StatusEntry *entries = (StatusEntry *)(image + hdr.entries_offset);
+  StatusPath *paths = (StatusPath *)(image + hdr.paths_offset);
+  uint32_t *buckets = (uint32_t *)(image + hdr.path_buckets_offset);
+  char *pool = image + hdr.strings_offset;
+  uint32_t used = 1;
+  uint32_t path = 0;
+
+  for (int i = 0; i < edit->count; i++) {
+    const StatusRecord *r = &edit->records[i];
+    entries[i].name = pool_add(pool, &used, r->name);
+    entries[i].version = pool_add(pool, &used, r->version);
+    entries[i].repo = pool_add(pool, &used, r->repo);
+    entries[i].sha256 = pool_add(pool, &used, r->sha256);
+    entries[i].files = pool_add(pool, &used, r->files);
+    entries[i].flags = r->flags;
+    entries[i].installed = r->installed;
+
+    /* Chains are kept in insertion order so the first owner wins. */
+    size_t pos = 0, start, n;
+    while (r->files && manifest_line(r->files, &pos, &start, &n)) {
+      StatusPath *p = &paths[path];
+      p->hash = hash_path(r->files + start, n);
+      p->entry = i;
+      p->path = entries[i].files + start;
+      p->len = n;
+
+      uint32_t *link = &buckets[p->hash & (bucket_count - 1)];
+      while (*link)
+        link = &paths[*link - 1].next;
+      *link = ++path;
+    }
+  }
+
+  hdr.strings_size = used;
+  hdr.total_size = hdr.strings_offset + used;
+  memcpy(image, &hdr, sizeof(hdr));
+  *len = hdr.total_size;
+  return image;
+}
+
+/* Replaces STATUS_FILE with the edited database. */
+int status_edit_save(StatusEdit *edit) {
+  size_t len;
+  char *image = status_edit_image(edit, &len);
+  if (!image)
+    return 0;
+
+  char temp_path[MAX_PATH];
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", STATUS_FILE,
+           (int)getpid());
+
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int ok = fd >= 0;
+  for (size_t done = 0; ok && done < len;) {
+    ssize_t w = write(fd, image + done, len - done);
+    ok = w > 0;
+    done += ok ? (size_t)w : 0;
+  }
+  free(image);
+
+  if (fd >= 0) {
+    ok = fsync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+  }
+  if (ok && rename(temp_path, STATUS_FILE) == 0)
+    return 1;
+
+  fprintf(stderr, "Failed to write %s\n", STATUS_FILE);
+  remove(temp_path);
+  return 0;
+}
+
+/* Serializes read-modify-write cycles of the database within the process. */
+void status_lock(void) {
+  pthread_mutex_lock(&status_mutex);
+}
+
+void status_unlock(void) {
+  pthread_mutex_unlock(&status_mutex);
+}
+
+static char *read_text(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return NULL;
+
+  size_t len = 0, cap = 4096;
+  char *text = malloc(cap);
+  size_t n;
+  while (text && (n = fread(text + len, 1, cap - len - 1, f)) > 0) {
+    len += n;
+    if (cap - len - 1 == 0) {
+      char *grown = realloc(text, cap * 2);
+      if (!grown) {
+        free(text);
+        text = NULL;
+        break;
+      }
+      text = grown;
+      cap *= 2;
+    }
+  }
+  fclose(f);
+  if (text)
+    text[len] = '\0';
+  return text;
+}
+
+/* Rewrites a version 1 database so that it gains the path table. */
+static int upgrade_database(void) {
+  StatusDB db;
+  StatusEdit edit;
+
+  if (!status_open(&db))
+    return 1;
+  if (db.hdr->version == STATUS_VERSION) {
+    status_close(&db);
+    return 1;
+  }
+
+  int ok = status_edit_load(&edit, &db);
+  status_close(&db);
+  ok = ok && status_edit_save(&edit);
+  status_edit_free(&edit);
+  return ok;
+}
+
+/* Whether status_migrate() has anything to do, judged from the header. */
+int status_needs_migration(void) {
+  int fd = open(STATUS_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    struct stat st;
+    return stat(VERSIONS_DIR, &st) == 0 && S_ISDIR(st.st_mode);
+  }
+
+  uint32_t head[2];
+  int old = read(fd, head, sizeof(head)) == (ssize_t)sizeof(head) &&
+            head[0] == STATUS_MAGIC && head[1] == 1;
+  close(fd);
+  return old;
+}
+
+/*
+ * Imports the per-package files of VERSIONS_DIR and FILES_DIR into a new
+ * database and removes them once it is written.
+ */
+int status_migrate(void) {
+  if (access(STATUS_FILE, F_OK) == 0)
+    return upgrade_database();
+
+  DIR *dir = opendir(VERSIONS_DIR);
+  if (!dir)
+    return 1;
+
+  StatusEdit edit;
+  int ok = 1;
+  memset(&edit, 0, sizeof(edit));
+
+  struct dirent *d;
+  while (ok && (d = readdir(dir)) != NULL) {
+    if (d->d_name[0] == '.' || strstr(d->d_name, STAGED_SUFFIX))
+      continue;
+
+    char path[MAX_PATH];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", VERSIONS_DIR, d->d_name);
+    char *version = read_text(path);
+    StatusRecord *r = edit_add(&edit);
+    if (!version || !r) {
+      free(version);
+      ok = 0;
+      break;
+    }
+
+    snprintf(r->name, sizeof(r->name), "%s", d->d_name);
+    snprintf(r->version, sizeof(r->version), "%s", version);
+    r->version[strcspn(r->version, "\r\n")] = '\0';
+    free(version);
+    if (stat(path, &st) == 0)
+      r->installed = (long long)st.st_mtime;
+
+    snprintf(path, sizeof(path), "%s/%s", FILES_DIR, d->d_name);
+    r->files = read_text(path);
+    if (r->files && strncmp(r->files, LEGACY_INSTALL_DIR "/",
+                            strlen(LEGACY_INSTALL_DIR) + 1) == 0)
+      r->flags |= STATUS_FLAG_LEGACY;
+  }
+  closedir(dir);
+
+  ok = ok && status_edit_save(&edit);
+  if (ok) {
+    if (verbose_mode) {
+      printf("[VERBOSE] Migrated %d packages to %s\n", edit.count,
+             STATUS_FILE);
+    }
+    fs_remove_tree(VERSIONS_DIR);
+    fs_remove_tree(FILES_DIR);
+  }
+  status_edit_free(&edit);
+  return ok;
+}
@@ -0,0 +1,106 @@
+#ifndef VICPKG_STATUS_H
+#define VICPKG_STATUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vicpkg.h"
+
+#define STATUS_MAGIC 0x54415453u
+#define STATUS_VERSION 2
+
+#define STATUS_FLAG_LEGACY 1u
+
+/*
+ * Installed-package database in STATUS_FILE: a header, an entry table sorted
+ * by package name, a hash table from every manifest path to its package and
+ * a string pool, mapped read-only and searched in place. Changes are made to
+ * a StatusEdit copy whose image replaces the whole file with rename(), either
+ * directly or as a staged file of an install.
+ */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t strings_size;
+  uint32_t entries_offset;
+  uint32_t strings_offset;
+  uint32_t total_size;
+  uint32_t reserved;
+
+  /* Version 2: the path table. */
+  uint32_t path_count;
+  uint32_t path_bucket_count;
+  uint32_t paths_offset;
+  uint32_t path_buckets_offset;
+} StatusHeader;
+
+typedef struct {
+  uint32_t name;
+  uint32_t version;
+  uint32_t repo;
+  uint32_t sha256;
+  uint32_t files;
+  uint32_t flags;
+  int64_t installed;
+} StatusEntry;
+
+/* A manifest line: `len` bytes at `path` in the pool, owned by `entry`. */
+typedef struct {
+  uint32_t hash;
+  uint32_t entry;
+  uint32_t path;
+  uint32_t len;
+  uint32_t next;
+} StatusPath;
+
+typedef struct {
+  const char *base;
+  size_t size;
+  const StatusHeader *hdr;
+  const StatusEntry *entries;
+  const StatusPath *paths;
+  const uint32_t *path_buckets;
+  uint32_t path_bucket_count;
+  const char *strings;
+} StatusDB;
+
+typedef struct {
+  char name[256];
+  char version[64];
+  char repo[MAX_PATH];
+  char sha256[65];
+  uint32_t flags;
+  long long installed;
+  char *files;
+} StatusRecord;
+
+typedef struct {
+  StatusRecord *records;
+  int count;
+  int cap;
+} StatusEdit;
+
+int status_open(StatusDB *db);
+void status_close(StatusDB *db);
+int status_count(const StatusDB *db);
+const StatusEntry *status_lookup(const StatusDB *db, const char *name);
+const char *status_string(const StatusDB *db, uint32_t offset);
+const StatusEntry *status_owner(const StatusDB *db, const char *path);
+int status_installed_version(const StatusDB *db, const char *name,
+                             char *version, size_t size);
+
+int status_edit_load(StatusEdit *edit, const StatusDB *db);
+StatusRecord *status_edit_set(StatusEdit *edit, const char *name);
+int status_edit_remove(StatusEdit *edit, const char *name);
+char *status_edit_image(StatusEdit *edit, size_t *len);
+int status_edit_save(StatusEdit *edit);
+void status_edit_free(StatusEdit *edit);
+
+void status_lock(void);
+void status_unlock(void);
+int status_needs_migration(void);
+int status_migrate(void);
+
+#endif
@@ -0,0 +1,383 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store.h"
+#include "trace.h"
+
+typedef struct {
+  char name[96];
+  time_t mtime;
+  long long size;
+} StoreEntry;
+
+long long store_cap(void) {
+  const char *env = getenv("VICPKG_CACHE_SIZE");
+  if (!env || !*env)
+    return STORE_DEFAULT_CAP;
+
+  char *end;
+  double value = strtod(env, &end);
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    value *= 1024;
+    /* fall through */
+  case 'M':
+    value *= 1024;
+    /* fall through */
+  case 'K':
+    value *= 1024;
+    break;
+  default:
+    break;
+  }
+  return value < 0 ? 0 : (long long)value;
+}
+
+static int valid_hash(const char *sha256) {
+  size_t i;
+  for (i = 0; sha256[i]; i++) {
+    if (!isxdigit((unsigned char)sha256[i]))
+      return 0;
+  }
+  return i == 64;
+}
+
+int store_archive_path(const char *sha256, char *path, size_t size) {
+  if (!valid_hash(sha256))
+    return 0;
+
+  char key[65];
+  for (int i = 0; i < 65; i++)
+    key[i] = (char)tolower((unsigned char)sha256[i]);
+  snprintf(path, size, "%s/%s.vpkg", ARCHIVE_DIR, key);
+  return 1;
+}
+
+int store_lookup(const char *sha256, char *path, size_t size) {
+  if (!store_archive_path(sha256, path, size) || access(path, R_OK) != 0)
+    return 0;
+
+  /* Record the hit for LRU eviction. */
+  utimes(path, NULL);
+  return 1;
+}
+
+int store_writer_open(StoreWriter *w, const char *path) {
+  memset(w, 0, sizeof(StoreWriter));
+  snprintf(w->path, sizeof(w->path), "%s", path);
+  snprintf(w->part, sizeof(w->part), "%s.%d.part", path, (int)getpid());
+  /* Readable too, so segmented downloads can hash what they wrote. */
+  w->file = fopen(w->part, "w+b");
+  return w->file != NULL;
+}
+
+int store_writer_open_archive(StoreWriter *w, const char *sha256) {
+  char path[MAX_PATH];
+  if (!store_archive_path(sha256, path, sizeof(path)))
+    return 0;
+
+  mkdir(ARCHIVE_DIR, 0755);
+  if (!store_writer_open(w, path))
+    return 0;
+  w->in_store = 1;
+  return 1;
+}
+
+/* Room for a sidecar name and its temporary copy next to any part file. */
+#define STATE_PATH_SIZE (MAX_PATH + 16)
+
+static void state_path(const StoreWriter *w, char *path, size_t size) {
+  snprintf(path, size, "%s.state", w->part);
+}
+
+static int load_state(const char *path, PartialState *state) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+
+  memset(state, 0, sizeof(PartialState));
+  state->size = -1;
+  char line[MAX_PATH + 32];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    char *value = strchr(line, ':');
+    if (!value)
+      continue;
+    *value++ = '\0';
+    if (*value == ' ')
+      value++;
+
+    if (strcmp(line, "URL") == 0)
+      snprintf(state->url, sizeof(state->url), "%s", value);
+    else if (strcmp(line, "Size") == 0)
+      state->size = atoll(value);
+    else if (strcmp(line, "SHA256") == 0)
+      snprintf(state->sha256, sizeof(state->sha256), "%s", value);
+    else if (strcmp(line, "Validator") == 0)
+      snprintf(state->validator, sizeof(state->validator), "%s", value);
+  }
+  fclose(f);
+  return state->url[0] != '\0';
+}
+
+/*
+ * Opens a writer for `path` that carries on with the partial download an
+ * earlier run left there, provided its state shows it is the file `state`
+ * describes: the same size and checksum, or without a checksum the same URL
+ * and a validator to check it with. w->size is then the number of bytes
+ * already held, and state->validator is set to the kept validator when the
+ * URL is the same. Otherwise any partial download is discarded.
+ */
+int store_writer_resume(StoreWriter *w, const char *path, PartialState *state) {
+  memset(w, 0, sizeof(StoreWriter));
+  snprintf(w->path, sizeof(w->path), "%s", path);
+  snprintf(w->part, sizeof(w->part), "%s.part", path);
+
+  char archive[MAX_PATH];
+  w->in_store = store_archive_path(state->sha256, archive, sizeof(archive)) &&
+                strcmp(archive, path) == 0;
+  if (w->in_store)
+    mkdir(ARCHIVE_DIR, 0755);
+
+  char sidecar[STATE_PATH_SIZE];
+  PartialState kept;
+  int same_url = 0, resume = 0;
+  state_path(w, sidecar, sizeof(sidecar));
+  if (load_state(sidecar, &kept) && kept.size == state->size) {
+    same_url = strcmp(kept.url, state->url) == 0;
+    if (state->sha256[0])
+      resume = strcasecmp(kept.sha256, state->sha256) == 0;
+    else
+      resume = same_url && !kept.sha256[0] && kept.validator[0];
+  }
+
+  state->validator[0] = '\0';
+  if (resume && (w->file = fopen(w->part, "r+b")) != NULL) {
+    if (fseeko(w->file, 0, SEEK_END) == 0 &&
+        (w->size = ftello(w->file)) >= 0 &&
+        (state->size <= 0 || w->size <= state->size)) {
+      if (same_url)
+        snprintf(state->validator, sizeof(state->validator), "%s",
+                 kept.validator);
+      return 1;
+    }
+    fclose(w->file);
+  }
+
+  w->size = 0;
+  remove(sidecar);
+  w->file = fopen(w->part, "w+b");
+  return w->file != NULL;
+}
+
+/* Records where the bytes held by `w` come from, for store_writer_resume(). */
+int store_writer_save_state(const StoreWriter *w, const PartialState *state) {
+  char sidecar[STATE_PATH_SIZE], temp[STATE_PATH_SIZE + 4];
+  state_path(w, sidecar, sizeof(sidecar));
+  snprintf(temp, sizeof(temp), "%s.tmp", sidecar);
+
+  FILE *f = fopen(temp, "w");
+  if (!f)
+    return 0;
+  fprintf(f, "URL: %s\nSize: %lld\nSHA256: %s\nValidator: %s\n", state->url,
+          state->size, state->sha256, state->validator);
+  if (fclose(f) != 0 || rename(temp, sidecar) != 0) {
+    remove(temp);
+    return 0;
+  }
+  return 1;
+}
+
+/* Throws away the bytes held by `w` so the download can start over. */
+int store_writer_restart(StoreWriter *w) {
+  if (fflush(w->file) != 0 || ftruncate(fileno(w->file), 0) != 0)
+    return 0;
+  rewind(w->file);
+  w->size = 0;
+  return 1;
+}
+
+int store_sink(void *user, const char *data, size_t len) {
+  StoreWriter *w = user;
+  trace_add(TRACE_BYTES_OUT, (long long)len);
+  if (fwrite(data, 1, len, w->file) != len)
+    return 0;
+  w->size += len;
+  return 1;
+}
+
+int store_writer_commit(StoreWriter *w) {
+  char sidecar[STATE_PATH_SIZE];
+  state_path(w, sidecar, sizeof(sidecar));
+  remove(sidecar);
+
+  int ok = fclose(w->file) == 0;
+  w->file = NULL;
+
+  if (!ok || rename(w->part, w->path) != 0) {
+    remove(w->part);
+    return 0;
+  }
+  return 1;
+}
+
+/* Closes `w` but leaves what it holds for a later store_writer_resume(). */
+void store_writer_keep(StoreWriter *w) {
+  fclose(w->file);
+  w->file = NULL;
+  if (w->size == 0)
+    store_writer_abort(w);
+}
+
+void store_writer_abort(StoreWriter *w) {
+  char sidecar[STATE_PATH_SIZE];
+  state_path(w, sidecar, sizeof(sidecar));
+  remove(sidecar);
+
+  if (w->file) {
+    fclose(w->file);
+    w->file = NULL;
+  }
+  remove(w->part);
+}
+
+static int list_entries(StoreEntry **out) {
+  DIR *dir = opendir(ARCHIVE_DIR);
+  int count = 0, cap = 0;
+  StoreEntry *entries = NULL;
+
+  *out = NULL;
+  if (!dir)
+    return 0;
+
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    if (d->d_name[0] == '.' || strlen(d->d_name) >= sizeof(entries->name))
+      continue;
+
+    char path[MAX_PATH];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", ARCHIVE_DIR, d->d_name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    if (count == cap) {
+      cap = cap ? cap * 2 : 32;
+      StoreEntry *grown = realloc(entries, cap * sizeof(StoreEntry));
+      if (!grown)
+        break;
+      entries = grown;
+    }
+    snprintf(entries[count].name, sizeof(entries[count].name), "%s",
+             d->d_name);
+    entries[count].mtime = st.st_mtime;
+    entries[count].size = (long long)st.st_size;
+    count++;
+  }
+  closedir(dir);
+
+  *out = entries;
+  return count;
+}
+
+static int by_age(const void *a, const void *b) {
+  const StoreEntry *x = a, *y = b;
+  return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+static int remove_entry(const StoreEntry *e, int *removed, long long *freed) {
+  char path[MAX_PATH];
+  snprintf(path, sizeof(path), "%s/%s", ARCHIVE_DIR, e->name);
+  if (unlink(path) != 0)
+    return 0;
+
+  if (verbose_mode) {
+    printf("[VERBOSE] Removed cached archive %s\n", e->name);
+  }
+  if (removed)
+    (*removed)++;
+  if (freed)
+    *freed += e->size;
+  return 1;
+}
+
+long long store_usage(int *count) {
+  StoreEntry *entries;
+  int n = list_entries(&entries);
+  long long total = 0;
+
+  for (int i = 0; i < n; i++)
+    total += entries[i].size;
+  free(entries);
+
+  if (count)
+    *count = n;
+  return total;
+}
+
+static int is_archive(const StoreEntry *e) {
+  const char *dot = strchr(e->name, '.');
+  return dot && strcmp(dot, ".vpkg") == 0;
+}
+
+/*
+ * Evicts least recently used archives until the archives in the store fit in
+ * `cap`. Those used at or after `since` are spared (none when it is 0), and
+ * partial downloads are left to store_clean().
+ */
+int store_trim(long long cap, time_t since, int *removed, long long *freed) {
+  StoreEntry *entries;
+  int n = list_entries(&entries);
+  long long total = 0;
+
+  for (int i = 0; i < n; i++) {
+    if (is_archive(&entries[i]))
+      total += entries[i].size;
+  }
+
+  qsort(entries, n, sizeof(StoreEntry), by_age);
+  for (int i = 0; i < n && total > cap; i++) {
+    if (!is_archive(&entries[i]) || (since && entries[i].mtime >= since))
+      continue;
+    if (remove_entry(&entries[i], removed, freed))
+      total -= entries[i].size;
+  }
+
+  free(entries);
+  return total <= cap;
+}
+
+/*
+ * Removes every archive `keep` rejects (all of them without a callback),
+ * along with partial downloads left behind by interrupted runs.
+ */
+int store_clean(StoreKeep keep, void *user, int *removed, long long *freed) {
+  StoreEntry *entries;
+  int n = list_entries(&entries);
+  int ok = 1;
+
+  for (int i = 0; i < n; i++) {
+    char sha256[65];
+    const char *dot = strchr(entries[i].name, '.');
+    size_t len = dot ? (size_t)(dot - entries[i].name) : 0;
+    int partial = !is_archive(&entries[i]);
+
+    snprintf(sha256, sizeof(sha256), "%.*s", (int)(len < 64 ? len : 64),
+             entries[i].name);
+    if (!partial && keep && keep(sha256, user))
+      continue;
+    if (!remove_entry(&entries[i], removed, freed))
+      ok = 0;
+  }
+
+  free(entries);
+  return ok;
+}
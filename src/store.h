@@ -0,0 +1,57 @@
+#ifndef VICPKG_STORE_H
+#define VICPKG_STORE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "vicpkg.h"
+
+/*
+ * Content-addressed archive store: package archives live in ARCHIVE_DIR as
+ * <sha256>.vpkg, keyed by the SHA256 field from Packages. An archive's mtime
+ * is its last use, and the oldest ones are evicted once an install or upgrade
+ * has finished with the store grown past store_cap().
+ */
+
+typedef struct {
+  FILE *file;
+  int in_store;
+  long long size;
+  char path[MAX_PATH];
+  char part[MAX_PATH];
+} StoreWriter;
+
+/*
+ * Where a partial download came from, kept beside it in <part>.state so an
+ * interrupted download can be resumed by a later run. `validator` is the
+ * ETag or Last-Modified the server sent for the file.
+ */
+typedef struct {
+  char url[MAX_PATH];
+  long long size;
+  char sha256[65];
+  char validator[128];
+} PartialState;
+
+long long store_cap(void);
+int store_archive_path(const char *sha256, char *path, size_t size);
+int store_lookup(const char *sha256, char *path, size_t size);
+
+int store_writer_open(StoreWriter *w, const char *path);
+int store_writer_open_archive(StoreWriter *w, const char *sha256);
+int store_sink(void *user, const char *data, size_t len);
+int store_writer_resume(StoreWriter *w, const char *path, PartialState *state);
+int store_writer_save_state(const StoreWriter *w, const PartialState *state);
+int store_writer_restart(StoreWriter *w);
+int store_writer_commit(StoreWriter *w);
+void store_writer_keep(StoreWriter *w);
+void store_writer_abort(StoreWriter *w);
+
+typedef int (*StoreKeep)(const char *sha256, void *user);
+
+int store_trim(long long cap, time_t since, int *removed, long long *freed);
+int store_clean(StoreKeep keep, void *user, int *removed, long long *freed);
+long long store_usage(int *count);
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tar.h"
+
+#define TAR_BLOCK 512
+#define TAR_META_MAX (1024 * 1024)
+
+enum { ST_HEADER, ST_DATA, ST_META, ST_PAD, ST_DONE };
+
+struct TarReader {
+  const TarCallbacks *cb;
+  void *user;
+  int state;
+  int failed;
+  int zero_blocks;
+
+  unsigned char hdr[TAR_BLOCK];
+  size_t hdr_len;
+
+  long long remaining;
+  size_t pad;
+
+  /* Pending GNU ('L', 'K') or pax ('x') metadata for the next member. */
+  char meta_type;
+  char *meta;
+  size_t meta_len;
+  char *long_name;
+  char *long_link;
+};
+
+static long long parse_number(const unsigned char *field, size_t len) {
+  long long value = 0;
+
+  /* GNU base-256 encoding for values that do not fit in octal. */
+  if (field[0] & 0x80) {
+    value = field[0] & 0x3f;
+    for (size_t i = 1; i < len; i++)
+      value = (value << 8) | field[i];
+    return value;
+  }
+
+  size_t i = 0;
+  while (i < len && (field[i] == ' ' || field[i] == '\0'))
+    i++;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    value = value * 8 + (field[i] - '0');
+  return value;
+}
+
+static int header_checksum_ok(const unsigned char *hdr) {
+  long long expected = parse_number(hdr + 148, 8);
+  long long sum = 0;
+
+  for (int i = 0; i < TAR_BLOCK; i++)
+    sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+  return sum == expected;
+}
+
+static char *field_string(const unsigned char *field, size_t len) {
+  size_t n = strnlen((const char *)field, len);
+  char *s = malloc(n + 1);
+  if (s) {
+    memcpy(s, field, n);
+    s[n] = '\0';
+  }
+  return s;
+}
+
+/* Applies the path and linkpath records of a pax extended header. */
+static void apply_pax(TarReader *t) {
+  size_t pos = 0;
+
+  while (pos < t->meta_len) {
+    char *rec = t->meta + pos;
+    char *space = memchr(rec, ' ', t->meta_len - pos);
+    long len = strtol(rec, NULL, 10);
+    if (!space || len <= 0 || pos + (size_t)len > t->meta_len)
+      break;
+
+    char *key = space + 1;
+    char *eq = memchr(key, '=', rec + len - key);
+    if (eq && rec[len - 1] == '\n') {
+      char **dst = NULL;
+      if ((size_t)(eq - key) == 4 && strncmp(key, "path", 4) == 0)
+        dst = &t->long_name;
+      else if ((size_t)(eq - key) == 8 && strncmp(key, "linkpath", 8) == 0)
+        dst = &t->long_link;
+
+      if (dst) {
+        size_t vlen = rec + len - 1 - (eq + 1);
+        free(*dst);
+        *dst = malloc(vlen + 1);
+        if (*dst) {
+          memcpy(*dst, eq + 1, vlen);
+          (*dst)[vlen] = '\0';
+        }
+      }
+    }
+    pos += len;
+  }
+}
+
+static void finish_meta(TarReader *t) {
+  if (t->meta_type == 'x') {
+    apply_pax(t);
+    free(t->meta);
+  } else {
+    char **dst = t->meta_type == 'L' ? &t->long_name : &t->long_link;
+    free(*dst);
+    *dst = t->meta;
+    (*dst)[strnlen(*dst, t->meta_len)] = '\0';
+  }
+  t->meta = NULL;
+  t->meta_len = 0;
+}
+
+static int handle_header(TarReader *t) {
+  const unsigned char *hdr = t->hdr;
+  int zero = 1;
+
+  for (int i = 0; i < TAR_BLOCK && zero; i++)
+    zero = hdr[i] == 0;
+  if (zero) {
+    if (++t->zero_blocks == 2)
+      t->state = ST_DONE;
+    return 1;
+  }
+  t->zero_blocks = 0;
+
+  if (!header_checksum_ok(hdr))
+    return 0;
+
+  char type = hdr[156] ? (char)hdr[156] : TAR_FILE;
+  long long size = parse_number(hdr + 124, 12);
+  if (size < 0)
+    return 0;
+
+  t->remaining = size;
+  t->pad = (size_t)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+
+  if (type == 'L' || type == 'K' || type == 'x') {
+    if (size > TAR_META_MAX)
+      return 0;
+    t->meta_type = type;
+    t->meta = malloc((size_t)size + 1);
+    t->meta_len = 0;
+    if (!t->meta)
+      return 0;
+    t->meta[size] = '\0';
+    t->state = size > 0 ? ST_META : (t->pad ? ST_PAD : ST_HEADER);
+    if (size == 0)
+      finish_meta(t);
+    return 1;
+  }
+
+  if (type == 'g') {
+    /* Global pax headers carry nothing we use. */
+    t->meta_type = 'g';
+    t->state = size > 0 ? ST_DATA : ST_HEADER;
+    return 1;
+  }
+
+  char *name = t->long_name;
+  char *link = t->long_link;
+  t->long_name = NULL;
+  t->long_link = NULL;
+
+  if (!name) {
+    char *base = field_string(hdr, 100);
+    if (base && memcmp(hdr + 257, "ustar", 5) == 0 && hdr[345]) {
+      char *prefix = field_string(hdr + 345, 155);
+      name = prefix ? malloc(strlen(prefix) + strlen(base) + 2) : NULL;
+      if (name)
+        sprintf(name, "%s/%s", prefix, base);
+      free(prefix);
+      free(base);
+    } else {
+      name = base;
+    }
+  }
+  if (!link)
+    link = field_string(hdr + 157, 100);
+
+  if (type == '7')
+    type = TAR_FILE;
+  if (type == TAR_HARDLINK || type == TAR_SYMLINK || type == TAR_DIRECTORY) {
+    t->remaining = 0;
+    t->pad = 0;
+  }
+
+  TarEntry entry;
+  entry.path = name;
+  entry.linkname = link ? link : "";
+  entry.type = type;
+  entry.mode = (mode_t)parse_number(hdr + 100, 8);
+  entry.size = t->remaining;
+
+  int ok = name && t->cb->begin(t->user, &entry);
+  free(name);
+  free(link);
+  if (!ok)
+    return 0;
+
+  t->meta_type = 0;
+  if (t->remaining > 0) {
+    t->state = ST_DATA;
+    return 1;
+  }
+  t->state = t->pad ? ST_PAD : ST_HEADER;
+  return t->cb->end(t->user);
+}
+
+TarReader *tar_reader_new(const TarCallbacks *cb, void *user) {
+  TarReader *t = calloc(1, sizeof(TarReader));
+  if (!t)
+    return NULL;
+  t->cb = cb;
+  t->user = user;
+  t->state = ST_HEADER;
+  return t;
+}
+
+int tar_reader_feed(TarReader *t, const char *data, size_t len) {
+  if (t->failed)
+    return 0;
+
+  while (len > 0) {
+    size_t n;
+
+    switch (t->state) {
+    case ST_HEADER:
+      n = TAR_BLOCK - t->hdr_len;
+      if (n > len)
+        n = len;
+      memcpy(t->hdr + t->hdr_len, data, n);
+      t->hdr_len += n;
+      if (t->hdr_len == TAR_BLOCK) {
+        t->hdr_len = 0;
+        if (!handle_header(t)) {
+          t->failed = 1;
+          return 0;
+        }
+      }
+      break;
+
+    case ST_DATA:
+    case ST_META:
+      n = (size_t)(t->remaining < (long long)len ? t->remaining : (long long)len);
+      if (t->state == ST_META) {
+        memcpy(t->meta + t->meta_len, data, n);
+        t->meta_len += n;
+      } else if (t->meta_type == 0 && !t->cb->data(t->user, data, n)) {
+        t->failed = 1;
+        return 0;
+      }
+      t->remaining -= n;
+      if (t->remaining == 0) {
+        int was_meta = t->state == ST_META;
+        int was_global = t->meta_type == 'g';
+        t->state = t->pad ? ST_PAD : ST_HEADER;
+        if (was_meta) {
+          finish_meta(t);
+        } else if (was_global) {
+          t->meta_type = 0;
+        } else if (!t->cb->end(t->user)) {
+          t->failed = 1;
+          return 0;
+        }
+      }
+      break;
+
+    case ST_PAD:
+      n = t->pad < len ? t->pad : len;
+      t->pad -= n;
+      if (t->pad == 0)
+        t->state = ST_HEADER;
+      break;
+
+    default:
+      /* Trailing blocks after the end-of-archive marker are ignored. */
+      return 1;
+    }
+
+    data += n;
+    len -= n;
+  }
+  return 1;
+}
+
+int tar_reader_finish(TarReader *t) {
+  return !t->failed &&
+         (t->state == ST_DONE || (t->state == ST_HEADER && t->hdr_len == 0));
+}
+
+void tar_reader_free(TarReader *t) {
+  if (!t)
+    return;
+  free(t->meta);
+  free(t->long_name);
+  free(t->long_link);
+  free(t);
+}
+
+int tar_reader_sink(void *user, const char *data, size_t len) {
+  return tar_reader_feed((TarReader *)user, data, len);
+}
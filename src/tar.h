@@ -0,0 +1,40 @@
+#ifndef VICPKG_TAR_H
+#define VICPKG_TAR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define TAR_FILE '0'
+#define TAR_HARDLINK '1'
+#define TAR_SYMLINK '2'
+#define TAR_DIRECTORY '5'
+
+typedef struct {
+  const char *path;
+  const char *linkname;
+  char type;
+  mode_t mode;
+  long long size;
+} TarEntry;
+
+/*
+ * Callbacks for a streaming tar reader. `begin` is called for each member
+ * (long names from GNU and pax headers already applied), `data` with its
+ * contents and `end` once it is complete. Any callback returning 0 aborts
+ * the stream.
+ */
+typedef struct {
+  int (*begin)(void *user, const TarEntry *entry);
+  int (*data)(void *user, const char *data, size_t len);
+  int (*end)(void *user);
+} TarCallbacks;
+
+typedef struct TarReader TarReader;
+
+TarReader *tar_reader_new(const TarCallbacks *cb, void *user);
+int tar_reader_feed(TarReader *t, const char *data, size_t len);
+int tar_reader_finish(TarReader *t);
+void tar_reader_free(TarReader *t);
+int tar_reader_sink(void *user, const char *data, size_t len);
+
+#endif
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_MAX_DEPTH 16
+#define TRACE_DETAIL_MAX 96
+
+typedef struct {
+  const char *name;
+  char detail[TRACE_DETAIL_MAX];
+  int tid;
+  int depth;
+  long long start_us;
+  long long dur_us;
+  long long cpu_us;
+  long long switches;
+  long long blocks;
+  long long counters[TRACE_COUNTERS];
+} TraceEvent;
+
+typedef struct {
+  const char *name;
+  char detail[TRACE_DETAIL_MAX];
+  long long start_us;
+  struct rusage usage;
+  long long counters[TRACE_COUNTERS];
+} TraceFrame;
+
+int trace_enabled = 0;
+
+static long long trace_origin;
+static TraceEvent *events;
+static int event_count;
+static int event_cap;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread TraceFrame frames[TRACE_MAX_DEPTH];
+static __thread int depth;
+static __thread int thread_id;
+
+long long trace_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long timeval_us(const struct timeval *tv) {
+  return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+void trace_start(void) {
+  trace_origin = trace_now_us();
+  trace_enabled = 1;
+}
+
+/* Returns a token for trace_end(), or -1 when tracing is off. */
+int trace_begin(const char *name, const char *detail) {
+  if (!trace_enabled || depth == TRACE_MAX_DEPTH)
+    return -1;
+
+  TraceFrame *f = &frames[depth];
+  f->name = name;
+  snprintf(f->detail, sizeof(f->detail), "%s", detail ? detail : "");
+  memset(f->counters, 0, sizeof(f->counters));
+  getrusage(RUSAGE_THREAD, &f->usage);
+  f->start_us = trace_now_us();
+  return depth++;
+}
+
+static void record(const TraceFrame *f, long long end_us) {
+  struct rusage now;
+  getrusage(RUSAGE_THREAD, &now);
+
+  if (!thread_id)
+    thread_id = (int)syscall(SYS_gettid);
+
+  pthread_mutex_lock(&trace_mutex);
+  if (event_count == event_cap) {
+    int cap = event_cap ? event_cap * 2 : 256;
+    TraceEvent *grown = realloc(events, cap * sizeof(TraceEvent));
+    if (!grown) {
+      pthread_mutex_unlock(&trace_mutex);
+      return;
+    }
+    events = grown;
+    event_cap = cap;
+  }
+
+  TraceEvent *e = &events[event_count++];
+  e->name = f->name;
+  memcpy(e->detail, f->detail, sizeof(e->detail));
+  e->tid = thread_id;
+  e->depth = (int)(f - frames);
+  e->start_us = f->start_us - trace_origin;
+  e->dur_us = end_us - f->start_us;
+  e->cpu_us = timeval_us(&now.ru_utime) - timeval_us(&f->usage.ru_utime) +
+              timeval_us(&now.ru_stime) - timeval_us(&f->usage.ru_stime);
+  e->switches = (now.ru_nvcsw - f->usage.ru_nvcsw) +
+                (now.ru_nivcsw - f->usage.ru_nivcsw);
+  e->blocks = (now.ru_inblock - f->usage.ru_inblock) +
+              (now.ru_oublock - f->usage.ru_oublock);
+  memcpy(e->counters, f->counters, sizeof(e->counters));
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+/* Ends span `span` along with any inner spans left open. */
+void trace_end(int span) {
+  if (span < 0)
+    return;
+
+  long long now = trace_now_us();
+  while (depth > span) {
+    TraceFrame *f = &frames[--depth];
+    record(f, now);
+    if (depth > 0) {
+      for (int i = 0; i < TRACE_COUNTERS; i++)
+        frames[depth - 1].counters[i] += f->counters[i];
+    }
+  }
+}
+
+void trace_add(int counter, long long n) {
+  if (trace_enabled && depth > 0)
+    frames[depth - 1].counters[counter] += n;
+}
+
+/* Totals for one phase of the table: spans sharing a name and depth. */
+typedef struct {
+  const char *name;
+  int depth;
+  int count;
+  long long first_us;
+  long long dur_us;
+  long long cpu_us;
+  long long counters[TRACE_COUNTERS];
+} TracePhase;
+
+static int by_start(const void *a, const void *b) {
+  const TracePhase *x = a, *y = b;
+  if (x->first_us != y->first_us)
+    return x->first_us < y->first_us ? -1 : 1;
+  return x->depth - y->depth;
+}
+
+void trace_print_timings(FILE *out) {
+  pthread_mutex_lock(&trace_mutex);
+  TracePhase *phases = calloc(event_count ? event_count : 1,
+                              sizeof(TracePhase));
+  int count = 0;
+
+  for (int i = 0; phases && i < event_count; i++) {
+    const TraceEvent *e = &events[i];
+    int p = 0;
+    while (p < count && (phases[p].depth != e->depth ||
+                         strcmp(phases[p].name, e->name) != 0))
+      p++;
+    if (p == count) {
+      phases[count].name = e->name;
+      phases[count].depth = e->depth;
+      phases[count].first_us = e->start_us;
+      count++;
+    }
+    TracePhase *ph = &phases[p];
+    ph->count++;
+    if (e->start_us < ph->first_us)
+      ph->first_us = e->start_us;
+    ph->dur_us += e->dur_us;
+    ph->cpu_us += e->cpu_us;
+    for (int c = 0; c < TRACE_COUNTERS; c++)
+      ph->counters[c] += e->counters[c];
+  }
+  pthread_mutex_unlock(&trace_mutex);
+
+  if (!phases)
+    return;
+  qsort(phases, count, sizeof(TracePhase), by_start);
+
+  fprintf(out, "\n%-28s %5s %10s %10s %10s %10s %5s %9s\n", "Phase", "Count",
+          "Wall ms", "CPU ms", "In KB", "Out KB", "Forks", "Decode ms");
+  for (int i = 0; i < count; i++) {
+    const TracePhase *ph = &phases[i];
+    int indent = ph->depth * 2 < 12 ? ph->depth * 2 : 12;
+    fprintf(out, "%*s%-*.*s %5d %10.1f %10.1f %10.1f %10.1f %5lld %9.1f\n",
+            indent, "", 28 - indent, 28 - indent, ph->name, ph->count,
+            ph->dur_us / 1000.0, ph->cpu_us / 1000.0,
+            ph->counters[TRACE_BYTES_IN] / 1024.0,
+            ph->counters[TRACE_BYTES_OUT] / 1024.0, ph->counters[TRACE_FORKS],
+            ph->counters[TRACE_DECODE_US] / 1000.0);
+  }
+  free(phases);
+}
+
+static void write_json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    unsigned char ch = (unsigned char)*s;
+    if (ch == '"' || ch == '\\')
+      fprintf(f, "\\%c", ch);
+    else if (ch < 0x20)
+      fprintf(f, "\\u%04x", ch);
+    else
+      fputc(ch, f);
+  }
+  fputc('"', f);
+}
+
+/* Writes the spans as Chrome trace-event JSON (chrome://tracing, Perfetto). */
+int trace_write_file(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return 0;
+
+  int pid = (int)getpid();
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  pthread_mutex_lock(&trace_mutex);
+  for (int i = 0; i < event_count; i++) {
+    const TraceEvent *e = &events[i];
+    fprintf(f, "%s{\"name\":", i ? ",\n" : "");
+    write_json_string(f, e->name);
+    fprintf(f,
+            ",\"cat\":\"vicpkg\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{",
+            e->start_us, e->dur_us, pid, e->tid);
+    if (e->detail[0]) {
+      fprintf(f, "\"detail\":");
+      write_json_string(f, e->detail);
+      fprintf(f, ",");
+    }
+    fprintf(f,
+            "\"bytes_in\":%lld,\"bytes_out\":%lld,\"forks\":%lld,"
+            "\"decode_us\":%lld,\"cpu_us\":%lld,\"context_switches\":%lld,"
+            "\"io_blocks\":%lld}}",
+            e->counters[TRACE_BYTES_IN], e->counters[TRACE_BYTES_OUT],
+            e->counters[TRACE_FORKS], e->counters[TRACE_DECODE_US], e->cpu_us,
+            e->switches, e->blocks);
+  }
+  pthread_mutex_unlock(&trace_mutex);
+
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
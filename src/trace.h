@@ -0,0 +1,32 @@
+#ifndef VICPKG_TRACE_H
+#define VICPKG_TRACE_H
+
+#include <stdio.h>
+
+/*
+ * Span tracer. Spans nest per thread and time themselves with the monotonic
+ * clock and per-thread rusage; counters added while a span is open are
+ * charged to it and, when it ends, to its parent as well. Nothing is
+ * recorded until trace_start(), so disabled spans cost one branch.
+ */
+
+enum {
+  TRACE_BYTES_IN,  /* bytes received from repositories */
+  TRACE_BYTES_OUT, /* bytes written to disk */
+  TRACE_FORKS,     /* child processes started */
+  TRACE_DECODE_US, /* time spent decompressing */
+  TRACE_COUNTERS
+};
+
+extern int trace_enabled;
+
+void trace_start(void);
+int trace_begin(const char *name, const char *detail);
+void trace_end(int span);
+void trace_add(int counter, long long n);
+long long trace_now_us(void);
+
+void trace_print_timings(FILE *out);
+int trace_write_file(const char *path);
+
+#endif
@@ -1,24 +1,34 @@
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-#define VICPKG_DIR "/data/vicpkg"
-#define VERSIONS_DIR VICPKG_DIR "/versions"
-#define FILES_DIR VICPKG_DIR "/files"
-#define CACHE_DIR VICPKG_DIR "/cache"
-#define LEGACY_INSTALL_DIR VICPKG_DIR "/legacy/installed"
-#define BIN_DIR VICPKG_DIR "/bin"
-#define REPOS_FILE VICPKG_DIR "/repos.list"
-#define VICPKG_VERSION "1.0.0"
-#define MAX_REPOS 10
-#define MAX_PATH 512
-#define MAX_LINE 2048
-#define INSTALL_ROOT "/"
+#include "decomp.h"
+#include "depends.h"
+#include "extract.h"
+#include "fetch.h"
+#include "fsutil.h"
+#include "index.h"
+#include "journal.h"
+#include "lock.h"
+#include "rewrite.h"
+#include "search.h"
+#include "segment.h"
+#include "sha256.h"
+#include "status.h"
+#include "store.h"
+#include "tar.h"
+#include "trace.h"
+#include "vicpkg.h"
 
 int verbose_mode = 0;
 int assume_yes = 0;
@@ -26,27 +36,8 @@ int quiet_mode = 0;
 int download_only = 0;
 int simulate = 0;
 
-typedef struct {
-  char *repos[MAX_REPOS];
-  int repo_count;
-  int repo_priority[MAX_REPOS];
-} VicPkgContext;
-
-typedef struct {
-  char package[256];
-  char version[64];
-  char architecture[64];
-  char filename[512];
-  char description[512];
-  char name[256];
-  long size;
-  int is_legacy;
-  char depends_os[64];
-  char depends_os_version[64];
-} PackageInfo;
-
 void set_cpu_freq(const char *freq) {
-  FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq", "w");
+  FILE *f = fopen(CPU_FREQ_FILE, "w");
   if (f) {
     fprintf(f, "%s", freq);
     fclose(f);
@@ -57,6 +48,7 @@ char *exec_command(const char *cmd) {
   FILE *fp = popen(cmd, "r");
   if (!fp)
     return NULL;
+  trace_add(TRACE_FORKS, 1);
 
   static char result[1024];
   if (fgets(result, sizeof(result), fp) != NULL) {
@@ -71,36 +63,42 @@ char *exec_command(const char *cmd) {
   return NULL;
 }
 
+/* getprop forks a process, so each property is read at most once per run. */
 char *get_os_name() {
-  char *result = exec_command("getprop ro.build.os.cfw.name 2>/dev/null");
-  if (!result || strlen(result) == 0) {
-    return "vicos";
-  }
-  
   static char os_name[64];
-  if (strstr(result, "Viccyware")) {
+  if (os_name[0]) {
+    return os_name;
+  }
+
+  char *result = exec_command("getprop ro.build.os.cfw.name 2>/dev/null");
+  if (result && strstr(result, "Viccyware")) {
     strcpy(os_name, "viccyware");
-  } else if (strstr(result, "wire-os")) {
+  } else if (result && strstr(result, "wire-os")) {
     strcpy(os_name, "wireos");
-  } else if (strstr(result, "purplOS")) {
+  } else if (result && strstr(result, "purplOS")) {
     strcpy(os_name, "purplos");
   } else {
     strcpy(os_name, "vicos");
   }
-  
+
   return os_name;
 }
 
 char *get_os_version() {
+  static char version[64];
+  if (version[0]) {
+    return version;
+  }
+
   char *result = exec_command("getprop ro.anki.version 2>/dev/null");
   if (!result) {
-    return "0.0.0.0";
+    strcpy(version, "0.0.0.0");
+    return version;
   }
-  
-  static char version[64];
+
   strncpy(version, result, sizeof(version) - 1);
   version[sizeof(version) - 1] = '\0';
-  
+
   char *src = version;
   char *dst = version;
   while (*src) {
@@ -110,22 +108,107 @@ char *get_os_version() {
     src++;
   }
   *dst = '\0';
-  
+
+  if (version[0] == '\0') {
+    strcpy(version, "0.0.0.0");
+  }
   return version;
 }
 
-int compare_versions(const char *v1, const char *v2) {
-  int n1[4] = {0}, n2[4] = {0};
-  sscanf(v1, "%d.%d.%d.%d", &n1[0], &n1[1], &n1[2], &n1[3]);
-  sscanf(v2, "%d.%d.%d.%d", &n2[0], &n2[1], &n2[2], &n2[3]);
-  
-  for (int i = 0; i < 4; i++) {
-    if (n1[i] < n2[i]) return -1;
-    if (n1[i] > n2[i]) return 1;
+/*
+ * Orders versions the way dpkg does: an optional numeric "epoch:" prefix
+ * first, then the upstream part, then any "-revision". Each part alternates
+ * non-digit runs, compared by character with letters before other symbols
+ * and '~' before everything (even the end), and digit runs compared as
+ * numbers, so "1.10" > "1.9", "1.0a" > "1.0" and "1.0~rc1" < "1.0".
+ */
+int version_char_order(int c) {
+  if (isdigit(c))
+    return 0;
+  if (isalpha(c))
+    return c;
+  if (c == '~')
+    return -1;
+  return c ? c + 256 : 0;
+}
+
+int compare_version_part(const char *a, const char *a_end, const char *b,
+                         const char *b_end) {
+  while (a < a_end || b < b_end) {
+    while ((a < a_end && !isdigit((unsigned char)*a)) ||
+           (b < b_end && !isdigit((unsigned char)*b))) {
+      int ca = a < a_end ? version_char_order((unsigned char)*a) : 0;
+      int cb = b < b_end ? version_char_order((unsigned char)*b) : 0;
+      if (ca != cb)
+        return ca < cb ? -1 : 1;
+      a++;
+      b++;
+    }
+
+    while (a < a_end && *a == '0')
+      a++;
+    while (b < b_end && *b == '0')
+      b++;
+
+    int first_diff = 0;
+    while (a < a_end && isdigit((unsigned char)*a) && b < b_end &&
+           isdigit((unsigned char)*b)) {
+      if (!first_diff)
+        first_diff = *a - *b;
+      a++;
+      b++;
+    }
+    if (a < a_end && isdigit((unsigned char)*a))
+      return 1;
+    if (b < b_end && isdigit((unsigned char)*b))
+      return -1;
+    if (first_diff)
+      return first_diff < 0 ? -1 : 1;
   }
   return 0;
 }
 
+void split_version(const char *v, unsigned long *epoch, const char **upstream,
+                   const char **revision, const char **end) {
+  const char *colon = strchr(v, ':');
+  const char *p = v;
+
+  *epoch = 0;
+  if (colon) {
+    while (p < colon && isdigit((unsigned char)*p))
+      p++;
+    if (p == colon) {
+      *epoch = strtoul(v, NULL, 10);
+      v = colon + 1;
+    }
+  }
+
+  *upstream = v;
+  *end = v + strlen(v);
+  const char *dash = strrchr(v, '-');
+  *revision = dash ? dash : *end;
+}
+
+int compare_versions(const char *v1, const char *v2) {
+  unsigned long e1, e2;
+  const char *u1, *r1, *end1, *u2, *r2, *end2;
+
+  split_version(v1, &e1, &u1, &r1, &end1);
+  split_version(v2, &e2, &u2, &r2, &end2);
+  if (e1 != e2)
+    return e1 < e2 ? -1 : 1;
+
+  int cmp = compare_version_part(u1, r1, u2, r2);
+  if (cmp != 0)
+    return cmp;
+
+  if (*r1)
+    r1++;
+  if (*r2)
+    r2++;
+  return compare_version_part(r1, end1, r2, end2);
+}
+
 void ensure_path_configured() {
   
   char *path_env = getenv("PATH");
@@ -134,14 +217,14 @@ void ensure_path_configured() {
   }
 
   const char *profile_file = "/etc/profile";
-  const char *path_line = "\nexport PATH=\"/data/vicpkg/bin:$PATH\"\n";
+  const char *path_line = "\nexport PATH=\"" BIN_DIR ":$PATH\"\n";
 
   FILE *f = fopen(profile_file, "r");
   if (f) {
     char line[MAX_LINE];
     int already_added = 0;
     while (fgets(line, sizeof(line), f)) {
-      if (strstr(line, "/data/vicpkg/bin")) {
+      if (strstr(line, BIN_DIR)) {
         already_added = 1;
         break;
       }
@@ -172,9 +255,9 @@ void ensure_path_configured() {
 
 void init_directories() {
   mkdir(VICPKG_DIR, 0755);
-  mkdir(VERSIONS_DIR, 0755);
-  mkdir(FILES_DIR, 0755);
   mkdir(CACHE_DIR, 0755);
+  mkdir(ARCHIVE_DIR, 0755);
+  mkdir(JOURNAL_DIR, 0755);
   mkdir(BIN_DIR, 0755);
   
   char legacy_dir[MAX_PATH];
@@ -186,25 +269,26 @@ void init_directories() {
 }
 
 void init_vicpkg_self() {
-  char version_file[MAX_PATH];
-  snprintf(version_file, sizeof(version_file), "%s/vicpkg", VERSIONS_DIR);
-
-  if (access(version_file, F_OK) != 0) {
-
-    FILE *f = fopen(version_file, "w");
-    if (f) {
-      fprintf(f, "%s\n", VICPKG_VERSION);
-      fclose(f);
-    }
-
-    char files_list[MAX_PATH];
-    snprintf(files_list, sizeof(files_list), "%s/vicpkg", FILES_DIR);
-    f = fopen(files_list, "w");
-    if (f) {
-      fprintf(f, "/anki/bin/vicpkg\n");
-      fclose(f);
+  StatusDB db;
+  status_open(&db);
+  int installed = status_lookup(&db, "vicpkg") != NULL;
+
+  if (!installed) {
+    StatusEdit edit;
+    status_lock();
+    StatusRecord *r = status_edit_load(&edit, &db)
+                          ? status_edit_set(&edit, "vicpkg")
+                          : NULL;
+    if (r) {
+      snprintf(r->version, sizeof(r->version), "%s", VICPKG_VERSION);
+      r->installed = (long long)time(NULL);
+      r->files = strdup("/anki/bin/vicpkg\n");
+      status_edit_save(&edit);
     }
+    status_edit_free(&edit);
+    status_unlock();
   }
+  status_close(&db);
 }
 
 void load_repositories(VicPkgContext *ctx) {
@@ -239,54 +323,126 @@ void load_repositories(VicPkgContext *ctx) {
   }
 }
 
-int check_repo_release(const char *repo) {
-  char cmd[MAX_PATH * 2];
-  char cache_file[MAX_PATH];
+int check_repo_release(const char *repo, RepoState *state) {
+  char url[MAX_PATH];
+  FetchBuffer release = {0};
+  FetchOptions opts = {0};
+  FetchResponse resp;
 
-  snprintf(cache_file, sizeof(cache_file), "%s/release.tmp", CACHE_DIR);
-  snprintf(cmd, sizeof(cmd), "curl -s -o %s %s/Release 2>/dev/null", cache_file,
-           repo);
+  snprintf(url, sizeof(url), "%s/Release", repo);
+  opts.timeout_ms = REPO_PROBE_TIMEOUT_MS;
+  opts.deadline_ms = REPO_PROBE_DEADLINE_MS;
+  opts.if_none_match = state->release_etag;
+  opts.if_modified_since = state->release_modified;
 
-  if (system(cmd) != 0) {
-    return 0;
+  if (!fetch_url(url, &opts, fetch_buffer_sink, &release, &resp)) {
+    fetch_buffer_free(&release);
+    return -1;
   }
 
-  FILE *f = fopen(cache_file, "r");
-  if (!f) {
-    return 0;
+  state->probe_status = resp.status;
+
+  if (resp.status == 304) {
+    fetch_buffer_free(&release);
+    return 2;
+  }
+
+  if (!fetch_status_ok(&resp)) {
+    fetch_buffer_free(&release);
+    return resp.status >= 500 ? -1 : 0;
   }
 
-  char line[MAX_LINE];
   int found_vicpkg = 0;
+  char date[64] = "";
+  char *text = release.data ? strdup(release.data) : NULL;
+  char *line = release.data;
+
+  while (line && *line) {
+    char *next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
 
-  while (fgets(line, sizeof(line), f)) {
     if (strncmp(line, "Architectures:", 14) == 0) {
       if (strstr(line, "vicpkg")) {
         found_vicpkg = 1;
-        break;
       }
+    } else if (strncmp(line, "Date:", 5) == 0) {
+      char *val = line + 5;
+      while (isspace((unsigned char)*val))
+        val++;
+      trim_string(val);
+      snprintf(date, sizeof(date), "%s", val);
     }
+    line = next;
   }
 
-  fclose(f);
-  remove(cache_file);
-
   if (verbose_mode && found_vicpkg) {
     printf("[VERBOSE] Found valid Release file at %s\n", repo);
   }
 
+  if (found_vicpkg && text) {
+    sha256_hex(text, strlen(text), state->fetched_hash);
+    snprintf(state->fetched_etag, sizeof(state->fetched_etag), "%s", resp.etag);
+    snprintf(state->fetched_modified, sizeof(state->fetched_modified), "%s",
+             resp.last_modified);
+    snprintf(state->date, sizeof(state->date), "%s", date);
+    state->release = text;
+  } else {
+    free(text);
+  }
+
+  fetch_buffer_free(&release);
   return found_vicpkg;
 }
 
-void prioritize_repos(VicPkgContext *ctx) {
-  for (int i = 0; i < ctx->repo_count; i++) {
-    if (check_repo_release(ctx->repos[i])) {
-      ctx->repo_priority[i] = 100;
-    } else {
-      ctx->repo_priority[i] = 1;
+int release_find_checksum(const char *release, const char *name,
+                          char *hash, size_t hash_size) {
+  const char *line = release;
+  int in_sha256 = 0;
+
+  while (line && *line) {
+    const char *next = strchr(line, '\n');
+    size_t len = next ? (size_t)(next - line) : strlen(line);
+    char buf[MAX_LINE];
+
+    if (len >= sizeof(buf))
+      len = sizeof(buf) - 1;
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    trim_string(buf);
+
+    if (buf[0] != ' ' && buf[0] != '\t') {
+      in_sha256 = strncmp(buf, "SHA256:", 7) == 0;
+    } else if (in_sha256) {
+      char sum[128], file[MAX_PATH];
+      long long size;
+      if (sscanf(buf, " %127s %lld %511s", sum, &size, file) == 3 &&
+          strcmp(file, name) == 0) {
+        snprintf(hash, hash_size, "%s", sum);
+        return 1;
+      }
     }
+
+    line = next ? next + 1 : NULL;
   }
 
+  hash[0] = '\0';
+  return 0;
+}
+
+typedef struct {
+  const char *repo;
+  int result;
+  RepoState state;
+} RepoProbe;
+
+void *probe_repo_thread(void *arg) {
+  RepoProbe *probe = arg;
+  probe->result = check_repo_release(probe->repo, &probe->state);
+  return NULL;
+}
+
+void sort_repos(VicPkgContext *ctx) {
   for (int i = 0; i < ctx->repo_count - 1; i++) {
     for (int j = 0; j < ctx->repo_count - i - 1; j++) {
       if (ctx->repo_priority[j] < ctx->repo_priority[j + 1]) {
@@ -297,181 +453,304 @@ void prioritize_repos(VicPkgContext *ctx) {
         int temp_prio = ctx->repo_priority[j];
         ctx->repo_priority[j] = ctx->repo_priority[j + 1];
         ctx->repo_priority[j + 1] = temp_prio;
+
+        RepoState temp_state = ctx->repo_state[j];
+        ctx->repo_state[j] = ctx->repo_state[j + 1];
+        ctx->repo_state[j + 1] = temp_state;
       }
     }
   }
 }
 
-void init_context(VicPkgContext *ctx) {
-  ctx->repo_count = 0;
+int split_fields(char *line, char **fields, int max) {
+  int count = 0;
+  while (count < max) {
+    fields[count++] = line;
+    char *tab = strchr(line, '\t');
+    if (!tab)
+      break;
+    *tab = '\0';
+    line = tab + 1;
+  }
+  return count;
+}
 
-  init_directories();
-  init_vicpkg_self();
-  load_repositories(ctx);
-  prioritize_repos(ctx);
+void save_repo_cache(VicPkgContext *ctx) {
+  char temp_file[MAX_PATH];
+  snprintf(temp_file, sizeof(temp_file), "%s.%d.tmp", REPO_CACHE_FILE,
+           (int)getpid());
 
-  set_cpu_freq("1267200");
-}
+  FILE *f = fopen(temp_file, "w");
+  if (!f)
+    return;
 
-void cleanup_context(VicPkgContext *ctx) {
   for (int i = 0; i < ctx->repo_count; i++) {
-    free(ctx->repos[i]);
+    RepoState *st = &ctx->repo_state[i];
+    fprintf(f, "%s\t%d\t%s\t%s\t%s\t%s\t%d\t%s\t%s\t%s\n", ctx->repos[i],
+            ctx->repo_priority[i], st->date, st->release_hash,
+            st->release_etag, st->release_modified, st->release_gated,
+            st->list_hash, st->list_etag, st->list_modified);
   }
-  set_cpu_freq("533333");
-}
 
-void show_usage() {
-  printf("Usage: vicpkg [options] command\n");
-  printf("\n");
-  printf("Commands:\n");
-  printf("  update                             - Update package cache\n");
-  printf(
-      "  upgrade [package]                  - Upgrade installed package(s)\n");
-  printf("  install <package> [package2...]    - Install package(s)\n");
-  printf("  purge <package> [package2...]     - Remove package(s)\n");
-  printf("  search <query>                     - Search for packages\n");
-  printf("  list                               - List installed packages\n");
-  printf("  show <package>                     - Show package details\n");
-  printf(
-      "  repo-list                          - List configured repositories\n");
-  printf("  repo-add <url>                     - Add a repository\n");
-  printf("  repo-remove <url>                  - Remove a repository\n");
-  printf("\n");
-  printf("Options:\n");
-  printf("  -h, --help           Show this help message\n");
-  printf("  -v, --verbose        Verbose mode\n");
-  printf("  -y, --yes            Assume yes to all prompts\n");
-  printf("  -q, --quiet          Quiet mode\n");
-  printf("  -s, --simulate       Simulate actions (dry-run)\n");
-  printf("  -d, --download-only  Download packages only, don't install\n");
-  printf("  --version            Show version information\n");
+  if (fclose(f) == 0) {
+    rename(temp_file, REPO_CACHE_FILE);
+  } else {
+    remove(temp_file);
+  }
 }
 
-void show_version() { printf("vicpkg version %s\n", VICPKG_VERSION); }
-
-int file_contains_404(const char *filepath) {
-  FILE *f = fopen(filepath, "r");
+int load_repo_cache(VicPkgContext *ctx) {
+  FILE *f = fopen(REPO_CACHE_FILE, "r");
   if (!f)
     return 0;
 
-  char buffer[256];
-  int found = 0;
-  while (fgets(buffer, sizeof(buffer), f)) {
-    if (strstr(buffer, "<head><title>404 Not Found</title></head>") ||
-        strstr(buffer, "<!DOCTYPE HTML>")) {
-      found = 1;
-      break;
+  int matched[MAX_REPOS] = {0};
+  int match_count = 0;
+  char line[MAX_LINE];
+
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char *fields[10] = {0};
+    int count = split_fields(line, fields, 10);
+    if (count < 2)
+      continue;
+
+    for (int i = 0; i < ctx->repo_count; i++) {
+      if (!matched[i] && strcmp(ctx->repos[i], fields[0]) == 0) {
+        RepoState *st = &ctx->repo_state[i];
+        ctx->repo_priority[i] = atoi(fields[1]);
+        snprintf(st->date, sizeof(st->date), "%s", count > 2 ? fields[2] : "");
+        if (count == 10) {
+          snprintf(st->release_hash, sizeof(st->release_hash), "%s", fields[3]);
+          snprintf(st->release_etag, sizeof(st->release_etag), "%s", fields[4]);
+          snprintf(st->release_modified, sizeof(st->release_modified), "%s",
+                   fields[5]);
+          st->release_gated = atoi(fields[6]);
+          snprintf(st->list_hash, sizeof(st->list_hash), "%s", fields[7]);
+          snprintf(st->list_etag, sizeof(st->list_etag), "%s", fields[8]);
+          snprintf(st->list_modified, sizeof(st->list_modified), "%s",
+                   fields[9]);
+        }
+        matched[i] = 1;
+        match_count++;
+        break;
+      }
     }
   }
   fclose(f);
-  return found;
-}
 
-int is_text_file(const char *filepath) {
-  FILE *f = fopen(filepath, "rb");
-  if (!f)
+  if (match_count != ctx->repo_count)
     return 0;
 
-  unsigned char buffer[512];
-  size_t bytes_read = fread(buffer, 1, sizeof(buffer), f);
-  fclose(f);
-
-  
-  for (size_t i = 0; i < bytes_read; i++) {
-    if (buffer[i] == 0) {
-      return 0;
-    }
+  if (verbose_mode) {
+    printf("[VERBOSE] Using cached repository order from %s\n",
+           REPO_CACHE_FILE);
   }
-
+  sort_repos(ctx);
   return 1;
 }
 
-void patch_file_paths(const char *filepath, const char *package_dir) {
-  if (!is_text_file(filepath)) {
-    return;
-  }
-
-  char temp_file[MAX_PATH];
-  snprintf(temp_file, sizeof(temp_file), "%s.tmp", filepath);
+void prioritize_repos(VicPkgContext *ctx) {
+  RepoProbe probes[MAX_REPOS];
+  pthread_t threads[MAX_REPOS];
+  int started[MAX_REPOS];
+  int span = trace_begin("probe repos", NULL);
 
-  FILE *src = fopen(filepath, "r");
-  FILE *dst = fopen(temp_file, "w");
+  for (int i = 0; i < ctx->repo_count; i++) {
+    RepoState *st = &probes[i].state;
+    memset(st, 0, sizeof(*st));
+    if (ctx->repo_priority[i] >= 100) {
+      memcpy(st->release_etag, ctx->repo_state[i].release_etag,
+             sizeof(st->release_etag));
+      memcpy(st->release_modified, ctx->repo_state[i].release_modified,
+             sizeof(st->release_modified));
+    }
 
-  if (!src || !dst) {
-    if (src) fclose(src);
-    if (dst) fclose(dst);
-    return;
+    probes[i].repo = ctx->repos[i];
+    started[i] = pthread_create(&threads[i], NULL, probe_repo_thread,
+                                &probes[i]) == 0;
+    if (!started[i]) {
+      probe_repo_thread(&probes[i]);
+    }
   }
 
-  char line[MAX_LINE];
-  int patched = 0;
+  for (int i = 0; i < ctx->repo_count; i++) {
+    RepoState *st = &ctx->repo_state[i];
 
-  while (fgets(line, sizeof(line), src)) {
-    char *pos = strstr(line, "/data/purplpkg");
-    if (pos) {
-      
-      while (pos) {
-        size_t prefix_len = pos - line;
-        fwrite(line, 1, prefix_len, dst);
-        fprintf(dst, "%s", package_dir);
-        
-        char *rest = pos + strlen("/data/purplpkg");
-        strcpy(line, rest);
-        pos = strstr(line, "/data/purplpkg");
-        patched = 1;
-      }
-      fprintf(dst, "%s", line);
-    } else {
-      fprintf(dst, "%s", line);
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
     }
-  }
-
-  fclose(src);
-  fclose(dst);
 
-  if (patched) {
-    if (verbose_mode) {
-      printf("[VERBOSE] Patched paths in: %s\n", filepath);
+    free(st->release);
+    st->release = probes[i].state.release;
+    st->probe_status = probes[i].state.probe_status;
+    memcpy(st->fetched_hash, probes[i].state.fetched_hash,
+           sizeof(st->fetched_hash));
+    memcpy(st->fetched_etag, probes[i].state.fetched_etag,
+           sizeof(st->fetched_etag));
+    memcpy(st->fetched_modified, probes[i].state.fetched_modified,
+           sizeof(st->fetched_modified));
+
+    if (probes[i].result == 1) {
+      ctx->repo_priority[i] = 100;
+      memcpy(st->date, probes[i].state.date, sizeof(st->date));
+    } else if (probes[i].result == 0) {
+      ctx->repo_priority[i] = 1;
+      st->date[0] = '\0';
+    } else {
+      if (verbose_mode && probes[i].result < 0) {
+        printf("[VERBOSE] Could not reach %s, keeping previous type\n",
+               ctx->repos[i]);
+      }
+      if (ctx->repo_priority[i] <= 0) {
+        ctx->repo_priority[i] = 1;
+      }
     }
-    rename(temp_file, filepath);
-  } else {
-    remove(temp_file);
   }
+
+  sort_repos(ctx);
+  save_repo_cache(ctx);
+  ctx->repos_probed = 1;
+  trace_end(span);
 }
 
-void create_symlinks_for_package(const char *package_name, const char *install_dir) {
-  DIR *dir = opendir(install_dir);
-  if (!dir) {
-    return;
+/*
+ * Sets up only what `needs` asks for, so read-only commands neither touch
+ * the network nor fork:
+ *   NEED_SETUP  state directories, PATH entry and vicpkg's own record
+ *   NEED_STATE  finish interrupted installs and migrate the status database
+ *   NEED_REPOS  repos.list and the cached repository order
+ *   NEED_PROBE  probe the repositories when that order is not cached
+ *   NEED_BOOST  raise the CPU clock until cleanup_context()
+ *   NEED_WRITE  hold the state lock exclusively instead of shared
+ */
+int init_context(VicPkgContext *ctx, unsigned needs) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->needs = needs;
+  int span = trace_begin("init", NULL);
+
+  if (needs & NEED_SETUP) {
+    init_directories();
+  }
+  /*
+   * Recovery rewrites state, so the lock is only taken exclusively first
+   * when an interrupted run or an old database has left work behind;
+   * otherwise readers share it. Both are checked again under the lock.
+   */
+  int lock_span = trace_begin("lock", NULL);
+  if ((needs & NEED_STATE) && (journal_pending() || status_needs_migration()) &&
+      lock_state(1)) {
+    int state_span = trace_begin("recover state", NULL);
+    journal_recover();
+    status_migrate();
+    trace_end(state_span);
+  }
+  if (!lock_state((needs & NEED_WRITE) != 0)) {
+    fprintf(stderr, "Failed to lock %s\n", LOCK_FILE);
+    trace_end(span);
+    return 0;
   }
-
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_name[0] == '.') {
-      continue;
+  trace_end(lock_span);
+  if (needs & NEED_SETUP) {
+    init_vicpkg_self();
+  }
+  if (needs & NEED_REPOS) {
+    load_repositories(ctx);
+    if (!load_repo_cache(ctx) && (needs & NEED_PROBE)) {
+      prioritize_repos(ctx);
     }
+  }
 
-    char source[MAX_PATH];
-    char target[MAX_PATH];
-    snprintf(source, sizeof(source), "%s/%s", install_dir, entry->d_name);
-    snprintf(target, sizeof(target), "%s/%s", BIN_DIR, entry->d_name);
+  if (needs & NEED_BOOST) {
+    lock_boost();
+    set_cpu_freq("1267200");
+  }
+  trace_end(span);
+  return 1;
+}
 
-    
-    unlink(target);
+void cleanup_context(VicPkgContext *ctx) {
+  for (int i = 0; i < ctx->repo_count; i++) {
+    free(ctx->repos[i]);
+    free(ctx->repo_state[i].release);
+  }
+  fetch_cleanup();
+  if ((ctx->needs & NEED_BOOST) && unlock_boost()) {
+    set_cpu_freq("533333");
+  }
+  unlock_state();
+}
 
-    
-    if (symlink(source, target) == 0) {
-      if (verbose_mode) {
-        printf("[VERBOSE] Created symlink: %s -> %s\n", target, source);
-      }
-    } else if (verbose_mode) {
-      printf("[VERBOSE] Failed to create symlink for %s\n", entry->d_name);
+unsigned command_needs(const char *action) {
+  static const struct {
+    const char *name;
+    unsigned needs;
+  } commands[] = {
+      {"update",
+       NEED_SETUP | NEED_STATE | NEED_REPOS | NEED_BOOST | NEED_WRITE},
+      {"upgrade", NEED_SETUP | NEED_STATE | NEED_REPOS | NEED_PROBE |
+                      NEED_BOOST | NEED_WRITE},
+      {"install", NEED_SETUP | NEED_STATE | NEED_REPOS | NEED_PROBE |
+                      NEED_BOOST | NEED_WRITE},
+      {"purge", NEED_SETUP | NEED_STATE | NEED_BOOST | NEED_WRITE},
+      {"repo-add", NEED_SETUP | NEED_REPOS | NEED_WRITE},
+      {"repo-remove", NEED_SETUP | NEED_REPOS | NEED_WRITE},
+      {"clean", NEED_STATE | NEED_WRITE},
+      {"autoclean", NEED_STATE | NEED_WRITE},
+      {"search", NEED_REPOS},
+      {"show", NEED_STATE | NEED_REPOS},
+      {"repo-list", NEED_REPOS},
+      {"list", NEED_STATE},
+      {"owns", NEED_STATE},
+  };
+
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strcmp(commands[i].name, action) == 0) {
+      return commands[i].needs;
     }
   }
+  return 0;
+}
 
-  closedir(dir);
+void show_usage() {
+  printf("Usage: vicpkg [options] command\n");
+  printf("\n");
+  printf("Commands:\n");
+  printf("  update                             - Update package cache\n");
+  printf(
+      "  upgrade [package...]               - Upgrade installed package(s)\n");
+  printf("  install <package> [package2...]    - Install package(s)\n");
+  printf("  purge <package> [package2...]     - Remove package(s)\n");
+  printf("  search <query>                     - Search for packages\n");
+  printf("  list                               - List installed packages\n");
+  printf("  show <package>                     - Show package details\n");
+  printf("  owns <path>                        - Show which package installed a file\n");
+  printf("  clean                              - Remove all cached archives\n");
+  printf("  autoclean                          - Remove outdated archives and "
+         "enforce the cache size\n");
+  printf(
+      "  repo-list                          - List configured repositories\n");
+  printf("  repo-add <url>                     - Add a repository\n");
+  printf("  repo-remove <url>                  - Remove a repository\n");
+  printf("\n");
+  printf("Options:\n");
+  printf("  -h, --help           Show this help message\n");
+  printf("  -v, --verbose        Verbose mode\n");
+  printf("  -y, --yes            Assume yes to all prompts\n");
+  printf("  -q, --quiet          Quiet mode\n");
+  printf("  -s, --simulate       Simulate actions (dry-run)\n");
+  printf("  -d, --download-only  Download packages only, don't install\n");
+  printf("  --version            Show version information\n");
+  printf("  --timings            Print a per-phase timing table on exit\n");
+  printf("  --trace-file <path>  Write a Chrome trace-event JSON file\n");
+  printf("\n");
+  printf("Environment:\n");
+  printf("  VICPKG_CACHE_SIZE    Archive cache size cap (default 128M)\n");
 }
 
+void show_version() { printf("vicpkg version %s\n", VICPKG_VERSION); }
+
 void trim_string(char *str) {
   char *end;
   while (isspace((unsigned char)*str))
@@ -484,17 +763,22 @@ void trim_string(char *str) {
   end[1] = '\0';
 }
 
-void remove_symlinks_for_package(const char *package_name) {
-  char files_list[MAX_PATH];
-  snprintf(files_list, sizeof(files_list), "%s/%s", FILES_DIR, package_name);
+/* Copies the next line of a file manifest into `line`; 0 at the end. */
+int next_manifest_line(const char **cursor, char *line, size_t size) {
+  const char *p = *cursor;
+  if (*p == '\0')
+    return 0;
 
-  FILE *f = fopen(files_list, "r");
-  if (!f)
-    return;
+  size_t len = strcspn(p, "\n");
+  snprintf(line, size, "%.*s", (int)(len < size ? len : size - 1), p);
+  *cursor = p[len] ? p + len + 1 : p + len;
+  trim_string(line);
+  return 1;
+}
 
+void remove_symlinks_for_package(const char *files) {
   char line[MAX_PATH];
-  while (fgets(line, sizeof(line), f)) {
-    trim_string(line);
+  while (next_manifest_line(&files, line, sizeof(line))) {
     if (line[0] == '\0')
       continue;
 
@@ -516,227 +800,625 @@ void remove_symlinks_for_package(const char *package_name) {
       }
     }
   }
-
-  fclose(f);
 }
 
-char *detect_compression(const char *filepath) {
-  FILE *f = fopen(filepath, "rb");
-  if (!f)
-    return "unknown";
+/* State for unpacking a legacy archive; see legacy_member_done(). */
+typedef struct {
+  const char *temp_dir;
+  const char *install_dir;
+  RewritePool *rewrite;
+  FetchBuffer files;
+} LegacyUnpack;
+
+/* Links BIN_DIR/<name> to the installed entry; done while it is unpacked. */
+void link_legacy_entry(const char *install_dir, const char *name) {
+  char source[MAX_PATH];
+  char target[MAX_PATH];
+  snprintf(source, sizeof(source), "%s/%s", install_dir, name);
+  snprintf(target, sizeof(target), "%s/%s", BIN_DIR, name);
+
+  unlink(target);
+  if (symlink(source, target) == 0) {
+    if (verbose_mode) {
+      printf("[VERBOSE] Created symlink: %s -> %s\n", target, source);
+    }
+  } else if (verbose_mode) {
+    printf("[VERBOSE] Failed to create symlink for %s\n", name);
+  }
+}
 
-  unsigned char magic[4];
-  size_t read = fread(magic, 1, 4, f);
-  fclose(f);
+/*
+ * Called as each member of a legacy archive lands in the temporary
+ * directory. Top-level files are made executable, every regular file is
+ * queued for /data/purplpkg rewriting, and each new top-level entry is
+ * added to the manifest and linked into BIN_DIR, so nothing needs another
+ * pass over the tree.
+ */
+void legacy_member_done(void *user, const char *path, char type) {
+  LegacyUnpack *u = user;
+  const char *rel = path + strlen(u->temp_dir) + 1;
+  size_t top_len = strcspn(rel, "/");
+
+  if (type == TAR_FILE) {
+    if (rel[top_len] == '\0') {
+      chmod(path, 0755);
+      if (verbose_mode) {
+        printf("[VERBOSE] Set executable permissions: %s\n", rel);
+      }
+    }
+    rewrite_pool_add(u->rewrite, path);
+  }
 
-  if (read < 2)
-    return "unknown";
+  if (rel[0] == '.' || top_len >= 256)
+    return;
 
-  if (magic[0] == 0x1f && magic[1] == 0x8b)
-    return "gzip";
-  if (magic[0] == 0x42 && magic[1] == 0x5a)
-    return "bzip2";
-  if (magic[0] == 0xfd && magic[1] == 0x37)
-    return "xz";
-  if (read >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
-      magic[3] == 0xfd)
-    return "zstd";
+  char name[256];
+  char line[MAX_PATH];
+  snprintf(name, sizeof(name), "%.*s", (int)top_len, rel);
+  int n = snprintf(line, sizeof(line), "%s/%s\n", u->install_dir, name);
 
-  return "gzip";
+  /* Members of one directory arrive together; most are not new. */
+  for (const char *p = u->files.data; p && *p; p = strchr(p, '\n') + 1) {
+    if (strncmp(p, line, n) == 0)
+      return;
+  }
+  fetch_buffer_sink(&u->files, line, n);
+  link_legacy_entry(u->install_dir, name);
 }
 
-int extract_legacy_package(const char *package_file, const char *package_name) {
-  char *compression = detect_compression(package_file);
-  char cmd[MAX_PATH * 2];
+/* Drops the links made for a failed install that are left dangling. */
+void unlink_legacy_entries(const char *files) {
+  char line[MAX_PATH];
+  while (next_manifest_line(&files, line, sizeof(line))) {
+    struct stat st;
+    char *name = strrchr(line, '/');
+    if (!name || lstat(line, &st) == 0)
+      continue;
 
-  if (verbose_mode) {
-    printf("[VERBOSE] Extracting legacy package with compression type: %s\n", compression);
+    char target[MAX_PATH];
+    snprintf(target, sizeof(target), "%s/%s", BIN_DIR, name + 1);
+    unlink(target);
   }
+}
 
+/*
+ * Streams a legacy archive from `url` into LEGACY_INSTALL_DIR/<package>,
+ * patching, marking executable and linking each member as it arrives. The
+ * archive is unpacked into a sibling directory and renamed into place, so
+ * a failed transfer leaves the installed copy alone. On success *files is
+ * the malloc'd manifest of top-level entries.
+ */
+int install_legacy_package(const char *url, const char *package,
+                           char **files) {
+  char install_dir[MAX_PATH];
   char temp_dir[MAX_PATH];
-  snprintf(temp_dir, sizeof(temp_dir), "/tmp/vicpkg_extract_%s", package_name);
-
-  snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-  system(cmd);
+  snprintf(install_dir, sizeof(install_dir), "%s/%s", LEGACY_INSTALL_DIR,
+           package);
+  snprintf(temp_dir, sizeof(temp_dir), "%s/.%s.%d.tmp", LEGACY_INSTALL_DIR,
+           package, (int)getpid());
+
+  *files = NULL;
+  fs_remove_tree(temp_dir);
+  if (!fs_make_dirs(temp_dir, 0755)) {
+    fprintf(stderr, "Failed to create %s: %s\n", temp_dir, strerror(errno));
+    return 0;
+  }
 
-  mkdir(temp_dir, 0755);
+  LegacyUnpack u;
+  memset(&u, 0, sizeof(u));
+  u.temp_dir = temp_dir;
+  u.install_dir = install_dir;
+  u.rewrite = rewrite_pool_new(LEGACY_PREFIX, install_dir, REWRITE_WORKERS);
 
-  
-  if (strcmp(compression, "gzip") == 0) {
-    snprintf(cmd, sizeof(cmd), "tar -xzf %s -C %s 2>/dev/null", package_file, temp_dir);
-  } else if (strcmp(compression, "bzip2") == 0) {
-    snprintf(cmd, sizeof(cmd), "tar -xjf %s -C %s 2>/dev/null", package_file, temp_dir);
-  } else if (strcmp(compression, "xz") == 0) {
-    snprintf(cmd, sizeof(cmd), "tar -xJf %s -C %s 2>/dev/null", package_file, temp_dir);
-  } else if (strcmp(compression, "zstd") == 0) {
-    snprintf(cmd, sizeof(cmd), "tar --zstd -xf %s -C %s 2>/dev/null", package_file, temp_dir);
-  } else {
-    snprintf(cmd, sizeof(cmd), "tar -xzf %s -C %s 2>/dev/null", package_file, temp_dir);
+  Extractor *x = u.rewrite ? extractor_new(temp_dir, "auto") : NULL;
+  if (!x) {
+    if (u.rewrite)
+      rewrite_pool_finish(u.rewrite);
+    fs_remove_tree(temp_dir);
+    return 0;
   }
+  extractor_set_flat(x);
+  extractor_set_done(x, legacy_member_done, &u);
 
   if (verbose_mode) {
-    printf("[VERBOSE] Running: %s\n", cmd);
+    printf("[VERBOSE] Streaming legacy package from: %s\n", url);
   }
 
-  if (system(cmd) != 0) {
-    fprintf(stderr, "Failed to extract archive\n");
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-    system(cmd);
-    return 0;
+  int span = trace_begin("legacy extract", package);
+  FetchResponse resp;
+  int ok = fetch_url(url, NULL, extractor_sink, x, &resp) &&
+           fetch_status_ok(&resp) && extractor_finish(x);
+  if (!ok) {
+    fprintf(stderr, "Failed to extract %s (HTTP %d)\n", url, resp.status);
   }
+  extractor_free(x);
 
-  
-  char install_dir[MAX_PATH];
-  snprintf(install_dir, sizeof(install_dir), "%s/%s", LEGACY_INSTALL_DIR, package_name);
-  
-  snprintf(cmd, sizeof(cmd), "rm -rf %s", install_dir);
-  system(cmd);
-  
-  mkdir(install_dir, 0755);
+  /* The pool has been patching files while the rest arrived. */
+  int patched = rewrite_pool_finish(u.rewrite);
+  trace_end(span);
+  if (patched < 0)
+    ok = 0;
+  else if (verbose_mode && patched > 0)
+    printf("[VERBOSE] Patched paths in %d files\n", patched);
 
-  
-  snprintf(cmd, sizeof(cmd), "mv %s/* %s/ 2>/dev/null", temp_dir, install_dir);
-  if (system(cmd) != 0) {
-    fprintf(stderr, "Failed to move files to install directory\n");
-    snprintf(cmd, sizeof(cmd), "rm -rf %s %s", temp_dir, install_dir);
-    system(cmd);
+  if (ok && (!fs_remove_tree(install_dir) || !fs_move(temp_dir, install_dir))) {
+    fprintf(stderr, "Failed to move files to install directory: %s\n",
+            strerror(errno));
+    ok = 0;
+  }
+
+  if (!ok) {
+    fs_remove_tree(temp_dir);
+    if (u.files.data)
+      unlink_legacy_entries(u.files.data);
+    fetch_buffer_free(&u.files);
     return 0;
   }
 
-  
-  snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-  system(cmd);
+  if (verbose_mode) {
+    printf("[VERBOSE] Legacy package installed to: %s\n", install_dir);
+  }
+  *files = u.files.data ? u.files.data : strdup("");
+  return *files != NULL;
+}
 
-  
-  DIR *dir = opendir(install_dir);
-  if (dir) {
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-      if (entry->d_name[0] != '.') {
-        char filepath[MAX_PATH];
-        snprintf(filepath, sizeof(filepath), "%s/%s", install_dir, entry->d_name);
-        
-        struct stat st;
-        if (stat(filepath, &st) == 0 && S_ISREG(st.st_mode)) {
-          patch_file_paths(filepath, install_dir);
-        }
-      }
-    }
-    closedir(dir);
+/* Reports `path` if a package other than `package` owns it. */
+int file_owned_by_other(const StatusDB *db, const char *package,
+                        const char *path) {
+  const StatusEntry *e = status_owner(db, path);
+  if (!e || strcmp(status_string(db, e->name), package) == 0)
+    return 0;
+
+  /* Packages may share directories. */
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    return 0;
+
+  fprintf(stderr, "%s: %s is already owned by package %s\n", package, path,
+          status_string(db, e->name));
+  return 1;
+}
+
+typedef struct {
+  StatusDB db;
+  const char *package;
+  int refused;
+} OwnerCheck;
+
+int check_file_owner(void *user, const char *path) {
+  OwnerCheck *c = user;
+  if (file_owned_by_other(&c->db, c->package, path)) {
+    c->refused = 1;
+    return 0;
   }
+  return 1;
+}
 
-  dir = opendir(install_dir);
-  if (dir) {
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-      if (entry->d_name[0] != '.') {
-        char filepath[MAX_PATH];
-        snprintf(filepath, sizeof(filepath), "%s/%s", install_dir, entry->d_name);
-        
-        struct stat st;
-        if (stat(filepath, &st) == 0 && S_ISREG(st.st_mode)) {
-          chmod(filepath, 0755);
-          if (verbose_mode) {
-            printf("[VERBOSE] Set executable permissions: %s\n", filepath);
-          }
-        }
-      }
-    }
-    closedir(dir);
+/*
+ * Records `package` in `edit` as installed from `info`, unless one of its
+ * files belongs to another package in `db`.
+ */
+int record_installed(StatusEdit *edit, const StatusDB *db, const char *package,
+                     const PackageInfo *info, const char *files) {
+  int ok = 1;
+  const char *cursor = files ? files : "";
+  char line[MAX_PATH];
+  while (next_manifest_line(&cursor, line, sizeof(line))) {
+    if (line[0] != '\0' && file_owned_by_other(db, package, line))
+      ok = 0;
   }
 
-  
-  create_symlinks_for_package(package_name, install_dir);
+  StatusRecord *r = ok ? status_edit_set(edit, package) : NULL;
+  if (!r)
+    return 0;
 
-  
-  char files_list[MAX_PATH];
-  snprintf(files_list, sizeof(files_list), "%s/%s", FILES_DIR, package_name);
-  
-  FILE *flist = fopen(files_list, "w");
-  if (flist) {
-    dir = opendir(install_dir);
-    if (dir) {
-      struct dirent *entry;
-      while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_name[0] != '.') {
-          fprintf(flist, "%s/%s\n", install_dir, entry->d_name);
-        }
-      }
-      closedir(dir);
+  snprintf(r->version, sizeof(r->version), "%s", info->version);
+  snprintf(r->repo, sizeof(r->repo), "%s", info->repo);
+  snprintf(r->sha256, sizeof(r->sha256), "%s", info->sha256);
+  r->flags = info->is_legacy ? STATUS_FLAG_LEGACY : 0;
+  r->installed = (long long)time(NULL);
+  free(r->files);
+  r->files = strdup(files ? files : "");
+  return r->files != NULL;
+}
+
+/*
+ * Loads the installed-package database into `edit` with `package` recorded
+ * as installed from `info`. Called with the status lock held.
+ */
+int edit_installed(StatusEdit *edit, const char *package,
+                   const PackageInfo *info, const char *files) {
+  StatusDB db;
+  status_open(&db);
+  int ok = status_edit_load(edit, &db) &&
+           record_installed(edit, &db, package, info, files);
+  status_close(&db);
+  return ok;
+}
+
+typedef struct {
+  FetchSink sink;
+  void *user;
+  StoreWriter *store;
+  PartialState *state;
+  const FetchResponse *resp;
+  const char *url;
+  Sha256 sha;
+  long long bytes;
+  long long expected_size;
+  long long range_start;
+  int started;
+  int failed;
+} VerifySink;
+
+void partial_state(PartialState *state, const char *url, long long size,
+                   const char *sha256) {
+  memset(state, 0, sizeof(PartialState));
+  snprintf(state->url, sizeof(state->url), "%s", url);
+  state->size = size;
+  snprintf(state->sha256, sizeof(state->sha256), "%s", sha256);
+}
+
+/* Passes bytes kept by an earlier run through the hash and the sink. */
+int replay_partial(VerifySink *v, long long upto) {
+  char buf[65536];
+  while (v->bytes < upto) {
+    if (!v->store)
+      return 0;
+    size_t want = upto - v->bytes < (long long)sizeof(buf)
+                      ? (size_t)(upto - v->bytes)
+                      : sizeof(buf);
+    ssize_t n = pread(fileno(v->store->file), buf, want, v->bytes);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    sha256_update(&v->sha, buf, n);
+    v->bytes += n;
+    if (v->sink && !v->sink(v->user, buf, n))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Runs on the first body bytes of each attempt. A 206 continues the
+ * download, after replaying whatever an earlier run kept. Anything else is
+ * the whole file again, which can only be taken while nothing has been
+ * passed on yet. The state beside the partial download is updated with the
+ * server's validator for the next resume.
+ */
+int resume_response(VerifySink *v) {
+  const FetchResponse *r = v->resp;
+  if (v->range_start > 0 && r->status == 206) {
+    if (!replay_partial(v, v->range_start))
+      return 0;
+  } else if (v->range_start > 0) {
+    if (v->bytes > 0 || (v->store && !store_writer_restart(v->store)))
+      return 0;
+    v->range_start = 0;
+  }
+
+  if (v->store && v->state) {
+    /* Weak ETags are not allowed in If-Range. */
+    const char *validator = r->etag[0] && strncmp(r->etag, "W/", 2) != 0
+                                ? r->etag
+                                : r->last_modified;
+    snprintf(v->state->url, sizeof(v->state->url), "%s", v->url);
+    snprintf(v->state->validator, sizeof(v->state->validator), "%s",
+             validator);
+    store_writer_save_state(v->store, v->state);
+  }
+  return 1;
+}
+
+/*
+ * Hashes and counts bytes on their way to `sink` and, when the archive is
+ * being kept, to `store`. Failing to keep a copy does not fail an install.
+ */
+int verify_sink(void *user, const char *data, size_t len) {
+  VerifySink *v = user;
+  if (!v->started) {
+    v->started = 1;
+    if (!resume_response(v)) {
+      v->failed = 1;
+      return 0;
     }
-    fclose(flist);
   }
 
-  if (verbose_mode) {
-    printf("[VERBOSE] Legacy package installed to: %s\n", install_dir);
+  v->bytes += len;
+  if (v->expected_size > 0 && v->bytes > v->expected_size) {
+    fprintf(stderr, "Size mismatch for %s: expected %lld bytes, got more\n",
+            v->url, v->expected_size);
+    v->failed = 1;
+    return 0;
   }
+  sha256_update(&v->sha, data, len);
 
+  if (v->store && !store_sink(v->store, data, len)) {
+    if (!v->sink) {
+      v->failed = 1;
+      return 0;
+    }
+    store_writer_abort(v->store);
+    v->store = NULL;
+  }
+  if (v->sink && !v->sink(v->user, data, len)) {
+    v->failed = 1;
+    return 0;
+  }
   return 1;
 }
 
-int extract_package_to_root(const char *package_file) {
-  char *compression = detect_compression(package_file);
-  char cmd[MAX_PATH * 2];
+/*
+ * Whether an attempt that did not deliver the whole file is worth resuming:
+ * the connection dropped, the body came up short or the server was only
+ * temporarily unavailable.
+ */
+int download_interrupted(int fetched, const VerifySink *v,
+                         const FetchResponse *resp) {
+  if (v->failed)
+    return 0;
+  if (!fetched)
+    return 1;
+  if (resp->status == 408 || resp->status == 429 || resp->status >= 500)
+    return 1;
+  if (!fetch_status_ok(resp))
+    return 0;
+  return (resp->content_length >= 0 &&
+          v->bytes - v->range_start < resp->content_length) ||
+         (v->expected_size > 0 && v->bytes < v->expected_size);
+}
+
+/*
+ * Fetches `url` through `v`, picking an interrupted transfer up again with
+ * a Range request from where it stopped (If-Range guards against the file
+ * having changed). The pause before each retry doubles for as long as
+ * attempts make no progress, and FETCH_RETRIES of those in a row give up.
+ * When no server answered at all it gives up at once, for the next mirror.
+ * Returns what the last fetch_url() returned; `interrupted` is set when it
+ * gave up on a transfer that could still be resumed later.
+ */
+int fetch_resumable(const char *url, VerifySink *v, FetchResponse *resp,
+                    int *interrupted) {
+  int stalled = 0;
+  for (;;) {
+    FetchOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    v->range_start = v->store ? v->store->size : v->bytes;
+    v->resp = resp;
+    v->started = 0;
+    if (v->range_start > 0) {
+      opts.ranged = 1;
+      opts.range_start = v->range_start;
+      opts.if_range = v->state ? v->state->validator : NULL;
+    }
+
+    int ok;
+    if (v->expected_size > 0 && v->range_start == v->expected_size) {
+      /* An earlier run received all of it; only the checks are left. */
+      memset(resp, 0, sizeof(FetchResponse));
+      resp->status = 206;
+      ok = replay_partial(v, v->range_start);
+      v->failed = !ok;
+    } else {
+      ok = fetch_url(url, &opts, verify_sink, v, resp);
+    }
+
+    /* The kept bytes reach past the end of what the server has now. */
+    if (ok && resp->status == 416 && v->bytes == 0 && v->store &&
+        v->store->size > 0 && store_writer_restart(v->store))
+      continue;
+
+    *interrupted = download_interrupted(ok, v, resp);
+    if (!*interrupted || (!ok && resp->status == 0))
+      return ok;
 
+    long long received = v->store ? v->store->size : v->bytes;
+    stalled = received > v->range_start ? 0 : stalled + 1;
+    if (stalled >= FETCH_RETRIES)
+      return 0;
+
+    int delay_ms = FETCH_BACKOFF_MS << stalled;
+    if (!quiet_mode) {
+      printf("Download of %s interrupted at %lld bytes, retrying in %d ms\n",
+             url, received, delay_ms);
+    }
+    struct timespec delay = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+  }
+}
+
+/*
+ * Checks a finished package download against the HTTP status, the
+ * Content-Length and the Size and SHA256 fields from Packages.
+ */
+int verify_download(VerifySink *v, const FetchResponse *resp,
+                    const PackageInfo *info, const char *url) {
   if (verbose_mode) {
-    printf("[VERBOSE] Extracting with compression type: %s\n", compression);
+    printf("[VERBOSE] HTTP %d, %lld of %lld bytes\n", resp->status, v->bytes,
+           resp->content_length);
   }
 
-  char temp_dir[MAX_PATH];
-  snprintf(temp_dir, sizeof(temp_dir), "%s/temp_extract", CACHE_DIR);
-
-  snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-  system(cmd);
-
-  mkdir(temp_dir, 0755);
-
-  if (strcmp(compression, "gzip") == 0) {
-    snprintf(cmd, sizeof(cmd), "tar -xzf %s -C %s 2>/dev/null", package_file,
-             temp_dir);
-  } else if (strcmp(compression, "bzip2") == 0) {
-    snprintf(cmd, sizeof(cmd), "tar -xjf %s -C %s 2>/dev/null", package_file,
-             temp_dir);
-  } else if (strcmp(compression, "xz") == 0) {
-    snprintf(cmd, sizeof(cmd), "tar -xJf %s -C %s 2>/dev/null", package_file,
-             temp_dir);
-  } else if (strcmp(compression, "zstd") == 0) {
-    snprintf(cmd, sizeof(cmd), "tar --zstd -xf %s -C %s 2>/dev/null",
-             package_file, temp_dir);
-  } else {
-    snprintf(cmd, sizeof(cmd), "tar -xzf %s -C %s 2>/dev/null", package_file,
-             temp_dir);
+  if (!fetch_status_ok(resp) || v->bytes == 0 ||
+      (resp->content_length >= 0 &&
+       v->bytes - v->range_start != resp->content_length)) {
+    return 0;
   }
 
-  if (system(cmd) != 0) {
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-    system(cmd);
+  if (info->size > 0 && v->bytes != info->size) {
+    fprintf(stderr, "Size mismatch for %s: expected %ld bytes, got %lld\n",
+            url, info->size, v->bytes);
     return 0;
   }
 
-  char pkg_dir[MAX_PATH];
-  snprintf(pkg_dir, sizeof(pkg_dir), "%s/pkg", temp_dir);
+  if (info->sha256[0] != '\0') {
+    char hash[SHA256_HEX_SIZE];
+    sha256_final_hex(&v->sha, hash);
+    if (strcasecmp(hash, info->sha256) != 0) {
+      fprintf(stderr, "Checksum mismatch for %s\n", url);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Where a downloaded archive is kept: the store if it has a checksum. */
+void package_archive_path(const PackageInfo *info, const char *package,
+                          char *path, size_t size) {
+  if (!store_archive_path(info->sha256, path, size)) {
+    snprintf(path, size, "%s/%s.vpkg", CACHE_DIR, package);
+  }
+}
+
+/* Where --download-only keeps a legacy package. */
+void legacy_archive_path(const char *package, char *path, size_t size) {
+  snprintf(path, size, "%s/%s.ppkg", CACHE_DIR, package);
+}
 
-  snprintf(cmd, sizeof(cmd), "cp -rf %s/* %s/ 2>/dev/null", pkg_dir,
-           INSTALL_ROOT);
-  int result = system(cmd);
+/* Decides whether an extracted, verified archive may be committed. */
+typedef int (*CommitGate)(void *user);
 
-  if (result != 0) {
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-    system(cmd);
-    return 0;
+/*
+ * Where an archive is extracted to: its files are staged under `journal`,
+ * and once `gate` allows it the extractor is handed back in `staged` for
+ * the transaction to commit.
+ */
+typedef struct {
+  Journal *journal;
+  CommitGate gate;
+  void *gate_user;
+  Extractor *staged;
+} StageTarget;
+
+/*
+ * Downloads a .vpkg from `url`, verifying it as the bytes arrive. With a
+ * `target` it streams through the decompressor and tar extractor into
+ * staged files, which replace nothing until the whole archive has been
+ * received, unpacked and verified, `gate` has allowed it and the caller
+ * commits target->staged. With `keep` the archive is also saved to
+ * package_archive_path() (only to the store when extracting). Returns 1 on
+ * success, 0 on a failed transfer, -1 if `gate` refused the commit, -2 if
+ * the archive itself failed the size or checksum check and -3 if it cannot
+ * be installed here whichever mirror it comes from: a file belongs to
+ * another package or it could not be staged.
+ */
+int fetch_package_archive(const char *url, const PackageInfo *info,
+                          const char *package, StageTarget *target,
+                          int keep) {
+  int extract = target != NULL;
+  VerifySink v;
+  Extractor *x = NULL;
+  StoreWriter w;
+  PartialState state;
+
+  memset(&v, 0, sizeof(v));
+  sha256_init(&v.sha);
+  v.url = url;
+  v.expected_size = info->size;
+
+  /* Without a checksum an archive is only kept when it is not extracted. */
+  if (keep && (info->sha256[0] || !extract)) {
+    char path[MAX_PATH];
+    package_archive_path(info, package, path, sizeof(path));
+    partial_state(&state, url, info->size, info->sha256);
+    if (store_writer_resume(&w, path, &state)) {
+      v.store = &w;
+      v.state = &state;
+      if (verbose_mode && w.size > 0) {
+        printf("[VERBOSE] Resuming %s at %lld bytes\n", url, w.size);
+      }
+    } else if (!extract) {
+      return 0;
+    }
   }
 
+  OwnerCheck owners;
+  if (extract) {
+    x = extractor_new(INSTALL_ROOT, "auto");
+    if (!x) {
+      if (v.store)
+        store_writer_abort(v.store);
+      return -3;
+    }
+    extractor_set_journal(x, target->journal);
+
+    /* Files owned by other packages are refused before anything is staged. */
+    memset(&owners, 0, sizeof(owners));
+    owners.package = package;
+    status_open(&owners.db);
+    extractor_set_check(x, check_file_owner, &owners);
+    v.sink = extractor_sink;
+    v.user = x;
+  }
+
+  FetchResponse resp;
+  int interrupted;
+  int fetched = fetch_resumable(url, &v, &resp, &interrupted);
+  int finished = !x || extractor_finish(x);
+  int corrupt = fetched && !verify_download(&v, &resp, info, url);
+  int ok = fetched && finished && !corrupt;
+
+  if (v.store) {
+    if (ok) {
+      if (!store_writer_commit(v.store) && !extract)
+        ok = 0;
+    } else if (interrupted) {
+      store_writer_keep(v.store);
+    } else {
+      store_writer_abort(v.store);
+    }
+  }
+
+  if (!x)
+    return ok ? 1 : corrupt ? -2 : 0;
+  status_close(&owners.db);
+
+  int refused = 0;
+  if (ok && target->gate) {
+    int wait_span = trace_begin("wait for dependencies", package);
+    refused = !target->gate(target->gate_user);
+    trace_end(wait_span);
+  }
+  if (!ok || refused) {
+    extractor_abort(x);
+    extractor_free(x);
+    return ok ? -1 : corrupt ? -2 : owners.refused ? -3 : 0;
+  }
+
+  target->staged = x;
   return 1;
 }
 
+/* Downloads `url` to `output`, resuming a download an earlier run left. */
 int download_file(const char *url, const char *output) {
-  char cmd[MAX_PATH * 2];
-  if (quiet_mode) {
-    snprintf(cmd, sizeof(cmd), "curl -s -o %s %s 2>/dev/null", output, url);
-  } else {
-    snprintf(cmd, sizeof(cmd), "curl -# -o %s %s 2>/dev/null", output, url);
-  }
-  return system(cmd) == 0;
+  VerifySink v;
+  StoreWriter w;
+  PartialState state;
+  PackageInfo unknown;
+
+  memset(&v, 0, sizeof(v));
+  memset(&unknown, 0, sizeof(unknown));
+  sha256_init(&v.sha);
+  v.url = url;
+  partial_state(&state, url, 0, "");
+  if (!store_writer_resume(&w, output, &state))
+    return 0;
+  v.store = &w;
+  v.state = &state;
+
+  FetchResponse resp;
+  int interrupted;
+  int ok = fetch_resumable(url, &v, &resp, &interrupted) &&
+           verify_download(&v, &resp, &unknown, url);
+
+  if (ok)
+    return store_writer_commit(&w);
+  if (interrupted)
+    store_writer_keep(&w);
+  else
+    store_writer_abort(&w);
+  return 0;
 }
 
 int check_os_dependency(const PackageInfo *info) {
@@ -765,218 +1447,328 @@ int check_os_dependency(const PackageInfo *info) {
   return 1;
 }
 
-int parse_packages_file(const char *packages_file, const char *package_name,
-                        PackageInfo *info) {
-  FILE *f = fopen(packages_file, "r");
-  if (!f)
-    return 0;
-
-  char line[MAX_LINE];
-  int in_package = 0;
-  int found = 0;
-
-  memset(info, 0, sizeof(PackageInfo));
-
-  while (fgets(line, sizeof(line), f)) {
-    if (line[0] == '\n' || line[0] == '\r') {
-      if (in_package && found)
-        break;
-      in_package = 0;
-      continue;
+int repo_is_configured(VicPkgContext *ctx, const char *repo) {
+  for (int i = 0; i < ctx->repo_count; i++) {
+    if (strcmp(ctx->repos[i], repo) == 0) {
+      return 1;
     }
+  }
+  return 0;
+}
 
-    char *colon = strchr(line, ':');
-    if (!colon)
-      continue;
-
-    *colon = '\0';
-    char *key = line;
-    char *value = colon + 1;
-
-    while (isspace((unsigned char)*value))
-      value++;
-    trim_string(value);
+int open_package_index(PackageIndex *idx) {
+  if (pkgindex_open(idx, PACKAGE_INDEX_FILE)) {
+    return 1;
+  }
+  if (verbose_mode) {
+    printf("[VERBOSE] No usable package index at %s\n", PACKAGE_INDEX_FILE);
+  }
+  return 0;
+}
 
-    if (strcmp(key, "Package") == 0) {
-      in_package = 1;
-      if (strcmp(value, package_name) == 0) {
-        found = 1;
-        strncpy(info->package, value, sizeof(info->package) - 1);
-      }
-    } else if (in_package && found) {
-      if (strcmp(key, "Version") == 0) {
-        strncpy(info->version, value, sizeof(info->version) - 1);
-      } else if (strcmp(key, "Architecture") == 0) {
-        strncpy(info->architecture, value, sizeof(info->architecture) - 1);
-      } else if (strcmp(key, "Filename") == 0) {
-        strncpy(info->filename, value, sizeof(info->filename) - 1);
-      } else if (strcmp(key, "Description") == 0) {
-        strncpy(info->description, value, sizeof(info->description) - 1);
-      } else if (strcmp(key, "Name") == 0) {
-        strncpy(info->name, value, sizeof(info->name) - 1);
-      } else if (strcmp(key, "Size") == 0) {
-        info->size = atol(value);
-      } else if (strcmp(key, "Depends-OS") == 0) {
-        strncpy(info->depends_os, value, sizeof(info->depends_os) - 1);
-      } else if (strcmp(key, "Depends-OS-Version") == 0) {
-        strncpy(info->depends_os_version, value, sizeof(info->depends_os_version) - 1);
-      }
+const PkgIndexEntry *skip_index_entries(VicPkgContext *ctx, PackageIndex *idx,
+                                        const PkgIndexEntry *e) {
+  while (e) {
+    if (!(e->flags & PKGINDEX_FLAG_LEGACY) &&
+        repo_is_configured(ctx, pkgindex_repo(idx, e))) {
+      return e;
     }
+    e = pkgindex_next(idx, e);
   }
+  return NULL;
+}
 
-  fclose(f);
-  return found;
+const PkgIndexEntry *find_index_entry(VicPkgContext *ctx, PackageIndex *idx,
+                                      const char *package) {
+  return skip_index_entries(ctx, idx, pkgindex_lookup(idx, package));
 }
 
-int try_download_package_vicpkg(const char *repo, const char *package,
-                                PackageInfo *info) {
-  char packages_file[MAX_PATH];
-  char cmd[MAX_PATH * 2];
+const PkgIndexEntry *next_index_entry(VicPkgContext *ctx, PackageIndex *idx,
+                                      const PkgIndexEntry *e) {
+  return skip_index_entries(ctx, idx, pkgindex_next(idx, e));
+}
 
-  snprintf(packages_file, sizeof(packages_file), "%s/Packages.tmp", CACHE_DIR);
-  snprintf(cmd, sizeof(cmd), "curl -s -o %s %s/Packages 2>/dev/null",
-           packages_file, repo);
+/* Returns 0 when the URL does not fit in `size`. */
+int package_url(const char *repo, const char *filename, char *url,
+                size_t size) {
+  if (filename[0] == '.' && filename[1] == '/')
+    filename += 2;
+  int n = snprintf(url, size, "%s/%s", repo, filename);
+  return n >= 0 && n < (int)size;
+}
 
-  if (system(cmd) != 0) {
+int try_find_package_in_cache(VicPkgContext *ctx, const char *package, PackageInfo *info) {
+  PackageIndex idx;
+  if (!open_package_index(&idx)) {
     return 0;
   }
 
-  if (!parse_packages_file(packages_file, package, info)) {
-    remove(packages_file);
-    return 0;
+  const PkgIndexEntry *e = find_index_entry(ctx, &idx, package);
+  if (e) {
+    pkgindex_fill_info(&idx, e, info);
   }
 
-  remove(packages_file);
-
-  if (strcmp(info->architecture, "vicpkg") != 0) {
-    if (verbose_mode) {
-      printf("[VERBOSE] Package architecture '%s' doesn't match 'vicpkg'\n",
-             info->architecture);
-    }
-    return 0;
-  }
+  pkgindex_close(&idx);
+  return e != NULL;
+}
 
-  char url[MAX_PATH];
-  char local_file[MAX_PATH];
+/*
+ * Downloads a large archive into the store in byte ranges spread over every
+ * configured repository that lists the same version with the same checksum.
+ * On success `path` names the committed archive.
+ */
+int fetch_segmented(VicPkgContext *ctx, PackageIndex *idx, const char *package,
+                    const PackageInfo *info, char *path, size_t size) {
+  char urls[MAX_REPOS][MAX_PATH];
+  const char *mirrors[MAX_REPOS];
+  int count = 0;
 
-  if (info->filename[0] == '.' && info->filename[1] == '/') {
-    snprintf(url, sizeof(url), "%s/%s", repo, info->filename + 2);
-  } else {
-    snprintf(url, sizeof(url), "%s/%s", repo, info->filename);
+  const PkgIndexEntry *e = find_index_entry(ctx, idx, package);
+  for (; e && count < MAX_REPOS; e = next_index_entry(ctx, idx, e)) {
+    if (strcmp(pkgindex_field(idx, e, IDX_VERSION), info->version) != 0 ||
+        strcasecmp(pkgindex_field(idx, e, IDX_SHA256), info->sha256) != 0)
+      continue;
+    if (!package_url(pkgindex_repo(idx, e), pkgindex_field(idx, e, IDX_FILENAME),
+                     urls[count], sizeof(urls[count])))
+      continue;
+    mirrors[count] = urls[count];
+    count++;
   }
 
-  snprintf(local_file, sizeof(local_file), "%s/%s.vpkg", CACHE_DIR, package);
+  StoreWriter w;
+  PartialState state;
+  if (count == 0 || !store_archive_path(info->sha256, path, size))
+    return 0;
+  partial_state(&state, mirrors[0], info->size, info->sha256);
+  if (!store_writer_resume(&w, path, &state))
+    return 0;
 
   if (verbose_mode) {
-    printf("[VERBOSE] Downloading from: %s\n", url);
+    printf("[VERBOSE] Fetching %s in segments from %d mirror(s)\n", package,
+           count);
+  }
+  int span = trace_begin("segmented fetch", package);
+  long long done = w.size;
+  int ok = segment_fetch(mirrors, count, info->size, fileno(w.file), &done,
+                         info->sha256);
+  trace_end(span);
+
+  if (ok)
+    return store_writer_commit(&w);
+
+  /* What arrived in one piece is kept for the plain download to resume. */
+  if (done > 0 && ftruncate(fileno(w.file), done) == 0 &&
+      fseeko(w.file, done, SEEK_SET) == 0) {
+    w.size = done;
+    store_writer_save_state(&w, &state);
+    store_writer_keep(&w);
+  } else {
+    store_writer_abort(&w);
   }
+  return 0;
+}
 
-  if (!download_file(url, local_file)) {
+/*
+ * Checks a stored archive against its checksum, for when extracting it
+ * stopped before the whole file had been read and hashed.
+ */
+int archive_intact(const char *path, const char *sha256) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
     return 0;
-  }
 
-  if (file_contains_404(local_file)) {
-    remove(local_file);
-    return 0;
-  }
+  Sha256 sha;
+  char buf[65536], hash[SHA256_HEX_SIZE];
+  size_t n;
+  sha256_init(&sha);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    sha256_update(&sha, buf, n);
+  int ok = !ferror(f);
+  fclose(f);
 
-  info->is_legacy = 0;
-  return 1;
+  sha256_final_hex(&sha, hash);
+  return ok && strcasecmp(hash, sha256) == 0;
 }
 
-int try_find_package_in_cache(VicPkgContext *ctx, const char *package, PackageInfo *info) {
-  for (int i = 0; i < ctx->repo_count; i++) {
-    if (ctx->repo_priority[i] >= 100) {
-      char packages_file[MAX_PATH];
-      snprintf(packages_file, sizeof(packages_file), "%s/Packages_%d",
-               CACHE_DIR, i);
-
-      if (parse_packages_file(packages_file, package, info)) {
-        info->is_legacy = 0;
-        
-        
-        char url[MAX_PATH];
-        char local_file[MAX_PATH];
-
-        if (info->filename[0] == '.' && info->filename[1] == '/') {
-          snprintf(url, sizeof(url), "%s/%s", ctx->repos[i], info->filename + 2);
-        } else {
-          snprintf(url, sizeof(url), "%s/%s", ctx->repos[i], info->filename);
-        }
+/*
+ * Stages into `target` (or without one, just downloads to
+ * package_archive_path()) the version of a package named in `info` from the
+ * first repository in priority order that serves it successfully. Archives
+ * already in the store are used without a download.
+ */
+int fetch_package(VicPkgContext *ctx, const char *package, PackageInfo *info,
+                  StageTarget *target) {
+  int download = target == NULL;
+  PackageIndex idx;
+  if (!open_package_index(&idx)) {
+    return 0;
+  }
 
-        snprintf(local_file, sizeof(local_file), "%s/%s.vpkg", CACHE_DIR, package);
+  char wanted[sizeof(info->version)];
+  snprintf(wanted, sizeof(wanted), "%s", info->version);
 
-        if (verbose_mode) {
-          printf("[VERBOSE] Downloading from cache info: %s\n", url);
-        }
+  int ok = 0, segmented = 0;
+  const PkgIndexEntry *e = find_index_entry(ctx, &idx, package);
+  for (; e && ok == 0; e = next_index_entry(ctx, &idx, e)) {
+    char cached[MAX_PATH];
+    char url[sizeof("file://") + MAX_PATH];
+    if (wanted[0] && strcmp(pkgindex_field(&idx, e, IDX_VERSION), wanted) != 0)
+      continue;
+    pkgindex_fill_info(&idx, e, info);
+
+    /*
+     * A segmented download was checked as it arrived, and is extracted from
+     * where it was committed rather than looked up in the store again.
+     */
+    PackageInfo checked = *info;
+    int stored = store_lookup(info->sha256, cached, sizeof(cached));
+    if (!stored && !segmented && info->size >= SEGMENT_MIN_SIZE &&
+        info->sha256[0]) {
+      segmented = 1;
+      stored = fetch_segmented(ctx, &idx, package, info, cached,
+                               sizeof(cached));
+      if (stored)
+        checked.sha256[0] = '\0';
+    }
 
-        if (!download_file(url, local_file)) {
-          continue;
-        }
+    if (stored) {
+      if (verbose_mode) {
+        printf("[VERBOSE] Using cached archive %s\n", cached);
+      }
+      if (download) {
+        ok = 1;
+        break;
+      }
 
-        if (file_contains_404(local_file)) {
-          remove(local_file);
-          continue;
-        }
+      snprintf(url, sizeof(url), "file://%s", cached);
+      ok = fetch_package_archive(url, &checked, package, target, 0);
+      /* Only a damaged archive is worth downloading again. */
+      if (ok == 0 && !archive_intact(cached, info->sha256))
+        ok = -2;
+      if (ok != -2)
+        break;
+      remove(cached);
+    }
 
-        return 1;
-      }
+    if (!package_url(pkgindex_repo(&idx, e), info->filename, url,
+                     sizeof(url))) {
+      fprintf(stderr, "URL of %s is too long\n", package);
+      continue;
     }
+
+    if (verbose_mode) {
+      printf("[VERBOSE] Downloading from cache info: %s\n", url);
+    }
+
+    ok = fetch_package_archive(url, info, package, target, 1);
+    /* Only a failed transfer or a damaged archive is worth another mirror. */
+    if (ok == -2)
+      ok = 0;
   }
-  return 0;
+
+  pkgindex_close(&idx);
+  return ok > 0;
 }
 
-int try_download_package_legacy(const char *repo, const char *package, PackageInfo *info) {
+typedef struct {
+  const char *repo;
+  const char *package;
+  int found;
+  long size;
+  FetchBuffer version;
+} LegacyProbe;
+
+/*
+ * Checks a legacy repository for <package>/<package>.ppkg with a HEAD
+ * request and, when it is there, reads the small .version file alongside.
+ */
+void *probe_legacy_thread(void *arg) {
+  LegacyProbe *probe = arg;
   char url[MAX_PATH];
-  char version_url[MAX_PATH];
-  char flist_url[MAX_PATH];
-  char local_file[MAX_PATH];
-  char version_file[MAX_PATH];
-  char flist_file[MAX_PATH];
+  FetchOptions opts = {0};
+  FetchResponse resp;
+
+  opts.head_only = 1;
+  opts.timeout_ms = REPO_PROBE_TIMEOUT_MS;
+  opts.deadline_ms = REPO_PROBE_DEADLINE_MS;
+  snprintf(url, sizeof(url), "%s/%s/%s.ppkg", probe->repo, probe->package,
+           probe->package);
+  if (!fetch_url(url, &opts, NULL, NULL, &resp) || !fetch_status_ok(&resp))
+    return NULL;
 
-  snprintf(url, sizeof(url), "%s/%s/%s.ppkg", repo, package, package);
-  snprintf(version_url, sizeof(version_url), "%s/%s/%s.version", repo, package, package);
-  snprintf(flist_url, sizeof(flist_url), "%s/%s/%s.flist", repo, package, package);
+  probe->found = 1;
+  probe->size = resp.content_length > 0 ? (long)resp.content_length : 0;
 
-  snprintf(local_file, sizeof(local_file), "%s/%s.ppkg", CACHE_DIR, package);
-  snprintf(version_file, sizeof(version_file), "%s/%s.version.tmp", CACHE_DIR, package);
-  snprintf(flist_file, sizeof(flist_file), "%s/%s.flist.tmp", CACHE_DIR, package);
+  opts.head_only = 0;
+  snprintf(url, sizeof(url), "%s/%s/%s.version", probe->repo, probe->package,
+           probe->package);
+  if (!fetch_to_buffer(url, &opts, &probe->version, &resp))
+    fetch_buffer_free(&probe->version);
+  return NULL;
+}
 
-  if (verbose_mode) {
-    printf("[VERBOSE] Trying legacy download from: %s\n", url);
-  }
+/*
+ * Looks for an unversioned package in all legacy repositories at once and
+ * takes it from the first one, in priority order, that has it. Only the
+ * version is read here; the archive is streamed at install time.
+ */
+int find_legacy_package(VicPkgContext *ctx, const char *package,
+                        PackageInfo *info) {
+  LegacyProbe probes[MAX_REPOS];
+  pthread_t threads[MAX_REPOS];
+  int started[MAX_REPOS];
+  int span = trace_begin("probe legacy", package);
 
-  
-  if (!download_file(url, local_file)) {
-    return 0;
+  memset(probes, 0, sizeof(probes));
+  for (int i = 0; i < ctx->repo_count; i++) {
+    started[i] = 0;
+    if (ctx->repo_priority[i] >= 100)
+      continue;
+    if (verbose_mode) {
+      printf("[VERBOSE] Trying legacy repository: %s\n", ctx->repos[i]);
+    }
+    probes[i].repo = ctx->repos[i];
+    probes[i].package = package;
+    started[i] = pthread_create(&threads[i], NULL, probe_legacy_thread,
+                                &probes[i]) == 0;
+    if (!started[i]) {
+      probe_legacy_thread(&probes[i]);
+    }
   }
 
-  if (file_contains_404(local_file)) {
-    remove(local_file);
-    return 0;
+  int chosen = -1;
+  for (int i = 0; i < ctx->repo_count; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    if (chosen < 0 && probes[i].found) {
+      chosen = i;
+    }
   }
-
-  
-  download_file(version_url, version_file);
-  download_file(flist_url, flist_file);
-
-  
-  strncpy(info->package, package, sizeof(info->package) - 1);
-  strncpy(info->architecture, "legacy", sizeof(info->architecture) - 1);
-  info->is_legacy = 1;
-
-  
-  FILE *vf = fopen(version_file, "r");
-  if (vf) {
-    if (fgets(info->version, sizeof(info->version), vf)) {
-      trim_string(info->version);
+  trace_end(span);
+
+  if (chosen >= 0) {
+    LegacyProbe *p = &probes[chosen];
+    memset(info, 0, sizeof(PackageInfo));
+    snprintf(info->package, sizeof(info->package), "%s", package);
+    snprintf(info->architecture, sizeof(info->architecture), "legacy");
+    snprintf(info->repo, sizeof(info->repo), "%s", p->repo);
+    snprintf(info->version, sizeof(info->version), "%s",
+             p->version.data ? p->version.data : "unknown");
+    trim_string(info->version);
+    if (!info->version[0])
+      snprintf(info->version, sizeof(info->version), "unknown");
+    info->size = p->size;
+    info->is_legacy = 1;
+    if (verbose_mode) {
+      printf("[VERBOSE] Found %s %s in %s\n", package, info->version, p->repo);
     }
-    fclose(vf);
-  } else {
-    strncpy(info->version, "unknown", sizeof(info->version) - 1);
   }
 
-  return 1;
+  for (int i = 0; i < ctx->repo_count; i++) {
+    fetch_buffer_free(&probes[i].version);
+  }
+  return chosen >= 0;
 }
 
 int is_in_path(const char *filepath) {
@@ -1008,44 +1800,20 @@ int is_in_path(const char *filepath) {
   return 0;
 }
 
-void save_package_list(const char *package, const char *temp_dir) {
-  char temp_list[MAX_PATH];
-  char files_list[MAX_PATH];
-
-  snprintf(temp_list, sizeof(temp_list), "%s/package.list", temp_dir);
-  snprintf(files_list, sizeof(files_list), "%s/%s", FILES_DIR, package);
-
-  FILE *src = fopen(temp_list, "r");
-  if (src) {
-    FILE *dst = fopen(files_list, "w");
-    if (dst) {
-      char line[MAX_PATH];
-      while (fgets(line, sizeof(line), src)) {
-        fputs(line, dst);
-      }
-      fclose(dst);
-    }
-    fclose(src);
-  }
-}
-
 void check_path_warning(const char *package) {
-  char files_list[MAX_PATH];
-  snprintf(files_list, sizeof(files_list), "%s/%s", FILES_DIR, package);
-
-  FILE *f = fopen(files_list, "r");
-  if (!f)
+  StatusDB db;
+  status_open(&db);
+  const StatusEntry *e = status_lookup(&db, package);
+  if (!e) {
+    status_close(&db);
     return;
+  }
 
+  const char *files = status_string(&db, e->files);
   char line[MAX_PATH];
   int found_in_path = 0;
 
-  while (fgets(line, sizeof(line), f)) {
-    size_t len = strlen(line);
-    if (len > 0 && line[len - 1] == '\n') {
-      line[len - 1] = '\0';
-    }
-
+  while (next_manifest_line(&files, line, sizeof(line))) {
     if (access(line, X_OK) == 0) {
       if (is_in_path(line)) {
         found_in_path = 1;
@@ -1056,7 +1824,7 @@ void check_path_warning(const char *package) {
       }
     }
   }
-  fclose(f);
+  status_close(&db);
 
   if (!found_in_path) {
     printf("NOTE: Legacy package installed to: %s/%s/\n", 
@@ -1097,142 +1865,338 @@ char *format_size(long bytes) {
   return buffer;
 }
 
-int cmd_update(VicPkgContext *ctx) {
-  if (!quiet_mode)
-    printf("Updating package cache...\n");
+typedef struct {
+  IndexBuilder *builder;
+  int repo;
+  Sha256 sha;
+  Decoder *decoder;
+} ListSink;
+
+int list_decoded_sink(void *user, const char *data, size_t len) {
+  ListSink *sink = user;
+  return index_builder_feed(sink->builder, sink->repo, data, len);
+}
 
-  for (int i = 0; i < ctx->repo_count; i++) {
-    if (!quiet_mode)
-      printf("Fetching from: %s\n", ctx->repos[i]);
+int list_sink(void *user, const char *data, size_t len) {
+  ListSink *sink = user;
+  sha256_update(&sink->sha, data, len);
+  if (sink->decoder)
+    return decoder_feed(sink->decoder, data, len);
+  return index_builder_feed(sink->builder, sink->repo, data, len);
+}
 
-    if (ctx->repo_priority[i] >= 100) {
-      char packages_file[MAX_PATH];
-      char cmd[MAX_PATH * 2];
+typedef struct {
+  const char *name;
+  const char *compression;
+  char sum[SHA256_HEX_SIZE];
+} ListVariant;
+
+/* Compressed package lists, most compact first. */
+static const char *list_variant_names[][2] = {
+    {"Packages.zst", "zstd"},
+    {"Packages.xz", "xz"},
+    {"Packages.bz2", "bzip2"},
+    {"Packages.gz", "gzip"},
+};
+
+/*
+ * Orders the package lists to try for a repo: compressed variants listed in
+ * the Release SHA256 section (in-process codecs before external ones), then
+ * the plain list.
+ */
+int collect_list_variants(const RepoState *st, int is_legacy,
+                          ListVariant *variants) {
+  int count = 0;
+  int n = sizeof(list_variant_names) / sizeof(list_variant_names[0]);
 
-      snprintf(packages_file, sizeof(packages_file), "%s/Packages_%d",
-               CACHE_DIR, i);
-      snprintf(cmd, sizeof(cmd), "curl -s -o %s %s/Packages 2>/dev/null",
-               packages_file, ctx->repos[i]);
-      
-      int result = system(cmd);
-      if (verbose_mode) {
-        printf("[VERBOSE] Downloaded Packages file to %s (result: %d)\n", packages_file, result);
+  if (!is_legacy && st->release) {
+    for (int pass = 0; pass < 2; pass++) {
+      for (int v = 0; v < n; v++) {
+        if (decoder_in_process(list_variant_names[v][1]) != (pass == 0))
+          continue;
+        ListVariant *lv = &variants[count];
+        if (release_find_checksum(st->release, list_variant_names[v][0],
+                                  lv->sum, sizeof(lv->sum))) {
+          lv->name = list_variant_names[v][0];
+          lv->compression = list_variant_names[v][1];
+          count++;
+        }
       }
-    } else {
-      char list_file[MAX_PATH];
-      char cmd[MAX_PATH * 2];
+    }
+  }
 
-      snprintf(list_file, sizeof(list_file), "%s/package_list_%d", CACHE_DIR,
-               i);
-      snprintf(cmd, sizeof(cmd), "curl -s -o %s %s/package.list 2>/dev/null",
-               list_file, ctx->repos[i]);
-      
-      int result = system(cmd);
+  ListVariant *plain = &variants[count++];
+  plain->name = is_legacy ? "package.list" : "Packages";
+  plain->compression = "none";
+  plain->sum[0] = '\0';
+  if (!is_legacy && st->release) {
+    release_find_checksum(st->release, "Packages", plain->sum,
+                          sizeof(plain->sum));
+  }
+  return count;
+}
+
+/*
+ * Streams one package list variant into the builder. Returns 1 with `hash`
+ * set to the checksum of the downloaded bytes, -1 when the server answered
+ * 304, and 0 on failure (the repo's partial entries are dropped).
+ */
+int fetch_list_variant(const char *repo_url, const ListVariant *variant,
+                       const FetchOptions *opts, IndexBuilder *builder,
+                       int repo, FetchResponse *resp, char *hash) {
+  char url[MAX_PATH];
+  snprintf(url, sizeof(url), "%s/%s", repo_url, variant->name);
+
+  ListSink sink;
+  sink.builder = builder;
+  sink.repo = repo;
+  sink.decoder = NULL;
+  sha256_init(&sink.sha);
+
+  if (strcmp(variant->compression, "none") != 0) {
+    sink.decoder =
+        decoder_new(variant->compression, list_decoded_sink, &sink);
+    if (!sink.decoder)
+      return 0;
+  }
+
+  int ok = fetch_url(url, opts, list_sink, &sink, resp);
+  if (ok && resp->status == 304) {
+    decoder_free(sink.decoder);
+    return -1;
+  }
+
+  ok = ok && fetch_status_ok(resp) &&
+       (resp->content_length < 0 || resp->bytes == resp->content_length);
+  if (sink.decoder) {
+    ok = decoder_finish(sink.decoder) && ok;
+    decoder_free(sink.decoder);
+  }
+  ok = ok && index_builder_finish_repo(builder, repo);
+
+  hash[0] = '\0';
+  if (ok) {
+    sha256_final_hex(&sink.sha, hash);
+    if (variant->sum[0] != '\0' && strcmp(variant->sum, hash) != 0)
+      ok = 0;
+  }
+
+  if (!ok) {
+    if (verbose_mode) {
+      printf("[VERBOSE] Fetching %s failed (HTTP %d)%s\n", url, resp->status,
+             hash[0] != '\0' ? ", checksum mismatch" : "");
+    }
+    index_builder_abort_repo(builder, repo);
+    return 0;
+  }
+
+  if (verbose_mode) {
+    printf("[VERBOSE] Fetched %s (%lld bytes)\n", url, resp->bytes);
+  }
+  return 1;
+}
+
+void commit_release_state(RepoState *st, int gated) {
+  if (st->probe_status != 200 || st->fetched_hash[0] == '\0')
+    return;
+  memcpy(st->release_hash, st->fetched_hash, sizeof(st->release_hash));
+  memcpy(st->release_etag, st->fetched_etag, sizeof(st->release_etag));
+  memcpy(st->release_modified, st->fetched_modified,
+         sizeof(st->release_modified));
+  st->release_gated = gated;
+}
+
+int refresh_repo_list(VicPkgContext *ctx, int i, IndexBuilder *builder,
+                      const PackageIndex *old) {
+  RepoState *st = &ctx->repo_state[i];
+  int is_legacy = ctx->repo_priority[i] < 100;
+  int repo = index_builder_add_repo(builder, ctx->repos[i], is_legacy);
+  int old_repo = old ? pkgindex_find_repo(old, ctx->repos[i], is_legacy) : -1;
+  ListVariant variants[8];
+  int variant_count = 0;
+  int gated = 0;
+  int list_known = 0;
+
+  if (repo < 0)
+    return REPO_FAILED;
+
+  variant_count = collect_list_variants(st, is_legacy, variants);
+  for (int v = 0; v < variant_count; v++) {
+    if (variants[v].sum[0] != '\0') {
+      gated = 1;
+      if (strcmp(variants[v].sum, st->list_hash) == 0)
+        list_known = 1;
+    }
+  }
+
+  if (old_repo >= 0 && !is_legacy) {
+    int release_same =
+        st->release_gated && st->release_hash[0] != '\0' &&
+        (st->probe_status == 304 ||
+         (st->probe_status == 200 &&
+          strcmp(st->fetched_hash, st->release_hash) == 0));
+
+    if (release_same || list_known) {
       if (verbose_mode) {
-        printf("[VERBOSE] Downloaded package.list to %s (result: %d)\n", list_file, result);
+        printf("[VERBOSE] Release for %s unchanged, skipping Packages\n",
+               ctx->repos[i]);
       }
+      index_builder_import_repo(builder, repo, old, old_repo);
+      commit_release_state(st, gated);
+      return REPO_UNCHANGED;
+    }
+  }
+
+  FetchResponse resp;
+  char hash[SHA256_HEX_SIZE] = "";
+  int result = 0;
+
+  for (int v = 0; v < variant_count && result == 0; v++) {
+    /* Checksummed variants are already compared against list_hash above. */
+    FetchOptions opts = {0};
+    if (old_repo >= 0 && variants[v].sum[0] == '\0') {
+      opts.if_none_match = st->list_etag;
+      opts.if_modified_since = st->list_modified;
+    }
+    result = fetch_list_variant(ctx->repos[i], &variants[v], &opts, builder,
+                                repo, &resp, hash);
+  }
+
+  if (result < 0 && old_repo >= 0) {
+    index_builder_import_repo(builder, repo, old, old_repo);
+    commit_release_state(st, gated);
+    return REPO_UNCHANGED;
+  }
+
+  if (result <= 0) {
+    if (old_repo >= 0) {
+      index_builder_import_repo(builder, repo, old, old_repo);
     }
+    return REPO_FAILED;
   }
 
+  int status = (old_repo >= 0 && strcmp(hash, st->list_hash) == 0)
+                   ? REPO_UNCHANGED
+                   : REPO_UPDATED;
+
+  memcpy(st->list_hash, hash, sizeof(st->list_hash));
+  snprintf(st->list_etag, sizeof(st->list_etag), "%s", resp.etag);
+  snprintf(st->list_modified, sizeof(st->list_modified), "%s",
+           resp.last_modified);
+  commit_release_state(st, gated);
+  return status;
+}
+
+int cmd_update(VicPkgContext *ctx) {
   if (!quiet_mode)
-    printf("Package cache updated.\n");
+    printf("Updating package cache...\n");
+
+  if (!ctx->repos_probed) {
+    prioritize_repos(ctx);
+  }
+
+  IndexBuilder *builder = index_builder_new();
+  if (!builder) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  PackageIndex old;
+  int have_old = open_package_index(&old);
+  int counts[3] = {0};
+  static const char *labels[3] = {"failed", "unchanged", "updated"};
+
+  for (int i = 0; i < ctx->repo_count; i++) {
+    int span = trace_begin("refresh list", ctx->repos[i]);
+    int status = refresh_repo_list(ctx, i, builder, have_old ? &old : NULL);
+    trace_end(span);
+    counts[status]++;
+
+    if (!quiet_mode || status == REPO_FAILED) {
+      printf("  %-9s %s\n", labels[status], ctx->repos[i]);
+    }
+  }
+
+  int span = trace_begin("write index", NULL);
+  int ok = index_builder_write(builder, PACKAGE_INDEX_FILE);
+  index_builder_free(builder);
+  trace_end(span);
+  if (have_old) {
+    pkgindex_close(&old);
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Failed to write package index %s\n", PACKAGE_INDEX_FILE);
+    return 1;
+  }
+
+  save_repo_cache(ctx);
+
+  for (int i = 0; i < MAX_REPOS; i++) {
+    char stale[MAX_PATH];
+    snprintf(stale, sizeof(stale), "%s/Packages_%d", CACHE_DIR, i);
+    remove(stale);
+    snprintf(stale, sizeof(stale), "%s/package_list_%d", CACHE_DIR, i);
+    remove(stale);
+  }
+
+  if (!quiet_mode)
+    printf("Package cache updated: %d updated, %d unchanged, %d failed.\n",
+           counts[REPO_UPDATED], counts[REPO_UNCHANGED], counts[REPO_FAILED]);
   return 0;
 }
 
+int search_filter(void *user, const PackageIndex *idx,
+                  const PkgIndexEntry *e) {
+  return repo_is_configured((VicPkgContext *)user, pkgindex_repo(idx, e));
+}
+
 int cmd_search(VicPkgContext *ctx, const char *query) {
   printf("Searching for: %s\n\n", query);
 
-  int found_any = 0;
+  PackageIndex idx;
+  if (!open_package_index(&idx)) {
+    printf("No package lists available. Try running 'vicpkg update' first.\n");
+    return 1;
+  }
 
-  for (int i = 0; i < ctx->repo_count; i++) {
-    if (ctx->repo_priority[i] >= 100) {
-      char packages_file[MAX_PATH];
-      snprintf(packages_file, sizeof(packages_file), "%s/Packages_%d",
-               CACHE_DIR, i);
+  SearchHit *hits;
+  int span = trace_begin("search", query);
+  int count = search_index(&idx, query, search_filter, ctx, &hits);
+  trace_end(span);
+  if (count < 0) {
+    fprintf(stderr, "Out of memory\n");
+    pkgindex_close(&idx);
+    return 1;
+  }
 
-      FILE *f = fopen(packages_file, "r");
-      if (f) {
-        char line[MAX_LINE];
-        char current_package[256] = "";
-        char current_desc[512] = "";
-        char current_version[64] = "";
-
-        while (fgets(line, sizeof(line), f)) {
-          if (strncmp(line, "Package:", 8) == 0) {
-            char *val = line + 8;
-            while (isspace(*val))
-              val++;
-            trim_string(val);
-            strncpy(current_package, val, sizeof(current_package) - 1);
-          } else if (strncmp(line, "Version:", 8) == 0) {
-            char *val = line + 8;
-            while (isspace(*val))
-              val++;
-            trim_string(val);
-            strncpy(current_version, val, sizeof(current_version) - 1);
-          } else if (strncmp(line, "Description:", 12) == 0) {
-            char *val = line + 12;
-            while (isspace(*val))
-              val++;
-            trim_string(val);
-            strncpy(current_desc, val, sizeof(current_desc) - 1);
-          } else if ((line[0] == '\n' || line[0] == '\r') &&
-                     current_package[0] != '\0') {
-            if (strstr(current_package, query) || strstr(current_desc, query)) {
-              printf("%s/%s (%s)\n", ctx->repos[i], current_package,
-                     current_version);
-              if (current_desc[0] != '\0') {
-                printf("  %s\n", current_desc);
-              }
-              printf("\n");
-              found_any = 1;
-            }
-            current_package[0] = '\0';
-            current_desc[0] = '\0';
-            current_version[0] = '\0';
-          }
-        }
-        
-        
-        if (current_package[0] != '\0') {
-          if (strstr(current_package, query) || strstr(current_desc, query)) {
-            printf("%s/%s (%s)\n", ctx->repos[i], current_package,
-                   current_version);
-            if (current_desc[0] != '\0') {
-              printf("  %s\n", current_desc);
-            }
-            printf("\n");
-            found_any = 1;
-          }
-        }
-        
-        fclose(f);
-      } else if (verbose_mode) {
-        printf("[VERBOSE] Could not open %s\n", packages_file);
-      }
-    } else {
-      char list_file[MAX_PATH];
-      snprintf(list_file, sizeof(list_file), "%s/package_list_%d", CACHE_DIR,
-               i);
+  for (int i = 0; i < count; i++) {
+    const PkgIndexEntry *e = hits[i].entry;
+    const char *repo = pkgindex_repo(&idx, e);
+    const char *package = pkgindex_field(&idx, e, IDX_PACKAGE);
 
-      FILE *f = fopen(list_file, "r");
-      if (f) {
-        char line[MAX_LINE];
-        while (fgets(line, sizeof(line), f)) {
-          trim_string(line);
-          if (strstr(line, query)) {
-            printf("%s/%s\n", ctx->repos[i], line);
-            found_any = 1;
-          }
-        }
-        fclose(f);
-      } else if (verbose_mode) {
-        printf("[VERBOSE] Could not open %s\n", list_file);
-      }
+    if (verbose_mode) {
+      printf("[VERBOSE] %s scored %d\n", package, hits[i].score);
+    }
+
+    if (e->flags & PKGINDEX_FLAG_LEGACY) {
+      printf("%s/%s\n", repo, package);
+      continue;
+    }
+
+    const char *desc = pkgindex_field(&idx, e, IDX_DESCRIPTION);
+    printf("%s/%s (%s)\n", repo, package,
+           pkgindex_field(&idx, e, IDX_VERSION));
+    if (desc[0] != '\0') {
+      printf("  %s\n", desc);
     }
+    printf("\n");
   }
 
-  if (!found_any) {
+  free(hits);
+  pkgindex_close(&idx);
+
+  if (count == 0) {
     printf("No packages found matching '%s'\n", query);
   }
 
@@ -1242,18 +2206,15 @@ int cmd_search(VicPkgContext *ctx, const char *query) {
 int cmd_show(VicPkgContext *ctx, const char *package) {
   PackageInfo info;
   int found = 0;
+  PackageIndex idx;
 
-  for (int i = 0; i < ctx->repo_count; i++) {
-    if (ctx->repo_priority[i] >= 100) {
-      char packages_file[MAX_PATH];
-      snprintf(packages_file, sizeof(packages_file), "%s/Packages_%d",
-               CACHE_DIR, i);
-
-      if (parse_packages_file(packages_file, package, &info)) {
-        found = 1;
-        break;
-      }
+  if (open_package_index(&idx)) {
+    const PkgIndexEntry *e = find_index_entry(ctx, &idx, package);
+    if (e) {
+      pkgindex_fill_info(&idx, e, &info);
+      found = 1;
     }
+    pkgindex_close(&idx);
   }
 
   if (!found) {
@@ -1281,20 +2242,29 @@ int cmd_show(VicPkgContext *ctx, const char *package) {
     }
     printf("\n");
   }
+  if (info.depends[0] != '\0') {
+    printf("Depends: %s\n", info.depends);
+  }
+  if (info.conflicts[0] != '\0') {
+    printf("Conflicts: %s\n", info.conflicts);
+  }
 
-  char version_file[MAX_PATH];
-  snprintf(version_file, sizeof(version_file), "%s/%s", VERSIONS_DIR, package);
-  if (access(version_file, F_OK) == 0) {
-    FILE *f = fopen(version_file, "r");
-    if (f) {
-      char installed_ver[64];
-      if (fgets(installed_ver, sizeof(installed_ver), f)) {
-        trim_string(installed_ver);
-        printf("Installed: %s\n", installed_ver);
-      }
-      fclose(f);
+  StatusDB db;
+  status_open(&db);
+  const StatusEntry *e = status_lookup(&db, package);
+  if (e) {
+    printf("Installed: %s\n", status_string(&db, e->version));
+    if (e->installed > 0) {
+      char date[64];
+      time_t when = (time_t)e->installed;
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&when));
+      printf("Installed-Date: %s\n", date);
+    }
+    if (status_string(&db, e->repo)[0] != '\0') {
+      printf("Installed-From: %s\n", status_string(&db, e->repo));
     }
   }
+  status_close(&db);
 
   return 0;
 }
@@ -1302,8 +2272,14 @@ int cmd_show(VicPkgContext *ctx, const char *package) {
 int cmd_list_repos(VicPkgContext *ctx) {
   printf("Configured repositories:\n");
   for (int i = 0; i < ctx->repo_count; i++) {
-    const char *type = (ctx->repo_priority[i] >= 100) ? "vicpkg" : "legacy";
-    printf("%d. %s [%s]\n", i + 1, ctx->repos[i], type);
+    const char *type = ctx->repo_priority[i] >= 100 ? "vicpkg"
+                       : ctx->repo_priority[i] > 0  ? "legacy"
+                                                    : "not probed";
+    printf("%d. %s [%s]", i + 1, ctx->repos[i], type);
+    if (ctx->repo_state[i].date[0] != '\0') {
+      printf(" (%s)", ctx->repo_state[i].date);
+    }
+    printf("\n");
   }
   return 0;
 }
@@ -1323,6 +2299,7 @@ int cmd_add_repo(VicPkgContext *ctx, const char *url) {
 
   ctx->repos[ctx->repo_count] = strdup(url);
   ctx->repo_priority[ctx->repo_count] = 0;
+  memset(&ctx->repo_state[ctx->repo_count], 0, sizeof(RepoState));
   ctx->repo_count++;
 
   FILE *f = fopen(REPOS_FILE, "a");
@@ -1353,11 +2330,14 @@ int cmd_remove_repo(VicPkgContext *ctx, const char *url) {
   }
 
   free(ctx->repos[found]);
+  free(ctx->repo_state[found].release);
   for (int i = found; i < ctx->repo_count - 1; i++) {
     ctx->repos[i] = ctx->repos[i + 1];
     ctx->repo_priority[i] = ctx->repo_priority[i + 1];
+    ctx->repo_state[i] = ctx->repo_state[i + 1];
   }
   ctx->repo_count--;
+  save_repo_cache(ctx);
 
   FILE *f = fopen(REPOS_FILE, "w");
   if (f) {
@@ -1371,39 +2351,114 @@ int cmd_remove_repo(VicPkgContext *ctx, const char *url) {
   return 0;
 }
 
-int cmd_list_installed() {
-  printf("Installed packages:\n");
-  DIR *dir = opendir(FILES_DIR);
-  if (!dir) {
-    fprintf(stderr, "Failed to open %s\n", FILES_DIR);
-    return 1;
+int archive_referenced(const char *sha256, void *user) {
+  const PackageIndex *idx = user;
+  for (uint32_t i = 0; i < idx->hdr->entry_count; i++) {
+    if (strcasecmp(pkgindex_field(idx, &idx->entries[i], IDX_SHA256),
+                   sha256) == 0) {
+      return 1;
+    }
   }
+  return 0;
+}
 
-  struct dirent *entry;
-  int count = 0;
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_name[0] != '.') {
-      char version_file[MAX_PATH];
-      snprintf(version_file, sizeof(version_file), "%s/%s", VERSIONS_DIR,
-               entry->d_name);
+void print_clean_summary(int removed, long long freed) {
+  int kept = 0;
+  long long used = store_usage(&kept);
 
-      FILE *f = fopen(version_file, "r");
-      if (f) {
-        char version[64];
-        if (fgets(version, sizeof(version), f)) {
-          trim_string(version);
-          printf("  %s (%s)\n", entry->d_name, version);
-        } else {
-          printf("  %s\n", entry->d_name);
-        }
-        fclose(f);
-      } else {
-        printf("  %s\n", entry->d_name);
+  if (!quiet_mode) {
+    printf("Removed %d archive%s, freed %s.\n", removed,
+           removed == 1 ? "" : "s", format_size((long)freed));
+    printf("Cache holds %d archive%s (%s", kept, kept == 1 ? "" : "s",
+           format_size((long)used));
+    printf(" of %s).\n", format_size((long)store_cap()));
+  }
+}
+
+int cmd_clean() {
+  int removed = 0;
+  long long freed = 0;
+  int ok = store_clean(NULL, NULL, &removed, &freed);
+
+  /*
+   * Archives from --download-only without a checksum, legacy leftovers and
+   * partial downloads with the state kept beside them.
+   */
+  DIR *dir = opendir(CACHE_DIR);
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      const char *ext = strrchr(entry->d_name, '.');
+      if (!ext || (strcmp(ext, ".vpkg") != 0 && strcmp(ext, ".ppkg") != 0 &&
+                   strcmp(ext, ".part") != 0 &&
+                   !strstr(entry->d_name, ".part.state"))) {
+        continue;
+      }
+
+      char path[MAX_PATH];
+      struct stat st;
+      snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, entry->d_name);
+      if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && unlink(path) == 0) {
+        removed++;
+        freed += st.st_size;
       }
-      count++;
     }
+    closedir(dir);
+  }
+
+  print_clean_summary(removed, freed);
+  return ok ? 0 : 1;
+}
+
+int cmd_autoclean() {
+  int removed = 0;
+  long long freed = 0;
+  int ok = 1;
+
+  PackageIndex idx;
+  if (open_package_index(&idx)) {
+    ok = store_clean(archive_referenced, &idx, &removed, &freed);
+    pkgindex_close(&idx);
   }
-  closedir(dir);
+
+  ok = store_trim(store_cap(), 0, &removed, &freed) && ok;
+  print_clean_summary(removed, freed);
+  return ok ? 0 : 1;
+}
+
+int cmd_owns(const char *path) {
+  StatusDB db;
+  status_open(&db);
+
+  char resolved[PATH_MAX];
+  const char *found = path;
+  const StatusEntry *e = status_owner(&db, path);
+  if (!e && realpath(path, resolved) && strcmp(resolved, path) != 0) {
+    e = status_owner(&db, resolved);
+    found = resolved;
+  }
+
+  if (e) {
+    printf("%s: %s\n", status_string(&db, e->name), found);
+  } else {
+    printf("No package owns %s\n", path);
+  }
+  status_close(&db);
+  return e ? 0 : 1;
+}
+
+int cmd_list_installed() {
+  printf("Installed packages:\n");
+
+  StatusDB db;
+  status_open(&db);
+  int count = status_count(&db);
+  for (int i = 0; i < count; i++) {
+    const StatusEntry *e = &db.entries[i];
+    printf("  %s (%s)\n", status_string(&db, e->name),
+           status_string(&db, e->version));
+  }
+  status_close(&db);
 
   if (count == 0) {
     printf("  No packages installed.\n");
@@ -1413,315 +2468,983 @@ int cmd_list_installed() {
 }
 
 int cmd_remove_package(const char *package) {
-  char files_list[MAX_PATH];
-  snprintf(files_list, sizeof(files_list), "%s/%s", FILES_DIR, package);
+  StatusDB db;
+  status_open(&db);
+  const StatusEntry *e = status_lookup(&db, package);
 
-  if (access(files_list, F_OK) != 0) {
+  if (!e) {
     printf("Package %s is not installed.\n", package);
+    status_close(&db);
     return 1;
   }
 
   if (strcmp(package, "vicpkg") == 0) {
     printf("Cannot remove vicpkg while using it.\n");
+    status_close(&db);
     return 1;
   }
 
   if (!prompt_yes_no("Do you want to continue?")) {
     printf("Abort.\n");
+    status_close(&db);
     return 1;
   }
 
   if (simulate) {
     printf("Would remove %s\n", package);
+    status_close(&db);
     return 0;
   }
 
   if (!quiet_mode)
     printf("Removing %s...\n", package);
 
-  
-  remove_symlinks_for_package(package);
+  int span = trace_begin("remove files", package);
+  const char *files = status_string(&db, e->files);
+  remove_symlinks_for_package(files);
 
-  FILE *f = fopen(files_list, "r");
-  if (f) {
-    char line[MAX_PATH];
-    while (fgets(line, sizeof(line), f)) {
-      trim_string(line);
-      if (line[0] != '\0') {
-        if (verbose_mode) {
-          printf("[VERBOSE] Removing: %s\n", line);
-        }
-        
-        
-        struct stat st;
-        if (stat(line, &st) == 0 && S_ISDIR(st.st_mode)) {
-          char cmd[MAX_PATH * 2];
-          snprintf(cmd, sizeof(cmd), "rm -rf %s", line);
-          system(cmd);
-        } else {
-          remove(line);
-        }
+  char line[MAX_PATH];
+  while (next_manifest_line(&files, line, sizeof(line))) {
+    if (line[0] != '\0') {
+      if (verbose_mode) {
+        printf("[VERBOSE] Removing: %s\n", line);
+      }
+      if (!fs_remove(line) && verbose_mode) {
+        printf("[VERBOSE] Failed to remove %s: %s\n", line, strerror(errno));
       }
     }
-    fclose(f);
   }
+  if (e->flags & STATUS_FLAG_LEGACY) {
+    char install_dir[MAX_PATH];
+    snprintf(install_dir, sizeof(install_dir), "%s/%s", LEGACY_INSTALL_DIR,
+             package);
+    fs_prune_dirs(install_dir, LEGACY_INSTALL_DIR);
+  }
+  trace_end(span);
 
-  remove(files_list);
+  StatusEdit edit;
+  status_lock();
+  int ok = status_edit_load(&edit, &db) && status_edit_remove(&edit, package) &&
+           status_edit_save(&edit);
+  status_edit_free(&edit);
+  status_unlock();
+  status_close(&db);
 
-  char version_file[MAX_PATH];
-  snprintf(version_file, sizeof(version_file), "%s/%s", VERSIONS_DIR, package);
-  remove(version_file);
+  if (!ok) {
+    fprintf(stderr, "Failed to record removal of %s\n", package);
+    return 1;
+  }
 
   if (!quiet_mode)
     printf("Package %s removed.\n", package);
   return 0;
 }
 
-int cmd_install_package(VicPkgContext *ctx, const char *package) {
+typedef struct {
+  char name[256];
   PackageInfo info;
-  int found = 0;
+  char current[64];
+  /* info.is_legacy, kept apart as workers rewrite info while they run. */
+  int legacy;
+  int cached;
+  int requested;
+  int visiting;
+  int *deps;
+  int dep_count;
+  int done;
+  int skipped;
+  int ok;
+  Extractor *staged;
+} InstallItem;
+
+/* Packages to install, with `order` listing them dependencies first. */
+typedef struct {
+  VicPkgContext *ctx;
+  PackageIndex idx;
+  int have_index;
+  StatusDB status;
+  InstallItem *items;
+  int *order;
+  int count;
+  int cap;
+} InstallPlan;
 
-  char version_file[MAX_PATH];
-  snprintf(version_file, sizeof(version_file), "%s/%s", VERSIONS_DIR, package);
-  int is_installed = (access(version_file, F_OK) == 0);
+typedef struct {
+  InstallPlan *plan;
+  Journal journal;
+  int next;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} InstallQueue;
 
-  if (try_find_package_in_cache(ctx, package, &info)) {
-    found = 1;
-    if (verbose_mode) {
-      printf("[VERBOSE] Found package in cache\n");
-    }
+typedef struct {
+  InstallQueue *queue;
+  InstallItem *item;
+} InstallJob;
+
+#define PLAN_FAILED -1
+#define PLAN_SATISFIED -2
+
+int plan_find(const InstallPlan *plan, const char *package) {
+  for (int i = 0; i < plan->count; i++) {
+    if (strcmp(plan->items[i].name, package) == 0)
+      return i;
   }
+  return -1;
+}
 
-  if (!found) {
-    for (int i = 0; i < ctx->repo_count; i++) {
+/*
+ * Picks the first index entry, in repository priority order, whose version
+ * satisfies `r`. Unversioned requests fall back to legacy repositories,
+ * which download the archive right away.
+ */
+int choose_candidate(InstallPlan *plan, const Relation *r, PackageInfo *info,
+                     int *cached) {
+  if (plan->have_index) {
+    const PkgIndexEntry *e = find_index_entry(plan->ctx, &plan->idx, r->name);
+    for (; e; e = next_index_entry(plan->ctx, &plan->idx, e)) {
+      if (!relation_satisfied(r,
+                              pkgindex_field(&plan->idx, e, IDX_VERSION)))
+        continue;
+
+      pkgindex_fill_info(&plan->idx, e, info);
       if (verbose_mode) {
-        printf("[VERBOSE] Trying repository: %s (priority: %d)\n", ctx->repos[i],
-               ctx->repo_priority[i]);
-      }
-
-      if (ctx->repo_priority[i] < 100) {
-        if (try_download_package_legacy(ctx->repos[i], package, &info)) {
-          found = 1;
-          break;
-        }
+        printf("[VERBOSE] Found %s %s in cache\n", r->name, info->version);
       }
+      char path[MAX_PATH];
+      *cached = store_archive_path(info->sha256, path, sizeof(path)) &&
+                access(path, R_OK) == 0;
+      return 1;
     }
   }
 
-  if (!found) {
-    printf("Package %s not found in any repository.\n", package);
-    printf("Try running 'vicpkg update' first.\n");
-    return 1;
-  }
+  if (r->op != REL_ANY)
+    return 0;
 
-  if (!check_os_dependency(&info)) {
+  *cached = 0;
+  return find_legacy_package(plan->ctx, r->name, info);
+}
+
+int candidate_available(InstallPlan *plan, const Relation *r) {
+  char current[64];
+  int i = plan_find(plan, r->name);
+  if (i >= 0)
+    return relation_satisfied(r, plan->items[i].info.version);
+
+  status_installed_version(&plan->status, r->name, current, sizeof(current));
+  if (current[0] && relation_satisfied(r, current))
     return 1;
+
+  if (!plan->have_index)
+    return 0;
+  const PkgIndexEntry *e = find_index_entry(plan->ctx, &plan->idx, r->name);
+  for (; e; e = next_index_entry(plan->ctx, &plan->idx, e)) {
+    if (relation_satisfied(r, pkgindex_field(&plan->idx, e, IDX_VERSION)))
+      return 1;
   }
+  return 0;
+}
 
-  if (is_installed) {
-    FILE *f = fopen(version_file, "r");
-    if (f) {
-      char current_ver[64];
-      if (fgets(current_ver, sizeof(current_ver), f)) {
-        trim_string(current_ver);
-        if (strcmp(current_ver, info.version) == 0) {
-          printf("%s is already the newest version (%s).\n", package,
-                 info.version);
-          fclose(f);
-          return 0;
-        }
-        printf("The following packages will be upgraded:\n");
-        printf("  %s (%s -> %s)\n", package, current_ver, info.version);
+int add_plan_item(InstallPlan *plan) {
+  if (plan->count == plan->cap) {
+    int cap = plan->cap ? plan->cap * 2 : 16;
+    InstallItem *items = realloc(plan->items, cap * sizeof(InstallItem));
+    if (!items)
+      return -1;
+    plan->items = items;
+    int *order = realloc(plan->order, cap * sizeof(int));
+    if (!order)
+      return -1;
+    plan->order = order;
+    plan->cap = cap;
+  }
+  memset(&plan->items[plan->count], 0, sizeof(InstallItem));
+  return plan->count++;
+}
+
+int plan_package(InstallPlan *plan, const Relation *r, int requested,
+                 int *ordered);
+
+/* Plans the Depends of item `i`, recording an edge for each one planned. */
+int plan_dependencies(InstallPlan *plan, int i, int *ordered) {
+  char depends[sizeof(plan->items[i].info.depends)];
+  const char *cursor = depends;
+  Relation alts[RELATION_MAX_ALTERNATIVES];
+  int n;
+
+  snprintf(depends, sizeof(depends), "%s", plan->items[i].info.depends);
+  while ((n = relation_parse(&cursor, alts, RELATION_MAX_ALTERNATIVES)) != 0) {
+    if (n < 0) {
+      fprintf(stderr, "Ignoring malformed dependency of %s\n",
+              plan->items[i].name);
+      continue;
+    }
+
+    int choice = 0;
+    for (int a = 0; a < n; a++) {
+      if (candidate_available(plan, &alts[a])) {
+        choice = a;
+        break;
       }
-      fclose(f);
     }
-  } else {
-    printf("The following NEW packages will be installed:\n");
-    printf("  %s (%s)", package, info.version);
-    if (info.size > 0) {
-      printf(" [%s]", format_size(info.size));
+
+    int d = plan_package(plan, &alts[choice], 0, ordered);
+    if (d == PLAN_FAILED) {
+      char wanted[MAX_LINE];
+      relation_format(&alts[choice], wanted, sizeof(wanted));
+      printf("%s depends on %s, which cannot be installed.\n",
+             plan->items[i].name, wanted);
+      return 0;
     }
-    printf("\n");
+    if (d == PLAN_SATISFIED)
+      continue;
+
+    InstallItem *item = &plan->items[i];
+    if (plan->items[d].visiting) {
+      if (verbose_mode) {
+        printf("[VERBOSE] Dependency cycle between %s and %s\n", item->name,
+               plan->items[d].name);
+      }
+      continue;
+    }
+
+    int *deps = realloc(item->deps, (item->dep_count + 1) * sizeof(int));
+    if (!deps)
+      return 0;
+    item->deps = deps;
+    item->deps[item->dep_count++] = d;
   }
+  return 1;
+}
 
-  if (info.size > 0) {
-    printf("Need to download %s of archives.\n", format_size(info.size));
+/*
+ * Adds the package `r` names to the plan along with everything it depends
+ * on. Returns its item, PLAN_SATISFIED when nothing needs installing, or
+ * PLAN_FAILED.
+ */
+int plan_package(InstallPlan *plan, const Relation *r, int requested,
+                 int *ordered) {
+  int i = plan_find(plan, r->name);
+  if (i >= 0) {
+    if (relation_satisfied(r, plan->items[i].info.version)) {
+      plan->items[i].requested |= requested;
+      return i;
+    }
+    char wanted[MAX_LINE];
+    relation_format(r, wanted, sizeof(wanted));
+    printf("Cannot install %s: %s %s is to be installed.\n", wanted, r->name,
+           plan->items[i].info.version);
+    return PLAN_FAILED;
   }
 
-  if (!prompt_yes_no("Do you want to continue?")) {
-    printf("Abort.\n");
-    return 1;
+  char current[64];
+  status_installed_version(&plan->status, r->name, current, sizeof(current));
+  if (!requested && current[0] && relation_satisfied(r, current))
+    return PLAN_SATISFIED;
+
+  PackageInfo info;
+  int cached = 0;
+  memset(&info, 0, sizeof(info));
+  if (!choose_candidate(plan, r, &info, &cached)) {
+    if (r->op == REL_ANY) {
+      printf("Package %s not found in any repository.\n", r->name);
+      printf("Try running 'vicpkg update' first.\n");
+    } else {
+      char wanted[MAX_LINE];
+      relation_format(r, wanted, sizeof(wanted));
+      printf("No available version of %s satisfies %s.\n", r->name, wanted);
+    }
+    return PLAN_FAILED;
   }
 
-  if (simulate) {
-    printf("Would install %s version %s\n", package, info.version);
-    return 0;
+  if (!check_os_dependency(&info))
+    return PLAN_FAILED;
+
+  if (requested && strcmp(current, info.version) == 0 && !download_only) {
+    printf("%s is already the newest version (%s).\n", r->name, info.version);
+    return PLAN_SATISFIED;
   }
 
-  if (!quiet_mode)
-    printf("Installing %s (%s)...\n", package, info.version);
+  i = add_plan_item(plan);
+  if (i < 0) {
+    fprintf(stderr, "Out of memory\n");
+    return PLAN_FAILED;
+  }
 
-  char pkg_file[MAX_PATH];
-  if (info.is_legacy) {
-    snprintf(pkg_file, sizeof(pkg_file), "%s/%s.ppkg", CACHE_DIR, package);
-  } else {
-    snprintf(pkg_file, sizeof(pkg_file), "%s/%s.vpkg", CACHE_DIR, package);
+  InstallItem *item = &plan->items[i];
+  snprintf(item->name, sizeof(item->name), "%s", r->name);
+  snprintf(item->current, sizeof(item->current), "%s", current);
+  item->info = info;
+  item->legacy = info.is_legacy;
+  item->cached = cached;
+  item->requested = requested;
+  item->visiting = 1;
+
+  int ok = plan_dependencies(plan, i, ordered);
+  plan->items[i].visiting = 0;
+  if (!ok)
+    return PLAN_FAILED;
+
+  plan->order[(*ordered)++] = i;
+  return i;
+}
+
+/*
+ * Checks the Conflicts of every planned package against what will be
+ * installed afterwards, and those of installed packages against the plan.
+ */
+int check_conflicts_field(InstallPlan *plan, const char *package,
+                          const char *conflicts) {
+  const char *cursor = conflicts;
+  Relation alts[RELATION_MAX_ALTERNATIVES];
+  int n;
+  int ok = 1;
+
+  while ((n = relation_parse(&cursor, alts, RELATION_MAX_ALTERNATIVES)) != 0) {
+    for (int a = 0; a < n; a++) {
+      if (strcmp(alts[a].name, package) == 0)
+        continue;
+
+      char version[64];
+      int i = plan_find(plan, alts[a].name);
+      if (i >= 0)
+        snprintf(version, sizeof(version), "%s", plan->items[i].info.version);
+      else
+        status_installed_version(&plan->status, alts[a].name, version,
+                                 sizeof(version));
+
+      if (version[0] && relation_satisfied(&alts[a], version)) {
+        printf("%s conflicts with %s %s.\n", package, alts[a].name, version);
+        ok = 0;
+      }
+    }
   }
+  return ok;
+}
 
-  if (download_only) {
-    printf("Downloaded to: %s\n", pkg_file);
-    return 0;
+int check_plan_conflicts(InstallPlan *plan) {
+  int ok = 1;
+
+  for (int i = 0; i < plan->count; i++) {
+    if (!check_conflicts_field(plan, plan->items[i].name,
+                               plan->items[i].info.conflicts))
+      ok = 0;
   }
 
-  int extract_success = 0;
-  
-  if (info.is_legacy) {
-    extract_success = extract_legacy_package(pkg_file, package);
-  } else {
-    char temp_dir[MAX_PATH];
-    snprintf(temp_dir, sizeof(temp_dir), "%s/temp_extract", CACHE_DIR);
-    
-    extract_success = extract_package_to_root(pkg_file);
-    
-    if (extract_success) {
-      save_package_list(package, temp_dir);
-      
-      char cmd[MAX_PATH];
-      snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-      system(cmd);
+  if (!plan->have_index)
+    return ok;
+
+  for (int i = 0; i < status_count(&plan->status); i++) {
+    const StatusEntry *s = &plan->status.entries[i];
+    const char *name = status_string(&plan->status, s->name);
+    const char *current = status_string(&plan->status, s->version);
+    if (plan_find(plan, name) >= 0)
+      continue;
+
+    const PkgIndexEntry *e = find_index_entry(plan->ctx, &plan->idx, name);
+    for (; e; e = next_index_entry(plan->ctx, &plan->idx, e)) {
+      if (strcmp(pkgindex_field(&plan->idx, e, IDX_VERSION), current) != 0)
+        continue;
+      if (!check_conflicts_field(plan, name,
+                                 pkgindex_field(&plan->idx, e, IDX_CONFLICTS)))
+        ok = 0;
+      break;
     }
   }
+  return ok;
+}
 
-  if (!extract_success) {
-    fprintf(stderr, "Failed to extract %s\n", package);
-    remove(pkg_file);
-    return 1;
+void free_install_plan(InstallPlan *plan) {
+  for (int i = 0; i < plan->count; i++)
+    free(plan->items[i].deps);
+  free(plan->items);
+  free(plan->order);
+  if (plan->have_index)
+    pkgindex_close(&plan->idx);
+  status_close(&plan->status);
+}
+
+/* Reports a failed or downloaded package; called with the lock held. */
+void finish_install_item(InstallItem *item) {
+  if (!item->ok) {
+    if (!item->skipped)
+      fprintf(stderr, "Failed to %s %s\n",
+              download_only ? "download" : "extract", item->name);
+    return;
   }
 
-  if (info.is_legacy) {
-    char version_tmp[MAX_PATH];
-    char flist_tmp[MAX_PATH];
-    snprintf(version_tmp, sizeof(version_tmp), "%s/%s.version.tmp", CACHE_DIR, package);
-    snprintf(flist_tmp, sizeof(flist_tmp), "%s/%s.flist.tmp", CACHE_DIR, package);
-    remove(version_tmp);
-    remove(flist_tmp);
+  if (download_only) {
+    char path[MAX_PATH];
+    if (item->legacy)
+      legacy_archive_path(item->name, path, sizeof(path));
+    else
+      package_archive_path(&item->info, item->name, path, sizeof(path));
+    printf("Downloaded to: %s\n", path);
   }
+}
 
-  FILE *f = fopen(version_file, "w");
-  if (f) {
-    fprintf(f, "%s\n", info.version);
-    fclose(f);
+/*
+ * Returns the first dependency of `item` that failed, -1 if all of them are
+ * installed, or -2 while some are still in progress. Called with the lock
+ * held.
+ */
+int dependency_state(const InstallPlan *plan, const InstallItem *item) {
+  int pending = 0;
+  for (int i = 0; i < item->dep_count; i++) {
+    const InstallItem *dep = &plan->items[item->deps[i]];
+    if (dep->done && !dep->ok)
+      return item->deps[i];
+    if (!dep->done)
+      pending = 1;
+  }
+  return pending ? -2 : -1;
+}
+
+/* Holds back a staged package until everything it depends on is in place. */
+int wait_for_dependencies(void *user) {
+  InstallJob *job = user;
+  InstallQueue *q = job->queue;
+  int state;
+
+  pthread_mutex_lock(&q->lock);
+  while ((state = dependency_state(q->plan, job->item)) == -2)
+    pthread_cond_wait(&q->changed, &q->lock);
+  if (state >= 0) {
+    printf("Skipping %s: dependency %s was not installed.\n", job->item->name,
+           q->plan->items[state].name);
+    job->item->skipped = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return state == -1;
+}
+
+void complete_install_item(InstallQueue *q, InstallItem *item) {
+  pthread_mutex_lock(&q->lock);
+  finish_install_item(item);
+  item->done = 1;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Workers take packages in dependency order, so anything an item waits on
+ * has already been picked up; downloads of dependents proceed meanwhile and
+ * only their staging is confirmed once the dependencies are staged.
+ */
+void *install_worker(void *arg) {
+  InstallQueue *q = arg;
+  InstallPlan *plan = q->plan;
+
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    int pos = q->next;
+    while (pos < plan->count && plan->items[plan->order[pos]].legacy)
+      pos++;
+    q->next = pos + 1;
+
+    InstallItem *item = pos < plan->count ? &plan->items[plan->order[pos]]
+                                          : NULL;
+    int failed_dep = item ? dependency_state(plan, item) : -1;
+    if (item && failed_dep < 0 && !quiet_mode && !download_only) {
+      printf("Installing %s (%s)...\n", item->name, item->info.version);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (!item)
+      break;
+
+    if (failed_dep >= 0 && !download_only) {
+      pthread_mutex_lock(&q->lock);
+      printf("Skipping %s: dependency %s was not installed.\n", item->name,
+             plan->items[failed_dep].name);
+      item->skipped = 1;
+      item->done = 1;
+      pthread_cond_broadcast(&q->changed);
+      pthread_mutex_unlock(&q->lock);
+      continue;
+    }
+
+    InstallJob job = {q, item};
+    StageTarget target = {&q->journal, wait_for_dependencies, &job, NULL};
+    int span = trace_begin("package", item->name);
+    item->ok = fetch_package(plan->ctx, item->name, &item->info,
+                             download_only ? NULL : &target);
+    item->staged = target.staged;
+    trace_end(span);
+    complete_install_item(q, item);
   }
+  return NULL;
+}
 
-  remove(pkg_file);
+void install_legacy_item(InstallItem *item) {
+  char url[MAX_PATH];
+  int n = snprintf(url, sizeof(url), "%s/%s/%s.ppkg", item->info.repo,
+                   item->name, item->name);
+  if (n < 0 || n >= (int)sizeof(url)) {
+    fprintf(stderr, "URL of %s is too long\n", item->name);
+    item->ok = 0;
+    return;
+  }
+
+  if (download_only) {
+    char pkg_file[MAX_PATH];
+    legacy_archive_path(item->name, pkg_file, sizeof(pkg_file));
+    item->ok = download_file(url, pkg_file);
+    return;
+  }
 
   if (!quiet_mode)
-    printf("Package %s installed successfully.\n", package);
+    printf("Installing %s (%s)...\n", item->name, item->info.version);
+
+  int span = trace_begin("package", item->name);
+  char *files;
+  item->ok = install_legacy_package(url, item->name, &files);
+
+  if (item->ok) {
+    StatusEdit edit;
+    int commit = trace_begin("commit", item->name);
+    status_lock();
+    item->ok = edit_installed(&edit, item->name, &item->info, files) &&
+               status_edit_save(&edit);
+    status_edit_free(&edit);
+    status_unlock();
+    trace_end(commit);
+    free(files);
+  }
+  trace_end(span);
+}
 
-  if (!quiet_mode && info.is_legacy)
-    check_path_warning(package);
+/* Drops a staged package from the transaction. */
+void discard_install_item(InstallItem *item) {
+  extractor_abort(item->staged);
+  extractor_free(item->staged);
+  item->staged = NULL;
+  item->ok = 0;
+}
 
-  return 0;
+/*
+ * Commits the staged packages of a plan as one transaction. The database
+ * update is staged with the first of them, a single journal_commit() makes
+ * everything durable, and only then are the packages renamed into place,
+ * dependencies first. A package that cannot be recorded is dropped together
+ * with whatever depends on it.
+ */
+void commit_install_plan(InstallPlan *plan, Journal *journal) {
+  StatusEdit edit;
+  StatusDB db;
+  Extractor *first = NULL;
+  size_t len = 0;
+  char *image = NULL;
+
+  int span = trace_begin("commit", NULL);
+  status_lock();
+  status_open(&db);
+  int ok = status_edit_load(&edit, &db);
+  for (int pos = 0; pos < plan->count; pos++) {
+    InstallItem *item = &plan->items[plan->order[pos]];
+    if (!item->staged)
+      continue;
+
+    int failed_dep = dependency_state(plan, item);
+    if (failed_dep >= 0) {
+      printf("Skipping %s: dependency %s was not installed.\n", item->name,
+             plan->items[failed_dep].name);
+      item->skipped = 1;
+      discard_install_item(item);
+    } else if (!ok ||
+               !record_installed(&edit, &db, item->name, &item->info,
+                                 extractor_package_list(item->staged))) {
+      fprintf(stderr, "Failed to install %s\n", item->name);
+      discard_install_item(item);
+    } else if (!first) {
+      first = item->staged;
+    }
+  }
+  status_close(&db);
+
+  if (first) {
+    image = status_edit_image(&edit, &len);
+    ok = image && extractor_stage_file(first, STATUS_FILE, image, len);
+    for (int pos = 0; ok && pos < plan->count; pos++) {
+      const InstallItem *item = &plan->items[plan->order[pos]];
+      if (item->staged)
+        ok = journal_add_package(journal, item->name);
+    }
+    if (ok && !journal_commit(journal)) {
+      fprintf(stderr, "Failed to write journal %s\n", journal->path);
+      ok = 0;
+    }
+  }
+  status_edit_free(&edit);
+  free(image);
+
+  int committed = 1;
+  for (int pos = 0; pos < plan->count; pos++) {
+    InstallItem *item = &plan->items[plan->order[pos]];
+    if (!item->staged)
+      continue;
+    if (!ok) {
+      fprintf(stderr, "Failed to install %s\n", item->name);
+      discard_install_item(item);
+      continue;
+    }
+    if (!extractor_commit(item->staged)) {
+      item->ok = 0;
+      committed = 0;
+    }
+    extractor_free(item->staged);
+    item->staged = NULL;
+  }
+
+  if (committed) {
+    journal_remove(journal);
+  } else {
+    journal_close(journal);
+    fprintf(stderr, "The install will be completed at the next start\n");
+  }
+  status_unlock();
+  trace_end(span);
 }
 
-int cmd_upgrade_package(VicPkgContext *ctx, const char *package) {
-  char version_file[MAX_PATH];
-  snprintf(version_file, sizeof(version_file), "%s/%s", VERSIONS_DIR, package);
+void print_install_plan(const InstallPlan *plan) {
+  const InstallItem *items = plan->items;
+  int count = plan->count;
+  long download = 0;
+  long unpacked = 0;
+  int upgrades = 0;
+  int installs = 0;
+  int additional = 0;
 
-  if (access(version_file, F_OK) != 0) {
-    printf("Package %s is not installed.\n", package);
-    return 1;
+  for (int i = 0; i < count; i++) {
+    if (items[i].requested)
+      continue;
+    if (additional++ == 0)
+      printf("The following additional packages will be installed:\n");
+    printf("  %s (%s)\n", items[i].name, items[i].info.version);
   }
 
-  return cmd_install_package(ctx, package);
+  for (int i = 0; i < count; i++) {
+    if (items[i].current[0] == '\0')
+      continue;
+    if (upgrades++ == 0)
+      printf("The following packages will be upgraded:\n");
+    printf("  %s (%s -> %s)\n", items[i].name, items[i].current,
+           items[i].info.version);
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (items[i].current[0] != '\0')
+      continue;
+    if (installs++ == 0)
+      printf("The following NEW packages will be installed:\n");
+    printf("  %s (%s)", items[i].name, items[i].info.version);
+    if (items[i].info.size > 0) {
+      printf(" [%s]", format_size(items[i].info.size));
+    }
+    printf("\n");
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (!items[i].cached && items[i].info.size > 0)
+      download += items[i].info.size;
+    unpacked += items[i].info.installed_size;
+  }
+
+  if (count > 1) {
+    printf("%d upgraded, %d newly installed.\n", upgrades, installs);
+  }
+  if (download > 0) {
+    printf("Need to download %s of archives.\n", format_size(download));
+  }
+  if (unpacked > 0) {
+    printf("After unpacking, %s of disk space will be used.\n",
+           format_size(unpacked));
+  }
 }
 
-int cmd_upgrade_all(VicPkgContext *ctx) {
-  printf("Checking for upgrades...\n");
+int run_install_plan(InstallPlan *plan) {
+  InstallQueue queue;
+  pthread_t workers[INSTALL_WORKERS];
+  int worker_count = 0;
+  int remote = 0;
+
+  for (int i = 0; i < plan->count; i++)
+    remote += !plan->items[i].legacy;
 
-  DIR *dir = opendir(VERSIONS_DIR);
-  if (!dir) {
-    fprintf(stderr, "Failed to open %s\n", VERSIONS_DIR);
+  /* Every package the workers stage is committed under this one journal. */
+  if (remote > 0 && !download_only && !journal_begin(&queue.journal, "install"))
     return 1;
+
+  queue.plan = plan;
+  queue.next = 0;
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.changed, NULL);
+
+  while (worker_count < INSTALL_WORKERS && worker_count < remote) {
+    if (pthread_create(&workers[worker_count], NULL, install_worker,
+                       &queue) != 0)
+      break;
+    worker_count++;
   }
 
-  char packages[100][256];
-  int package_count = 0;
+  /* Legacy archives stream in on this thread while the workers run. */
+  for (int pos = 0; pos < plan->count; pos++) {
+    InstallItem *item = &plan->items[plan->order[pos]];
+    if (!item->legacy)
+      continue;
+    install_legacy_item(item);
+    complete_install_item(&queue, item);
+  }
+
+  if (worker_count == 0 && remote > 0) {
+    install_worker(&queue);
+  }
+  for (int i = 0; i < worker_count; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_cond_destroy(&queue.changed);
+  pthread_mutex_destroy(&queue.lock);
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_name[0] != '.') {
-      strncpy(packages[package_count], entry->d_name, sizeof(packages[0]) - 1);
-      package_count++;
+  if (remote > 0 && !download_only)
+    commit_install_plan(plan, &queue.journal);
+
+  int result = 0;
+  for (int pos = 0; pos < plan->count; pos++) {
+    InstallItem *item = &plan->items[plan->order[pos]];
+    if (!item->ok) {
+      result = 1;
+    } else if (!quiet_mode && !download_only) {
+      printf("Package %s installed successfully.\n", item->name);
+      if (item->legacy)
+        check_path_warning(item->name);
     }
   }
-  closedir(dir);
+  return result;
+}
 
-  if (package_count == 0) {
-    printf("No packages installed.\n");
-    return 0;
+/*
+ * Installs several packages as one transaction: the requested packages and
+ * their dependencies are resolved against the index and shown as a single
+ * plan with one prompt, then installed by a bounded pool of workers in
+ * dependency order, each streaming its archive into the extractor as it
+ * arrives.
+ */
+void open_install_plan(InstallPlan *plan, VicPkgContext *ctx) {
+  memset(plan, 0, sizeof(InstallPlan));
+  plan->ctx = ctx;
+  plan->have_index = open_package_index(&plan->idx);
+  status_open(&plan->status);
+}
+
+/* Shows the plan, asks for confirmation and runs it. Frees the plan. */
+int confirm_install_plan(InstallPlan *plan) {
+  int result;
+
+  print_install_plan(plan);
+
+  if (!prompt_yes_no("Do you want to continue?")) {
+    printf("Abort.\n");
+    free_install_plan(plan);
+    return 1;
   }
 
-  int upgrades = 0;
-  for (int i = 0; i < package_count; i++) {
-    PackageInfo info;
-    int found = 0;
-
-    for (int j = 0; j < ctx->repo_count; j++) {
-      if (ctx->repo_priority[j] >= 100) {
-        char packages_file[MAX_PATH];
-        snprintf(packages_file, sizeof(packages_file), "%s/Packages_%d",
-                 CACHE_DIR, j);
-
-        if (parse_packages_file(packages_file, packages[i], &info)) {
-          found = 1;
-          break;
-        }
-      }
+  if (simulate) {
+    for (int pos = 0; pos < plan->count; pos++) {
+      const InstallItem *item = &plan->items[plan->order[pos]];
+      printf("Would install %s version %s\n", item->name, item->info.version);
     }
+    free_install_plan(plan);
+    return 0;
+  }
 
-    if (found) {
-      char version_file[MAX_PATH];
-      snprintf(version_file, sizeof(version_file), "%s/%s", VERSIONS_DIR,
-               packages[i]);
+  time_t started = time(NULL);
+  int span = trace_begin("run plan", NULL);
+  result = run_install_plan(plan);
+  trace_end(span);
+  free_install_plan(plan);
 
-      FILE *f = fopen(version_file, "r");
-      if (f) {
-        char current_ver[64];
-        if (fgets(current_ver, sizeof(current_ver), f)) {
-          trim_string(current_ver);
-          if (strcmp(current_ver, info.version) != 0) {
-            printf("  %s (%s -> %s)\n", packages[i], current_ver, info.version);
-            upgrades++;
-          }
-        }
-        fclose(f);
+  /* Only now may the store shrink, and never by what this run used. */
+  store_trim(store_cap(), started, NULL, NULL);
+  return result;
+}
+
+int cmd_install_packages(VicPkgContext *ctx, char **packages, int count) {
+  InstallPlan plan;
+  int ordered = 0;
+  int result = 0;
+
+  open_install_plan(&plan, ctx);
+  int span = trace_begin("plan", NULL);
+
+  for (int i = 0; i < count; i++) {
+    const char *cursor = packages[i];
+    Relation r;
+
+    /* Requests may pin a version, e.g. "ffmpeg (>= 8.0)" or "ffmpeg=8.0.1". */
+    char request[MAX_LINE];
+    snprintf(request, sizeof(request), "%s", packages[i]);
+    char *eq = strchr(request, '=');
+    if (eq && !strchr(request, '(') && eq > request && eq[-1] != '<' &&
+        eq[-1] != '>') {
+      *eq = '\0';
+      if (strlen(request) >= sizeof(r.name) ||
+          strlen(eq + 1) >= sizeof(r.version)) {
+        printf("Invalid package request: %s\n", packages[i]);
+        result = 1;
+        continue;
+      }
+      snprintf(r.version, sizeof(r.version), "%s", eq + 1);
+      snprintf(r.name, sizeof(r.name), "%s", request);
+      r.op = REL_EQ;
+    } else {
+      cursor = request;
+      if (relation_parse(&cursor, &r, 1) != 1) {
+        printf("Invalid package request: %s\n", packages[i]);
+        result = 1;
+        continue;
       }
     }
+
+    if (plan_package(&plan, &r, 1, &ordered) == PLAN_FAILED)
+      result = 1;
   }
 
-  if (upgrades == 0) {
-    printf("All packages are up to date.\n");
-    return 0;
+  if (result == 0 && !check_plan_conflicts(&plan))
+    result = 1;
+  trace_end(span);
+
+  if (result != 0 || plan.count == 0) {
+    free_install_plan(&plan);
+    return result;
   }
 
-  printf("%d package(s) can be upgraded.\n", upgrades);
+  return confirm_install_plan(&plan);
+}
 
-  if (!prompt_yes_no("Do you want to continue?")) {
-    printf("Abort.\n");
+int cmd_install_package(VicPkgContext *ctx, const char *package) {
+  char *packages[1] = {(char *)package};
+  return cmd_install_packages(ctx, packages, 1);
+}
+
+/*
+ * Finds the newest version of every installed package in one pass over the
+ * index. best[i] is left NULL unless status entry i has a newer candidate;
+ * among equal versions the higher priority repository wins.
+ */
+void find_upgrades(InstallPlan *plan, const PkgIndexEntry **best) {
+  for (uint32_t i = 0; plan->have_index && i < plan->idx.hdr->entry_count;
+       i++) {
+    const PkgIndexEntry *e = &plan->idx.entries[i];
+    if ((e->flags & PKGINDEX_FLAG_LEGACY) ||
+        !repo_is_configured(plan->ctx, pkgindex_repo(&plan->idx, e)))
+      continue;
+
+    const StatusEntry *s =
+        status_lookup(&plan->status, pkgindex_field(&plan->idx, e, IDX_PACKAGE));
+    if (!s)
+      continue;
+
+    int k = (int)(s - plan->status.entries);
+    const char *version = pkgindex_field(&plan->idx, e, IDX_VERSION);
+    if (compare_versions(version, status_string(&plan->status, s->version)) <= 0)
+      continue;
+    if (!best[k] ||
+        compare_versions(version,
+                         pkgindex_field(&plan->idx, best[k], IDX_VERSION)) > 0)
+      best[k] = e;
+  }
+}
+
+/*
+ * Upgrades the named installed packages, or all of them when `count` is 0,
+ * to their newest available versions in a single transaction.
+ */
+int cmd_upgrade_packages(VicPkgContext *ctx, char **packages, int count) {
+  InstallPlan plan;
+  int ordered = 0;
+  int result = 0;
+
+  if (count == 0)
+    printf("Checking for upgrades...\n");
+
+  open_install_plan(&plan, ctx);
+  if (!plan.have_index) {
+    printf("No package lists available. Try running 'vicpkg update' first.\n");
+    free_install_plan(&plan);
     return 1;
   }
 
-  for (int i = 0; i < package_count; i++) {
-    cmd_upgrade_package(ctx, packages[i]);
+  int installed = status_count(&plan.status);
+  if (count == 0 && installed == 0) {
+    printf("No packages installed.\n");
+    free_install_plan(&plan);
+    return 0;
   }
 
-  return 0;
+  int span = trace_begin("plan", NULL);
+  const PkgIndexEntry **best = calloc(installed ? installed : 1,
+                                      sizeof(PkgIndexEntry *));
+  if (!best) {
+    fprintf(stderr, "Out of memory\n");
+    free_install_plan(&plan);
+    return 1;
+  }
+  find_upgrades(&plan, best);
+
+  for (int i = 0; i < (count ? count : installed); i++) {
+    const StatusEntry *s = count ? status_lookup(&plan.status, packages[i])
+                                 : &plan.status.entries[i];
+    if (!s) {
+      printf("Package %s is not installed.\n", packages[i]);
+      result = 1;
+      continue;
+    }
+
+    int k = (int)(s - plan.status.entries);
+    Relation r;
+    memset(&r, 0, sizeof(r));
+    snprintf(r.name, sizeof(r.name), "%s", status_string(&plan.status, s->name));
+
+    if (best[k]) {
+      r.op = REL_EQ;
+      snprintf(r.version, sizeof(r.version), "%s",
+               pkgindex_field(&plan.idx, best[k], IDX_VERSION));
+    } else if (count && (s->flags & STATUS_FLAG_LEGACY)) {
+      /* Legacy packages are unversioned; fetch whatever is there now. */
+      r.op = REL_ANY;
+    } else {
+      if (count)
+        printf("%s is already the newest version (%s).\n", r.name,
+               status_string(&plan.status, s->version));
+      continue;
+    }
+
+    if (plan_find(&plan, r.name) >= 0)
+      continue;
+    if (plan_package(&plan, &r, 1, &ordered) == PLAN_FAILED)
+      result = 1;
+  }
+  free(best);
+
+  if (result == 0 && !check_plan_conflicts(&plan))
+    result = 1;
+  trace_end(span);
+
+  if (result != 0 || plan.count == 0) {
+    if (result == 0 && count == 0)
+      printf("All packages are up to date.\n");
+    free_install_plan(&plan);
+    return result;
+  }
+
+  return confirm_install_plan(&plan);
 }
 
 int main(int argc, char *argv[]) {
 
   int arg_start = 1;
+  int timings = 0;
+  const char *trace_file = NULL;
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
       verbose_mode = 1;
@@ -1741,6 +3464,10 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(argv[i], "--version") == 0) {
       show_version();
       return 0;
+    } else if (strcmp(argv[i], "--timings") == 0) {
+      timings = 1;
+    } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+      trace_file = argv[++i];
     } else if (argv[i][0] != '-') {
       arg_start = i;
       break;
@@ -1752,10 +3479,16 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
+  if (timings || trace_file)
+    trace_start();
+  int span = trace_begin(argv[arg_start], NULL);
+
   VicPkgContext ctx;
-  init_context(&ctx);
+  if (!init_context(&ctx, command_needs(argv[arg_start]))) {
+    return 1;
+  }
 
-  if (chdir(VICPKG_DIR) != 0) {
+  if (chdir(VICPKG_DIR) != 0 && (ctx.needs & NEED_SETUP)) {
     fprintf(stderr, "Failed to change to %s\n", VICPKG_DIR);
     cleanup_context(&ctx);
     return 1;
@@ -1767,17 +3500,26 @@ int main(int argc, char *argv[]) {
   if (strcmp(action, "update") == 0) {
     result = cmd_update(&ctx);
   } else if (strcmp(action, "upgrade") == 0) {
-    if (arg_start + 1 < argc && argv[arg_start + 1][0] != '-') {
-      result = cmd_upgrade_package(&ctx, argv[arg_start + 1]);
-    } else {
-      result = cmd_upgrade_all(&ctx);
+    char *packages[argc];
+    int count = 0;
+    for (int i = arg_start + 1; i < argc; i++) {
+      if (argv[i][0] != '-') {
+        packages[count++] = argv[i];
+      }
     }
+    result = cmd_upgrade_packages(&ctx, packages, count);
   } else if (strcmp(action, "search") == 0 && arg_start + 1 < argc) {
     result = cmd_search(&ctx, argv[arg_start + 1]);
   } else if (strcmp(action, "show") == 0 && arg_start + 1 < argc) {
     result = cmd_show(&ctx, argv[arg_start + 1]);
+  } else if (strcmp(action, "owns") == 0 && arg_start + 1 < argc) {
+    result = cmd_owns(argv[arg_start + 1]);
   } else if (strcmp(action, "list") == 0) {
     result = cmd_list_installed();
+  } else if (strcmp(action, "clean") == 0) {
+    result = cmd_clean();
+  } else if (strcmp(action, "autoclean") == 0) {
+    result = cmd_autoclean();
   } else if (strcmp(action, "repo-list") == 0) {
     result = cmd_list_repos(&ctx);
   } else if (strcmp(action, "repo-add") == 0 && arg_start + 1 < argc) {
@@ -1793,13 +3535,14 @@ int main(int argc, char *argv[]) {
       }
     }
   } else if (strcmp(action, "install") == 0 && arg_start + 1 < argc) {
+    char *packages[argc];
+    int count = 0;
     for (int i = arg_start + 1; i < argc; i++) {
       if (argv[i][0] != '-') {
-        if (cmd_install_package(&ctx, argv[i]) != 0) {
-          result = 1;
-        }
+        packages[count++] = argv[i];
       }
     }
+    result = cmd_install_packages(&ctx, packages, count);
   } else {
     fprintf(stderr, "Unknown action or missing arguments: %s\n", action);
     show_usage();
@@ -1807,5 +3550,13 @@ int main(int argc, char *argv[]) {
   }
 
   cleanup_context(&ctx);
+  trace_end(span);
+
+  if (timings)
+    trace_print_timings(stderr);
+  if (trace_file && !trace_write_file(trace_file)) {
+    fprintf(stderr, "Failed to write trace to %s\n", trace_file);
+    result = 1;
+  }
   return result;
 }
\ No newline at end of file
@@ -0,0 +1,111 @@
+#ifndef VICPKG_H
+#define VICPKG_H
+
+/* Overridable so host builds (see `make bench`) can run in a sandbox. */
+#ifndef VICPKG_DIR
+#define VICPKG_DIR "/data/vicpkg"
+#endif
+#ifndef CPU_FREQ_FILE
+#define CPU_FREQ_FILE "/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq"
+#endif
+#define VERSIONS_DIR VICPKG_DIR "/versions"
+#define FILES_DIR VICPKG_DIR "/files"
+#define CACHE_DIR VICPKG_DIR "/cache"
+#define LEGACY_INSTALL_DIR VICPKG_DIR "/legacy/installed"
+/* Where legacy packages expect to live; rewritten to their install dir. */
+#define LEGACY_PREFIX "/data/purplpkg"
+#define BIN_DIR VICPKG_DIR "/bin"
+#define REPOS_FILE VICPKG_DIR "/repos.list"
+#define STATUS_FILE VICPKG_DIR "/status.db"
+#define REPO_CACHE_FILE CACHE_DIR "/repos.cache"
+#define PACKAGE_INDEX_FILE CACHE_DIR "/packages.idx"
+#define ARCHIVE_DIR CACHE_DIR "/archives"
+#define JOURNAL_DIR VICPKG_DIR "/journal"
+#define LOCK_FILE VICPKG_DIR "/lock"
+#define STAGED_SUFFIX ".vicpkg-new"
+#define STORE_DEFAULT_CAP (128LL * 1024 * 1024)
+#define VICPKG_VERSION "1.0.0"
+#define MAX_REPOS 10
+#define MAX_PATH 512
+#define MAX_LINE 2048
+#define INSTALL_ROOT "/"
+#define REPO_PROBE_TIMEOUT_MS 5000
+/* A probe gives up after this long in all, however slowly it is answered. */
+#define REPO_PROBE_DEADLINE_MS 8000
+#define INSTALL_WORKERS 4
+#define REWRITE_WORKERS 4
+/* Archives at least this large are fetched in ranges from every mirror. */
+#define SEGMENT_MIN_SIZE (8LL * 1024 * 1024)
+#define SEGMENT_SIZE (1024 * 1024)
+#define SEGMENT_WORKERS 4
+/* Interrupted downloads resume after a pause that doubles while stalled. */
+#define FETCH_RETRIES 3
+#define FETCH_BACKOFF_MS 500
+
+#define REPO_FAILED 0
+#define REPO_UNCHANGED 1
+#define REPO_UPDATED 2
+
+/* What a command needs set up before it runs; see init_context(). */
+#define NEED_SETUP 1u
+#define NEED_STATE 2u
+#define NEED_REPOS 4u
+#define NEED_PROBE 8u
+#define NEED_BOOST 16u
+#define NEED_WRITE 32u
+
+extern int verbose_mode;
+extern int assume_yes;
+extern int quiet_mode;
+extern int download_only;
+extern int simulate;
+
+typedef struct {
+  char date[64];
+  char release_hash[65];
+  char release_etag[128];
+  char release_modified[64];
+  int release_gated;
+  char list_hash[65];
+  char list_etag[128];
+  char list_modified[64];
+
+  /* Result of this run's Release probe; committed once the list is fresh. */
+  int probe_status;
+  char *release;
+  char fetched_hash[65];
+  char fetched_etag[128];
+  char fetched_modified[64];
+} RepoState;
+
+typedef struct {
+  char *repos[MAX_REPOS];
+  int repo_count;
+  int repo_priority[MAX_REPOS];
+  RepoState repo_state[MAX_REPOS];
+  int repos_probed;
+  unsigned needs;
+} VicPkgContext;
+
+typedef struct {
+  char package[256];
+  char version[64];
+  char architecture[64];
+  char filename[512];
+  char description[512];
+  char name[256];
+  long size;
+  int is_legacy;
+  char depends_os[64];
+  char depends_os_version[64];
+  char sha256[65];
+  long installed_size;
+  char depends[512];
+  char conflicts[512];
+  char repo[MAX_PATH];
+} PackageInfo;
+
+void trim_string(char *str);
+int compare_versions(const char *v1, const char *v2);
+
+#endif